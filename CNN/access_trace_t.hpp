@@ -0,0 +1,332 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <iomanip>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+#include "cache_sim_t.hpp"
+
+class access_trace_t
+{
+public:
+	/*
+	  access_trace_t records the memory accesses the layers make
+	  through tensor_t, so you can study how a loop order uses
+	  the cache without any outside tools.
+
+	  It only sees anything in builds compiled with
+	  -DTRACE_TENSOR_ACCESSES.  Those builds send every
+	  tensor_t::get() (and so operator()) and as_vector() here:
+	  which tensor, which address, and whether it was a read or
+	  a write.  We can't see what happens through a `T&`, so
+	  accesses through a const tensor are reads, and for the
+	  rest we check whether the element changed by the time of
+	  the next access.  That misses writes that store the value
+	  that was already there, and ones that happen after another
+	  access in the same expression (e.g., `a(i) += b(i)` may
+	  count as a read of `a`).  Accesses through `data` directly
+	  aren't seen at all.
+
+	  Between start() and stop(), accesses go to a cache_sim_t,
+	  and we count which level served each one, by layer, phase,
+	  and tensor.  model_t tells us which layer and phase is
+	  running (through profiler_t::scope_t), and
+	  model_t::label_tensors() names the tensors, so report()
+	  can say things like "layer 0 calc_grads, L0 filters: 97%
+	  L1 hits".  You can also keep the first accesses of the raw
+	  stream (see stream()).
+
+	  It's one global recorder for one simulated cache, so trace
+	  one thread at a time.
+	*/
+	struct access_t {
+		uint32_t tensor; // See tensor_name().
+		uint64_t address;
+		bool write;
+	};
+
+	struct stats_t {
+		uint64_t reads = 0;
+		uint64_t writes = 0;
+		std::vector<uint64_t> served; // By cache level, then memory.
+	};
+
+	// Start recording into `cache` (which we don't own), and keep
+	// the first `keep` accesses of the raw stream.
+	static void start(cache_sim_t * cache, size_t keep = 0) {
+		state_t & s = state();
+		s.cache = cache;
+		s.keep = keep;
+		s.on = true;
+	}
+
+	static void stop() {
+		resolve();
+		state().on = false;
+	}
+
+	static bool enabled() {
+		return state().on;
+	}
+
+	// Forget the stream and the counts, but not the labels.
+	static void clear() {
+		state_t & s = state();
+		s.pending.address = nullptr;
+		s.stats.clear();
+		s.stream.clear();
+		s.last = nullptr;
+	}
+
+	// Forget the labels and tensors too, since the tensors we
+	// know may be gone, and their addresses reused.
+	static void reset() {
+		clear();
+		state_t & s = state();
+		s.ids.clear();
+		s.names.clear();
+		s.layer_names.clear();
+	}
+
+	// Call `tensor` `name` in the report.  Tensors with the same
+	// name are counted together.
+	static void label(const void * tensor, const std::string & name) {
+		state_t & s = state();
+		s.names[id(tensor)] = name;
+	}
+
+	static void name_layer(int layer, const std::string & name) {
+		state().layer_names[layer] = name;
+	}
+
+	// Count accesses from now on against `layer` and `phase` (-1
+	// for outside any layer).
+	static void set_context(int layer, int phase) {
+		resolve();
+		state_t & s = state();
+		s.layer = layer;
+		s.phase = phase;
+		s.last = nullptr;
+	}
+
+	// Record an access to `bytes` bytes at `address` in
+	// `tensor`.  If `may_write` is set, it's a write if those
+	// bytes have changed by the next record().
+	static void record(const void * tensor, const void * address, size_t bytes, bool may_write) {
+		state_t & s = state();
+		if (!s.on) {
+			return;
+		}
+		resolve();
+		uint32_t t = id(tensor);
+		long stream_index = -1;
+		if (s.stream.size() < s.keep) {
+			stream_index = s.stream.size();
+			s.stream.push_back({t, (uint64_t)address, false});
+		}
+		if (!s.last || s.last_tensor != t) {
+			stats_t & st = s.stats[std::make_tuple(s.layer, s.phase, t)];
+			if (st.served.empty()) {
+				st.served.resize(s.cache ? s.cache->config.size() + 1 : 1);
+			}
+			s.last = &st;
+			s.last_tensor = t;
+		}
+		s.last->reads++;
+		if (may_write) {
+			s.pending.address = address;
+			s.pending.bytes = std::min(bytes, sizeof(s.pending.old));
+			memcpy(s.pending.old, address, s.pending.bytes);
+			s.pending.stats = s.last;
+			s.pending.stream_index = stream_index;
+		}
+		if (!s.cache) {
+			return;
+		}
+		// Charge the access to the slowest level any of its
+		// lines came from.
+		uint64_t line = s.cache->line_size();
+		int level = 0;
+		for (uint64_t a = (uint64_t)address & ~(line - 1); a < (uint64_t)address + bytes; a += line) {
+			level = std::max(level, s.cache->access(a, false));
+		}
+		s.last->served[level]++;
+	}
+
+	static const std::vector<access_t> & stream() {
+		return state().stream;
+	}
+
+	static std::string tensor_name(uint32_t tensor) {
+		state_t & s = state();
+		auto n = s.names.find(tensor);
+		return n == s.names.end() ? "tensor " + std::to_string(tensor) : n->second;
+	}
+
+	// Counts for each layer, phase, and tensor name.  Layer and
+	// phase are -1 for accesses outside any layer.
+	static std::map<std::tuple<int, int, std::string>, stats_t> totals() {
+		std::map<std::tuple<int, int, std::string>, stats_t> t;
+		for (auto & i: state().stats) {
+			stats_t & to = t[std::make_tuple(std::get<0>(i.first), std::get<1>(i.first), tensor_name(std::get<2>(i.first)))];
+			to.reads += i.second.reads;
+			to.writes += i.second.writes;
+			to.served.resize(i.second.served.size());
+			for (uint l = 0; l < i.second.served.size(); l++) {
+				to.served[l] += i.second.served[l];
+			}
+		}
+		return t;
+	}
+
+	// CSV, one row per layer, phase, and tensor.  For each cache
+	// level, the fraction of accesses it served, then the
+	// fraction that went to memory.
+	static std::string report() {
+		state_t & s = state();
+		static const char * phases[] = {"activate", "calc_grads", "fix_weights"};
+		std::stringstream ss;
+		ss << std::fixed << std::setprecision(4);
+		ss << "layer,spec,phase,tensor,reads,writes";
+		if (s.cache) {
+			for (auto & c: s.cache->config) {
+				ss << "," << c.name;
+			}
+			ss << ",memory";
+		}
+		ss << "\n";
+		for (auto & i: totals()) {
+			int layer = std::get<0>(i.first);
+			int phase = std::get<1>(i.first);
+			const stats_t & st = i.second;
+			ss << layer << ",\"" << (s.layer_names.count(layer) ? s.layer_names[layer] : "") << "\","
+			   << (phase < 0 ? "none" : phases[phase]) << ",\"" << std::get<2>(i.first) << "\","
+			   << st.reads << "," << st.writes;
+			if (s.cache) {
+				double n = st.reads + st.writes;
+				for (auto v: st.served) {
+					ss << "," << v / n;
+				}
+			}
+			ss << "\n";
+		}
+		return ss.str();
+	}
+
+private:
+	// The last access, if it might have been a write.
+	struct pending_t {
+		const void * address = nullptr;
+		size_t bytes = 0;
+		char old[16];
+		stats_t * stats = nullptr;
+		long stream_index = -1;
+	};
+
+	struct state_t {
+		pending_t pending;
+		bool on = false;
+		cache_sim_t * cache = nullptr;
+		size_t keep = 0;
+		int layer = -1;
+		int phase = -1;
+		std::unordered_map<const void*, uint32_t> ids;
+		std::unordered_map<uint32_t, std::string> names;
+		std::map<int, std::string> layer_names;
+		std::map<std::tuple<int, int, uint32_t>, stats_t> stats;
+		std::vector<access_t> stream;
+		// The last stats we updated, since accesses come in runs.
+		stats_t * last = nullptr;
+		uint32_t last_tensor = 0;
+	};
+
+	static state_t & state() {
+		static state_t s;
+		return s;
+	}
+
+	// If the pending access changed its element, it was a write.
+	static void resolve() {
+		state_t & s = state();
+		pending_t & p = s.pending;
+		if (!p.address) {
+			return;
+		}
+		if (memcmp(p.old, p.address, p.bytes) != 0) {
+			p.stats->reads--;
+			p.stats->writes++;
+			if (p.stream_index >= 0) {
+				s.stream[p.stream_index].write = true;
+			}
+			if (s.cache) {
+				s.cache->mark_dirty((uint64_t)p.address);
+			}
+		}
+		p.address = nullptr;
+	}
+
+	// Tensors are numbered in the order we first see them.
+	static uint32_t id(const void * tensor) {
+		state_t & s = state();
+		auto i = s.ids.find(tensor);
+		if (i != s.ids.end()) {
+			return i->second;
+		}
+		uint32_t n = s.ids.size();
+		s.ids[tensor] = n;
+		return n;
+	}
+};
+
+#ifdef INCLUDE_TESTS
+namespace CNNTest {
+
+	TEST_F(CNNTest, access_trace) {
+		cache_sim_t cache({{"L1", 1024, 64, 2}});
+		std::vector<double> a(256), b(256);
+		access_trace_t::reset();
+		access_trace_t::label(&a, "a");
+		access_trace_t::name_layer(3, "test layer");
+
+		access_trace_t::record(&a, &a[0], sizeof(double), false);
+		EXPECT_TRUE(access_trace_t::stream().empty());
+
+		access_trace_t::start(&cache, 4);
+		access_trace_t::set_context(3, 1);
+		for (int i = 0; i < 256; i++) {
+			access_trace_t::record(&a, &a[i], sizeof(double), true);
+			access_trace_t::record(&b, &b[i], sizeof(double), true);
+			b[i] = a[i] + 1;
+		}
+		access_trace_t::set_context(-1, -1);
+		access_trace_t::record(&a, &a[0], sizeof(double), false);
+		access_trace_t::stop();
+
+		ASSERT_EQ(access_trace_t::stream().size(), 4u);
+		EXPECT_EQ(access_trace_t::stream()[1].address, (uint64_t)&b[0]);
+		EXPECT_TRUE(access_trace_t::stream()[1].write);
+
+		auto totals = access_trace_t::totals();
+		auto & sa = totals[std::make_tuple(3, 1, std::string("a"))];
+		EXPECT_EQ(sa.reads, 256u);
+		EXPECT_EQ(sa.writes, 0u);
+		// One miss per 64-byte line, unless `a` and `b` start
+		// partway into a line.
+		EXPECT_GE(sa.served[0], 256u - 33u);
+		EXPECT_EQ(sa.served[0] + sa.served[1], 256u);
+		std::string b_name = access_trace_t::tensor_name(access_trace_t::stream()[1].tensor);
+		EXPECT_EQ(totals[std::make_tuple(3, 1, b_name)].writes, 256u);
+		// A tensor of 2KB in a 1KB cache has been evicted by the end.
+		EXPECT_EQ(totals[std::make_tuple(-1, -1, std::string("a"))].served[1], 1u);
+
+		std::string report = access_trace_t::report();
+		EXPECT_NE(report.find("3,\"test layer\",calc_grads,\"a\",256,0,"), std::string::npos);
+		access_trace_t::reset();
+	}
+}
+#endif
@@ -0,0 +1,292 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <vector>
+#include "model_t.hpp"
+#include "tracer_t.hpp"
+
+class batching_server_t
+{
+public:
+	/*
+	  batching_server_t serves single-sample requests with a
+	  batched model.  submit() queues a sample and returns a
+	  future for its output.  A worker thread takes requests off
+	  the queue in batches of up to the model's batch size,
+	  waiting at most `max_wait` after the oldest one arrived for
+	  the batch to fill, runs the batch through model_t::apply()
+	  once, and hands each request its row of the output.
+
+	  A short batch is padded with zeros, so the model always
+	  does a full batch of work.  That's the trade-off max_wait
+	  controls: a longer wait means fuller batches (better
+	  throughput) and slower answers when traffic is light.
+
+	  The server has the model to itself while it's running, so
+	  nobody else should use it.  It should be in inference mode
+	  (set_training(false), or freeze() it).
+
+	  metrics() reports the queue depth, batch sizes, and request
+	  latency (from submit() to the result being ready) over the
+	  most recent requests.
+	*/
+	struct metrics_t {
+		uint64_t requests = 0;
+		uint64_t batches = 0;
+		size_t queue_depth = 0;
+		size_t max_queue_depth = 0;
+		// Seconds, over the last `latency_window` requests.
+		double mean_latency = 0;
+		double p50_latency = 0;
+		double p99_latency = 0;
+		double max_latency = 0;
+
+		double mean_batch_size() const {
+			return batches ? requests / (double)batches : 0;
+		}
+	};
+
+	static const size_t latency_window = 4096;
+
+	const int max_batch;
+	const std::chrono::microseconds max_wait;
+
+	batching_server_t(const model_t & model, std::chrono::microseconds max_wait)
+		:
+		max_batch(model.get_plan()[0]->in.size.b),
+		max_wait(max_wait),
+		model(model),
+		input(model.get_plan()[0]->in.size)
+	{
+		throw_assert(!model.training, "Serve the model in inference mode: set_training(false) or freeze() it.");
+		sample_size = input.size;
+		sample_size.b = 1;
+		worker = std::thread([this]() {
+				tracer_t::name_thread("batching server");
+				serve();
+			});
+	}
+
+	// Answers everything that's queued, then stops.
+	~batching_server_t() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		ready.notify_one();
+		worker.join();
+	}
+
+	std::future<tensor_t<double>> submit(const tensor_t<double> & sample) {
+		throw_assert(sample.size == sample_size, "Request is " << sample.size << ", but the model takes " << sample_size);
+		request_t r{sample, std::promise<tensor_t<double>>(), std::chrono::steady_clock::now()};
+		std::future<tensor_t<double>> f = r.result.get_future();
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			throw_assert(!stopping, "The server is shutting down.");
+			queue.push_back(std::move(r));
+			stats.max_queue_depth = std::max(stats.max_queue_depth, queue.size());
+		}
+		ready.notify_one();
+		return f;
+	}
+
+	metrics_t metrics() const {
+		std::lock_guard<std::mutex> lock(mutex);
+		metrics_t m = stats;
+		m.queue_depth = queue.size();
+		if (!latencies.empty()) {
+			std::vector<double> sorted(latencies);
+			std::sort(sorted.begin(), sorted.end());
+			double sum = 0;
+			for (auto l: sorted) {
+				sum += l;
+			}
+			m.mean_latency = sum / sorted.size();
+			m.p50_latency = sorted[sorted.size() / 2];
+			m.p99_latency = sorted[std::min(sorted.size() - 1, sorted.size() * 99 / 100)];
+			m.max_latency = sorted.back();
+		}
+		return m;
+	}
+
+	std::string report() const {
+		metrics_t m = metrics();
+		std::stringstream ss;
+		ss << "requests " << m.requests << ", batches " << m.batches
+		   << ", mean batch " << m.mean_batch_size() << "/" << max_batch
+		   << ", queue depth " << m.queue_depth << " (max " << m.max_queue_depth << ")"
+		   << ", latency mean " << m.mean_latency * 1e3 << " ms, p50 " << m.p50_latency * 1e3
+		   << " ms, p99 " << m.p99_latency * 1e3 << " ms, max " << m.max_latency * 1e3 << " ms\n";
+		return ss.str();
+	}
+
+private:
+	struct request_t {
+		tensor_t<double> sample;
+		std::promise<tensor_t<double>> result;
+		std::chrono::steady_clock::time_point arrived;
+	};
+
+	const model_t & model;
+	tensor_t<double> input;
+	tdsize sample_size;
+	std::thread worker;
+	mutable std::mutex mutex;
+	std::condition_variable ready;
+	std::deque<request_t> queue;
+	bool stopping = false;
+	metrics_t stats;
+	std::vector<double> latencies; // A ring of the last latency_window.
+
+	void serve() {
+		std::vector<request_t> batch;
+		while (true) {
+			batch.clear();
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				ready.wait(lock, [this]() { return stopping || !queue.empty(); });
+				if (queue.empty()) {
+					return;
+				}
+				auto deadline = queue.front().arrived + max_wait;
+				ready.wait_until(lock, deadline, [this]() { return stopping || (int)queue.size() >= max_batch; });
+				int n = std::min<int>(max_batch, queue.size());
+				for (int i = 0; i < n; i++) {
+					batch.push_back(std::move(queue.front()));
+					queue.pop_front();
+				}
+			}
+			run(batch);
+		}
+	}
+
+	void run(std::vector<request_t> & batch) {
+		tracer_t::span_t span("batch", "server", batch.size());
+		const size_t in_stride = input.element_count() / max_batch;
+		for (uint i = 0; i < batch.size(); i++) {
+			memcpy(&input.data[i * in_stride], batch[i].sample.data, in_stride * sizeof(double));
+		}
+		std::fill(&input.data[batch.size() * in_stride], input.data + input.element_count(), 0.0);
+		std::vector<tensor_t<double>> rows;
+		std::exception_ptr error;
+		try {
+			const tensor_t<double> & out = model.apply(input);
+			tdsize row_size = out.size;
+			row_size.b = 1;
+			const size_t out_stride = out.element_count() / max_batch;
+			for (uint i = 0; i < batch.size(); i++) {
+				rows.emplace_back(row_size);
+				memcpy(rows.back().data, &out.data[i * out_stride], out_stride * sizeof(double));
+			}
+		} catch (...) {
+			error = std::current_exception();
+		}
+
+		// Count the batch before anyone can see the answers, so
+		// the metrics always include them.
+		auto now = std::chrono::steady_clock::now();
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stats.batches++;
+			for (auto & r: batch) {
+				double l = std::chrono::duration<double>(now - r.arrived).count();
+				if (latencies.size() < latency_window) {
+					latencies.push_back(l);
+				} else {
+					latencies[stats.requests % latency_window] = l;
+				}
+				stats.requests++;
+			}
+		}
+		for (uint i = 0; i < batch.size(); i++) {
+			if (error) {
+				batch[i].result.set_exception(error);
+			} else {
+				batch[i].result.set_value(std::move(rows[i]));
+			}
+		}
+	}
+};
+
+#ifdef INCLUDE_TESTS
+namespace CNNTest {
+
+	TEST_F(CNNTest, batching_server) {
+		const int batch = 8;
+		srand(11);
+		conv_layer_t l1( 1, 3, 4, 0, tdsize(10,10,1,batch) );
+		relu_layer_t l2( l1.out.size );
+		fc_layer_t   l3( l2.out.size, 5 );
+		model_t model;
+		model.add_layer(l1);
+		model.add_layer(l2);
+		model.add_layer(l3);
+		model.set_training(false);
+
+		const int clients = 4, per_client = 25;
+		std::vector<tensor_t<double>> samples;
+		for (int i = 0; i < clients * per_client; i++) {
+			samples.emplace_back(10,10,1,1);
+			randomize(samples.back());
+		}
+		// Answers from the batched model, one sample at a time.
+		std::vector<tensor_t<double>> expected;
+		tensor_t<double> one(10,10,1,batch);
+		for (auto & s: samples) {
+			memcpy(one.data, s.data, s.calculate_data_size());
+			tensor_t<double> & out = model.apply(one);
+			expected.emplace_back(5,1,1,1);
+			memcpy(expected.back().data, out.data, expected.back().calculate_data_size());
+		}
+
+		batching_server_t::metrics_t m;
+		{
+			batching_server_t server(model, std::chrono::milliseconds(50));
+			EXPECT_EQ(server.max_batch, batch);
+			EXPECT_ANY_THROW(server.submit(tensor_t<double>(10,10,2,1)));
+
+			// A local load generator: each client sends its share
+			// of the requests and then waits for the answers.
+			std::vector<std::thread> threads;
+			std::vector<int> wrong(clients, 0);
+			for (int c = 0; c < clients; c++) {
+				threads.emplace_back([&, c]() {
+						std::vector<std::future<tensor_t<double>>> answers;
+						for (int i = c; i < (int)samples.size(); i += clients) {
+							answers.push_back(server.submit(samples[i]));
+						}
+						for (int i = c, k = 0; i < (int)samples.size(); i += clients, k++) {
+							wrong[c] += answers[k].get() != expected[i];
+						}
+					});
+			}
+			for (auto & t: threads) {
+				t.join();
+			}
+			for (int c = 0; c < clients; c++) {
+				EXPECT_EQ(wrong[c], 0);
+			}
+
+			// A lone request waits out max_wait and then goes by
+			// itself.
+			auto start = std::chrono::steady_clock::now();
+			EXPECT_EQ(server.submit(samples[0]).get(), expected[0]);
+			EXPECT_GE(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(45));
+			m = server.metrics();
+		}
+		EXPECT_EQ(m.requests, (uint64_t)samples.size() + 1);
+		EXPECT_EQ(m.queue_depth, 0u);
+		EXPECT_GT(m.max_queue_depth, 1u);
+		EXPECT_GT(m.mean_batch_size(), 1.5);
+		EXPECT_LE(m.p50_latency, m.p99_latency);
+		EXPECT_GE(m.max_latency, 0.045);
+	}
+}
+#endif
@@ -0,0 +1,95 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+#include "types.hpp"
+
+struct bitmask_t
+{
+	/* 
+	   bitmask_t is a packed array of bits.  Layers use it to
+	   remember a yes/no decision per element (e.g., which inputs
+	   relu let through) for back propagation.  It takes 1/64th
+	   the space of a tensor_t<double> of the same size.
+
+	   Bit i lives in bit (i % 64) of words[i / 64].
+	*/
+	std::vector<uint64_t> words;
+	size_t bit_count;
+
+	bitmask_t(size_t n = 0) : words((n + 63) / 64), bit_count(n) {}
+
+	void resize(size_t n) {
+		words.assign((n + 63) / 64, 0);
+		bit_count = n;
+	}
+
+	size_t size() const {
+		return bit_count;
+	}
+
+	bool get(size_t i) const {
+		return (words[i / 64] >> (i % 64)) & 1;
+	}
+
+	void set(size_t i, bool v) {
+		uint64_t bit = uint64_t(1) << (i % 64);
+		if (v) {
+			words[i / 64] |= bit;
+		} else {
+			words[i / 64] &= ~bit;
+		}
+	}
+
+	void fill(bool v) {
+		for (auto & w: words) {
+			w = v ? ~uint64_t(0) : 0;
+		}
+		if (v && bit_count % 64) {
+			words.back() = (uint64_t(1) << (bit_count % 64)) - 1;
+		}
+	}
+
+	size_t get_total_memory_size() const {
+		return words.size() * sizeof(uint64_t);
+	}
+
+	bool operator==(const bitmask_t & o) const {
+		return bit_count == o.bit_count && words == o.words;
+	}
+
+	bool operator!=(const bitmask_t & o) const {
+		return !(*this == o);
+	}
+};
+
+
+#ifdef INCLUDE_TESTS
+namespace CNNTest {
+
+	TEST_F(CNNTest, bitmask_ops) {
+		bitmask_t m(130);
+		EXPECT_EQ(m.size(), 130u);
+		EXPECT_EQ(m.get_total_memory_size(), 3*sizeof(uint64_t));
+		m.set(0, true);
+		m.set(64, true);
+		m.set(129, true);
+		EXPECT_TRUE(m.get(0));
+		EXPECT_FALSE(m.get(1));
+		EXPECT_TRUE(m.get(64));
+		EXPECT_TRUE(m.get(129));
+		m.set(64, false);
+		EXPECT_FALSE(m.get(64));
+
+		bitmask_t n(130);
+		EXPECT_NE(m, n);
+		m.fill(false);
+		EXPECT_EQ(m, n);
+
+		m.fill(true);
+		for (size_t i = 0; i < n.size(); i++) {
+			n.set(i, true);
+		}
+		EXPECT_EQ(m, n);
+	}
+}
+#endif
@@ -0,0 +1,217 @@
+#pragma once
+#include <cstdint>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "throw_assert.hpp"
+
+class cache_sim_t
+{
+public:
+	/*
+	  cache_sim_t is a simple model of a multi-level cache
+	  hierarchy: each level is set-associative with LRU
+	  replacement, write-back, and write-allocate, and a miss in
+	  one level goes on to the next.  A line that misses is
+	  brought into every level it missed in (so the levels are
+	  neither inclusive nor exclusive), and a dirty line evicted
+	  from one level is written into the next.  All the levels
+	  must use the same line size.
+
+	  There's no prefetcher, no timing, and no sharing between
+	  cores, so the numbers won't match real hardware exactly.
+	  But they are deterministic and the same on every machine,
+	  which makes them good for comparing two loop orders.
+	  access_trace_t feeds one from tensor accesses.
+	*/
+	struct level_config_t {
+		std::string name;
+		size_t size;      // Bytes.
+		size_t line_size; // Bytes, a power of two.
+		int ways;
+	};
+
+	struct level_stats_t {
+		uint64_t hits = 0;
+		uint64_t misses = 0;
+		uint64_t writebacks = 0; // Dirty lines this level evicted.
+	};
+
+	// Roughly a current desktop core.
+	static std::vector<level_config_t> default_config() {
+		return {{"L1", 32 << 10, 64, 8},
+			{"L2", 1 << 20, 64, 16},
+			{"L3", 8 << 20, 64, 16}};
+	}
+
+	const std::vector<level_config_t> config;
+	std::vector<level_stats_t> stats;
+	uint64_t memory_writebacks = 0;
+
+	cache_sim_t(const std::vector<level_config_t> & config = default_config())
+		: config(config), stats(config.size())
+	{
+		throw_assert(!config.empty(), "A cache needs at least one level.");
+		for (auto & c: config) {
+			throw_assert(c.line_size == config[0].line_size, "All cache levels must have the same line size.");
+			throw_assert((c.line_size & (c.line_size - 1)) == 0, "Cache line size must be a power of two.");
+			throw_assert(c.ways > 0 && c.size % (c.line_size * c.ways) == 0, "Cache " << c.name << " size must be a multiple of line_size * ways.");
+			levels.emplace_back(c);
+		}
+	}
+
+	size_t line_size() const {
+		return config[0].line_size;
+	}
+
+	// Access the line holding `address`.  Returns the level that
+	// had it, or config.size() if it came from memory.
+	int access(uint64_t address, bool write) {
+		uint64_t line = address / line_size();
+		int hit = levels.size();
+		for (uint l = 0; l < levels.size(); l++) {
+			if (levels[l].lookup(line, write && l == 0)) {
+				hit = l;
+				stats[l].hits++;
+				break;
+			}
+			stats[l].misses++;
+		}
+		for (int l = hit - 1; l >= 0; l--) {
+			fill(l, line, write && l == 0);
+		}
+		return hit;
+	}
+
+	// Mark the line holding `address` dirty in the first level,
+	// if it's there, as if the last access to it were a write.
+	void mark_dirty(uint64_t address) {
+		levels[0].lookup(address / line_size(), true);
+	}
+
+	// Empty every level, without writing anything back.
+	void invalidate() {
+		for (auto & l: levels) {
+			l.invalidate();
+		}
+	}
+
+	void reset_stats() {
+		stats.assign(levels.size(), level_stats_t());
+		memory_writebacks = 0;
+	}
+
+	std::string report() const {
+		std::stringstream ss;
+		ss << std::fixed << std::setprecision(4);
+		for (uint l = 0; l < levels.size(); l++) {
+			uint64_t n = stats[l].hits + stats[l].misses;
+			ss << config[l].name << ": " << stats[l].hits << " hits, " << stats[l].misses << " misses, "
+			   << "hit rate " << (n ? stats[l].hits / (double)n : 0.0) << ", "
+			   << stats[l].writebacks << " writebacks\n";
+		}
+		return ss.str();
+	}
+
+private:
+	struct level_t {
+		uint64_t sets;
+		int ways;
+		// For each way of each set, the line it holds (plus
+		// one, so zero means empty), when it was last used,
+		// and whether it's dirty.
+		std::vector<uint64_t> tags;
+		std::vector<uint64_t> used;
+		std::vector<bool> dirty;
+		uint64_t clock = 0;
+
+		level_t(const level_config_t & c)
+			: sets(c.size / c.line_size / c.ways), ways(c.ways),
+			  tags(sets * ways, 0), used(sets * ways, 0), dirty(sets * ways, false) {}
+
+		bool lookup(uint64_t line, bool write) {
+			size_t base = (line % sets) * ways;
+			for (int w = 0; w < ways; w++) {
+				if (tags[base + w] == line + 1) {
+					used[base + w] = ++clock;
+					if (write) {
+						dirty[base + w] = true;
+					}
+					return true;
+				}
+			}
+			return false;
+		}
+
+		// Put `line` in its set, and return the victim's line
+		// (plus one) if it was dirty, or zero.
+		uint64_t insert(uint64_t line, bool write) {
+			size_t base = (line % sets) * ways;
+			size_t victim = base;
+			for (int w = 0; w < ways; w++) {
+				if (used[base + w] < used[victim]) {
+					victim = base + w;
+				}
+			}
+			uint64_t evicted = dirty[victim] ? tags[victim] : 0;
+			tags[victim] = line + 1;
+			used[victim] = ++clock;
+			dirty[victim] = write;
+			return evicted;
+		}
+
+		void invalidate() {
+			std::fill(tags.begin(), tags.end(), 0);
+			std::fill(used.begin(), used.end(), 0);
+			std::fill(dirty.begin(), dirty.end(), false);
+		}
+	};
+
+	std::vector<level_t> levels;
+
+	void fill(uint l, uint64_t line, bool write) {
+		uint64_t evicted = levels[l].insert(line, write);
+		if (!evicted) {
+			return;
+		}
+		stats[l].writebacks++;
+		if (l + 1 == levels.size()) {
+			memory_writebacks++;
+		} else if (!levels[l + 1].lookup(evicted - 1, true)) {
+			fill(l + 1, evicted - 1, true);
+		}
+	}
+};
+
+#ifdef INCLUDE_TESTS
+namespace CNNTest {
+
+	TEST_F(CNNTest, cache_sim) {
+		// Streaming through memory misses once per line.
+		cache_sim_t stream({{"L1", 1024, 64, 2}});
+		for (uint64_t a = 0; a < 4096; a += 8) {
+			stream.access(a, false);
+		}
+		EXPECT_EQ(stream.stats[0].misses, 64u);
+		EXPECT_EQ(stream.stats[0].hits, 448u);
+
+		// Three lines that map to the same set of a 2-way
+		// cache: LRU keeps the two most recent.
+		cache_sim_t lru({{"L1", 1024, 64, 2}, {"L2", 4096, 64, 4}});
+		const uint64_t stride = 512; // sets * line_size
+		lru.access(0, true);
+		lru.access(stride, false);
+		lru.access(0, false);          // Hit; `stride` is now LRU.
+		EXPECT_EQ(lru.access(2 * stride, false), 2); // Evicts `stride`, which is clean.
+		EXPECT_EQ(lru.access(0, false), 0);
+		EXPECT_EQ(lru.access(stride, false), 1); // Evicts 2 * stride from L1; L2 still has it.
+		EXPECT_EQ(lru.stats[0].writebacks, 0u);
+		lru.access(3 * stride, false); // Evicts line 0, which is dirty.
+		EXPECT_EQ(lru.stats[0].writebacks, 1u);
+		EXPECT_EQ(lru.access(0, false), 1);
+		EXPECT_EQ(lru.memory_writebacks, 0u);
+		EXPECT_EQ(lru.stats[0].hits + lru.stats[0].misses, 8u);
+	}
+}
+#endif
@@ -12,5 +12,16 @@
 #include "relu_layer_t.hpp"
 #include "conv_layer_t.hpp"
 #include "dropout_layer_t.hpp"
+#include "fused_elementwise_layer_t.hpp"
+#include "conv_relu_pool_layer_t.hpp"
 #include "softmax_layer_t.hpp"
+#include "softmax_cross_entropy_layer_t.hpp"
 #include "model_t.hpp"
+#include "data_parallel_trainer_t.hpp"
+#include "hogwild_trainer_t.hpp"
+#include "pipeline_t.hpp"
+#include "roofline_t.hpp"
+#include "weight_file_t.hpp"
+#include "batching_server_t.hpp"
+#include "exec_context_t.hpp"
+#include "evaluator_t.hpp"
@@ -7,7 +7,8 @@ class conv_layer_t: public layer_t
 {
 public:
 	std::vector<tensor_t<double>> filters;  // convolution filter kernels
-	std::vector<tensor_t<gradient_t>> filter_grads;
+	std::vector<tensor_t<gradient_t>> filter_grads; // Summed over the batch.
+	tensor_t<double> packed_filters; // All the filters, filter-innermost (see freeze()).
 	uint16_t stride;
 	uint16_t kernel_size;
 	uint16_t kernel_count;
@@ -23,6 +24,7 @@ public:
 		layer_t(in_size, tdsize(ROUND_UP_IDIV(in_size.x, stride),
 					ROUND_UP_IDIV(in_size.y, stride),
 					kernel_count, in_size.b)),
+		packed_filters(1,1,1,1),
 		pad(pad)
 		
 	{
@@ -31,35 +33,26 @@ public:
 		this->kernel_count = kernel_count;
 		throw_assert(kernel_size >= stride, "Convolution kernel size (" << kernel_size << ") must be >= than stride (" << stride << ").");
 		for ( int a = 0; a < kernel_count; a++ ) {	
-			tensor_t<double> t( kernel_size, kernel_size, in_size.z );
+			tensor_t<double> t = new_parameters(tdsize( kernel_size, kernel_size, in_size.z ));
 
 			int maxval = kernel_size * kernel_size * in_size.z;
 
+			if (!t.is_released())
 			for ( int i = 0; i < kernel_size; i++ )
 				for ( int j = 0; j < kernel_size; j++ )
 					for ( int z = 0; z < in_size.z; z++ )
 						t( i, j, z ) = 1.0f / maxval * rand() / double( RAND_MAX );
-			filters.push_back( t );
+			filters.push_back( std::move(t) );
 		}
 		for ( int i = 0; i < kernel_count; i++ )
 		{
-			tensor_t<gradient_t> t( kernel_size, kernel_size, in_size.z, in_size.b );
+			tensor_t<gradient_t> t( kernel_size, kernel_size, in_size.z );
 			filter_grads.push_back( t );
 		}
+		packed_filters.release(); // Until freeze().
 
 	}
 
-	void change_batch_size(int new_batch_size) {
-                std::cout << "Changing conv_layer batch_size" << std::endl;
-                layer_t::change_batch_size(new_batch_size);
-		filter_grads.clear();
-		for ( int i = 0; i < this->kernel_count; i++ )
-		{
-			tensor_t<gradient_t> t( this->kernel_size, this->kernel_size, in.size.z, in.size.b );
-			filter_grads.push_back( t );
-		}
-        }
-
 	size_t get_total_memory_size() const {
 		size_t sum = 0;
 		for(auto & i: filters) {
@@ -68,15 +61,52 @@ public:
 		for(auto & i: filter_grads) {
 			sum += i.get_total_memory_size();
 		}
-		return sum + layer_t::get_total_memory_size();
+		return sum + packed_filters.get_total_memory_size() + layer_t::get_total_memory_size();
 	}
 
 	std::string kind_str() const {
 		return "conv_layer_t";
 	}
+
+	layer_cost_t cost() const {
+		const double I = in.element_count();
+		const double O = out.element_count();
+		const double K = kernel_size * kernel_size * in.size.z; // Taps per output.
+		const double W = K * kernel_count;
+		layer_cost_t c;
+		c[layer_phase::activate] = {2 * K * O, 8 * (I + O + W)};
+		// One multiply-add for grads_out and one for the filter
+		// gradients per tap.
+		c[layer_phase::calc_grads] = {4 * K * O, 8 * (2 * I + O + W) + 2 * sizeof(gradient_t) * W};
+		c[layer_phase::fix_weights] = {6 * W, 2 * 8 * W + 2 * sizeof(gradient_t) * W};
+		return c;
+	}
+	using layer_t::parameter_tensors;
+	std::vector<tensor_t<double>*> parameter_tensors() {
+		if (frozen) {
+			return {&packed_filters};
+		}
+		std::vector<tensor_t<double>*> p;
+		for (auto & f: filters) {
+			p.push_back(&f);
+		}
+		return p;
+	}
+
+	void label_tensors(const std::string & prefix) const {
+		layer_t::label_tensors(prefix);
+		for (auto & f: filters) {
+			access_trace_t::label(&f, prefix + "filters");
+		}
+		for (auto & g: filter_grads) {
+			access_trace_t::label(&g, prefix + "filter_grads");
+		}
+		access_trace_t::label(&packed_filters, prefix + "packed_filters");
+	}
+
 	std::string param_str() const {
 		std::stringstream ss;
-		ss << "stride=" << stride << ", kernel_size=" << kernel_size << ", kernel_count=" << filters.size() << ", pad=" << pad;
+		ss << "stride=" << stride << ", kernel_size=" << kernel_size << ", kernel_count=" << kernel_count << ", pad=" << pad;
 		return ss.str();
 	}
 
@@ -106,13 +136,63 @@ public:
 		return !(*this == o);
 	}
 
+	layer_t * replicate() const {
+		conv_layer_t * r = new conv_layer_t(*this);
+		for ( uint i = 0; i < filters.size(); i++ ) {
+			r->filters[i].view(filters[i]);
+		}
+		if (frozen) {
+			r->packed_filters.view(packed_filters);
+		}
+		return r;
+	}
+
+	// Repack the filters into one tensor where the weights for all
+	// the filters at a given tap, (i, j, z), are next to each
+	// other, in the order activate() visits the taps.  Then
+	// activate() can compute every filter's output for a pixel in
+	// one pass over the input window, with unit-stride loads.
+	void freeze() {
+		layer_t::freeze();
+		const int k = kernel_size;
+		const bool unloaded = filters[0].is_released();
+		packed_filters = unloaded ? tensor_t<double>::released(tdsize(kernel_count, in.size.z, k, k))
+			: tensor_t<double>(kernel_count, in.size.z, k, k);
+		if (!unloaded)
+		for ( int f = 0; f < kernel_count; f++ )
+			for ( int i = 0; i < k; i++ )
+				for ( int j = 0; j < k; j++ )
+					for ( int z = 0; z < in.size.z; z++ )
+						packed_filters( f, z, j, i ) = filters[f]( i, j, z );
+		std::vector<tensor_t<double>>().swap(filters);
+		release_gradients();
+		sums.assign(kernel_count, 0.0);
+	}
+
+	void release_gradients() {
+		std::vector<tensor_t<gradient_t>>().swap(filter_grads);
+	}
+
+	void add_grads(const layer_t & other) {
+		auto & o = static_cast<const conv_layer_t &>(other);
+		for ( uint k = 0; k < filter_grads.size(); k++ ) {
+			for ( size_t n = 0; n < filter_grads[k].element_count(); n++ ) {
+				filter_grads[k].data[n].grad += o.filter_grads[k].data[n].grad;
+			}
+		}
+	}
+
 	range_t map_to_output( int x, int y )
 	{
 		return map_to_output_impl(x,y, kernel_size, stride, filters.size(), out.size);
 	}
 
 	void activate( tensor_t<double>& in ) {
-		copy_input(in);
+		bind_input(in);
+		if (frozen) {
+			activate_packed(in);
+			return;
+		}
 		for ( int b = 0; b < out.size.b; b++ ) {
 			for ( uint filter = 0; filter < filters.size(); filter++ ) {
 				tensor_t<double>& filter_data = filters[filter];
@@ -141,6 +221,38 @@ public:
 		}
 	}
 	
+	// Same arithmetic as above (so the results are identical), but
+	// with all the filters at once.
+	void activate_packed( const tensor_t<double>& in ) {
+		const int F = kernel_count;
+		for ( int b = 0; b < out.size.b; b++ ) {
+			for ( int y = 0; y < out.size.y; y++ ) {
+				for ( int x = 0; x < out.size.x; x++ ) {
+					point_t mapped(x*stride, y*stride, 0);
+					std::fill(sums.begin(), sums.end(), 0.0);
+					const double * w = packed_filters.data;
+					for ( int i = 0; i < kernel_size; i++ )
+						for ( int j = 0; j < kernel_size; j++ )
+							for ( int z = 0; z < in.size.z; z++, w += F ) {
+								double v;
+								if (mapped.x + i >= in.size.x ||
+								    mapped.y + j >= in.size.y) {
+									v = pad;
+								} else {
+									v = in( mapped.x + i, mapped.y + j, z, b );
+								}
+								for ( int f = 0; f < F; f++ ) {
+									sums[f] += w[f]*v;
+								}
+							}
+					for ( int f = 0; f < F; f++ ) {
+						out( x, y, f, b ) = sums[f];
+					}
+				}
+			}
+		}
+	}
+
 	void test_fix_weights() {
 		for(uint i = 0; i < filter_grads.size(); i++) {
 			randomize(filter_grads[i]);
@@ -150,26 +262,28 @@ public:
 
 
 	void fix_weights() {
-		for ( int b = 0; b < in.size.b; b++ )
-			for ( uint a = 0; a < filters.size(); a++ )
-				for ( int i = 0; i < kernel_size; i++ )
-					for ( int j = 0; j < kernel_size; j++ )
-						for ( int z = 0; z < in.size.z; z++ ) {
-							double& w = filters[a].get( i, j, z );
-							gradient_t& grad = filter_grads[a].get( i, j, z, b );
-							w = update_weight( w, grad );
-							update_gradient( grad );
-						}
+		throw_assert(!frozen, "Can't update a frozen conv_layer_t.");
+		for ( uint a = 0; a < filters.size(); a++ )
+			for ( int i = 0; i < kernel_size; i++ )
+				for ( int j = 0; j < kernel_size; j++ )
+					for ( int z = 0; z < in.size.z; z++ ) {
+						double& w = filters[a].get( i, j, z );
+						gradient_t& grad = filter_grads[a].get( i, j, z );
+						w = update_weight( w, grad );
+						update_gradient( grad );
+					}
 	}
 
 	void calc_grads(const tensor_t<double>& grad_next_layer ) {
 		throw_assert(grad_next_layer.size == out.size, "mismatch input size for calc_grads");
-		for ( int b = 0; b < in.size.b; b++ )
+		throw_assert(!frozen, "Can't compute gradients for a frozen conv_layer_t.");
+		if (!accumulate_grads) {
 			for ( uint k = 0; k < filter_grads.size(); k++ ) 
 				for ( int i = 0; i < kernel_size; i++ )
 					for ( int j = 0; j < kernel_size; j++ )
 						for ( int z = 0; z < in.size.z; z++ )
-							filter_grads[k].get( i, j, z, b ).grad = 0;
+							filter_grads[k].get( i, j, z ).grad = 0;
+		}
 		
 		for ( int b = 0; b < in.size.b; b++ ) {
 			for ( int x = 0; x < in.size.x; x++ ) {
@@ -184,7 +298,7 @@ public:
 								for ( int k = rn.min_z; k <= rn.max_z; k++ ) {
 									int w_applied = filters[k].get( x - minx, y - miny, z );
 									sum_error += w_applied * grad_next_layer( i, j, k, b );
-									filter_grads[k].get( x - minx, y - miny, z, b ).grad += in( x, y, z, b ) * grad_next_layer( i, j, k, b );
+									filter_grads[k].get( x - minx, y - miny, z ).grad += in( x, y, z, b ) * grad_next_layer( i, j, k, b );
 								}
 							}
 						}
@@ -195,6 +309,10 @@ public:
 		}
 	}
 
+private:
+	std::vector<double> sums; // One per filter, for activate_packed().
+
+public:
 	std::string regression_code() const {
 		std::stringstream ss;
 		ss << "conv_test<opt_conv_layer_t>("
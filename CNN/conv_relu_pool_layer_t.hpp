@@ -0,0 +1,254 @@
+#pragma once
+#include "conv_layer_t.hpp"
+#include "relu_layer_t.hpp"
+#include "pool_layer_t.hpp"
+
+class conv_relu_pool_layer_t : public layer_t
+{
+public:
+	/*
+	  conv_relu_pool_layer_t runs a conv_layer_t -> relu_layer_t ->
+	  pool_layer_t sequence as a single layer.
+
+	  Run separately, the three layers write out the full-size
+	  convolution output, copy it into the relu, write it again,
+	  copy it into the pool, and only then shrink it.  Here, for
+	  each row of pooled output, we compute just the convolution
+	  rows its windows cover into a small buffer (which stays in
+	  L1), apply the relu there, pool it, and write only the pooled
+	  result.
+
+	  The three layers keep all the state: the conv's filters and
+	  input, the relu's mask, and the pool's switches.  That is all
+	  calc_grads() needs, so it can push the gradient back through
+	  the pool and the relu in one scatter and then hand off to the
+	  conv.  Our `in`, `out`, and `grads_out` are views of the
+	  conv's `in`, the pool's `out`, and the conv's `grads_out`.
+
+	  The results are bit-for-bit the same as running the layers
+	  separately.  model_t substitutes this layer in finalize().
+	*/
+	conv_layer_t * conv;
+	relu_layer_t * relu;
+	pool_layer_t * pool;
+	std::vector<double> rows; // Convolution output for one pooling window's worth of rows.
+
+	conv_relu_pool_layer_t(conv_layer_t * conv, relu_layer_t * relu, pool_layer_t * pool)
+		:
+		layer_t(conv->in.size, pool->out.size),
+		conv(conv),
+		relu(relu),
+		pool(pool)
+	{
+		throw_assert(conv->out.size == relu->in.size && relu->out.size == pool->in.size, "Can't fuse layers with mismatched sizes.");
+		throw_assert(!conv->frozen, "Frozen conv layers have their own kernel; don't fuse them.");
+		bind_layers();
+	}
+
+	std::string kind_str() const {
+		return "conv_relu_pool_layer_t";
+	}
+
+	std::string param_str() const {
+		return conv->spec_str() + " -> " + relu->spec_str() + " -> " + pool->spec_str();
+	}
+
+	std::string regression_code() const {
+		return conv->regression_code() + "\n" + relu->regression_code() + "\n" + pool->regression_code() + "\n";
+	}
+
+	void change_batch_size(int new_batch_size) {
+		conv->change_batch_size(new_batch_size);
+		relu->change_batch_size(new_batch_size);
+		pool->change_batch_size(new_batch_size);
+		bind_layers();
+	}
+
+	// The three layers' arithmetic, but the full-size convolution
+	// output never goes to memory on the way forward.
+	void label_tensors(const std::string & prefix) const {
+		layer_t::label_tensors(prefix);
+		conv->label_tensors(prefix + "conv ");
+		relu->label_tensors(prefix + "relu ");
+		pool->label_tensors(prefix + "pool ");
+	}
+
+	layer_cost_t cost() const {
+		layer_cost_t c;
+		layer_cost_t parts[] = {conv->cost(), relu->cost(), pool->cost()};
+		for (auto & part: parts) {
+			for (int p = 0; p < layer_phase_count; p++) {
+				c.phases[p].flops += part.phases[p].flops;
+				c.phases[p].bytes += part.phases[p].bytes;
+			}
+		}
+		// The conv's write, the relu's read and write, and the
+		// pool's read all stay in `rows`.
+		c[layer_phase::activate].bytes -= 4 * 8.0 * conv->out.element_count();
+		return c;
+	}
+
+	void use_buffers(double * out, double * grads_out) {
+		layer_t::use_buffers(out, grads_out);
+		if (grads_out) {
+			conv->grads_out.view(grads_out, conv->grads_out.size);
+		}
+	}
+
+	void activate(tensor_t<double>& in) {
+		conv->bind_input(in);
+		this->in.view(conv->in);
+
+		const tdsize & cs = conv->out.size;
+		const int pf = pool->filter_size;
+		rows.resize(pf * cs.x);
+
+		for ( int b = 0; b < cs.b; b++ ) {
+			for ( int filter = 0; filter < cs.z; filter++ ) {
+				for ( int py = 0; py < out.size.y; py++ ) {
+					int y0 = py * pool->stride;
+					int y1 = std::min(y0 + pf, (int)cs.y);
+					for ( int y = y0; y < y1; y++ ) {
+						conv_relu_row(&rows[(y - y0) * cs.x], y, filter, b);
+					}
+					pool_row(py, y0, y1, filter, b);
+				}
+			}
+		}
+	}
+
+	void calc_grads(const tensor_t<double>& grad_next_layer) {
+		throw_assert(grad_next_layer.size == out.size, "mismatch input size for calc_grads");
+		// The pool sends each gradient to its max, and the relu
+		// blocks it if the max was negative.
+		tensor_t<double> & g = relu->grads_out;
+		g.clear();
+		for ( size_t n = 0; n < pool->switches.element_count(); n++ ) {
+			int s = pool->switches.data[n];
+			if ( s >= 0 && relu->mask.get(s) ) {
+				g.data[s] += grad_next_layer.data[n];
+			}
+		}
+		conv->calc_grads(g);
+	}
+
+	void fix_weights() {
+		conv->fix_weights();
+	}
+
+private:
+	void bind_layers() {
+		in.view(conv->in);
+		out.view(pool->out);
+		grads_out.view(conv->grads_out);
+	}
+
+	// Compute row `y` of the convolution output for `filter` and
+	// apply the relu.  The arithmetic matches conv_layer_t::activate()
+	// exactly.
+	void conv_relu_row(double * row, int y, int filter, int b) {
+		const tensor_t<double> & in = conv->in;
+		const tensor_t<double> & filter_data = conv->filters[filter];
+		const int k = conv->kernel_size;
+		for ( int x = 0; x < conv->out.size.x; x++ ) {
+			point_t mapped(x * conv->stride, y * conv->stride, 0);
+			double sum = 0;
+			for ( int i = 0; i < k; i++ )
+				for ( int j = 0; j < k; j++ )
+					for ( int z = 0; z < in.size.z; z++ ) {
+						double f = filter_data( i, j, z );
+						double v;
+						if (mapped.x + i >= in.size.x ||
+						    mapped.y + j >= in.size.y) {
+							v = conv->pad;
+						} else {
+							v = in( mapped.x + i, mapped.y + j, z, b );
+						}
+						sum += f*v;
+					}
+			bool pass = !(sum < 0);
+			relu->mask.set(conv->out.linearize(x, y, filter, b), pass);
+			row[x] = pass ? sum : 0;
+		}
+	}
+
+	// Pool convolution rows [y0, y1) (held in `rows`) into row `py`
+	// of the output.  Candidates are visited in the same order as
+	// pool_layer_t::activate() so ties resolve the same way.
+	void pool_row(int py, int y0, int y1, int filter, int b) {
+		const tdsize & cs = conv->out.size;
+		const int pf = pool->filter_size;
+		for ( int px = 0; px < out.size.x; px++ ) {
+			int x0 = px * pool->stride;
+			double mval = -FLT_MAX;
+			int mloc = -1;
+			for ( int i = 0; i < pf; i++ )
+				for ( int j = 0; j < pf; j++ ) {
+					double v;
+					int loc;
+					if (x0 + i >= cs.x || y0 + j >= y1) {
+						v = pool->pad;
+						loc = -1;
+					} else {
+						v = rows[j * cs.x + x0 + i];
+						loc = conv->out.linearize(x0 + i, y0 + j, filter, b);
+					}
+					if ( v > mval ) {
+						mval = v;
+						mloc = loc;
+					}
+				}
+			out( px, py, filter, b ) = mval;
+			pool->switches( px, py, filter, b ) = mloc;
+		}
+	}
+};
+
+#ifdef INCLUDE_TESTS
+namespace CNNTest {
+
+	TEST_F(CNNTest, conv_relu_pool) {
+		// Odd sizes and an overlapping pool exercise the edges.
+		for (auto pool_size : {std::make_pair(2, 2), std::make_pair(2, 3)}) {
+			tdsize size(15,13,3,2);
+			tensor_t<double> in(size);
+			for (size_t i = 0; i < in.element_count(); i++)
+				in.data[i] = rand() / double(RAND_MAX) - 0.5;
+
+			srand(42);
+			conv_layer_t c1( 1, 3, 4, 0, size );
+			relu_layer_t r1( c1.out.size );
+			pool_layer_t p1( pool_size.first, pool_size.second, 0, r1.out.size );
+			tensor_t<double> next_grads(p1.out.size);
+			randomize(next_grads);
+
+			srand(42);
+			conv_layer_t c2( 1, 3, 4, 0, size );
+			relu_layer_t r2( c2.out.size );
+			pool_layer_t p2( pool_size.first, pool_size.second, 0, r2.out.size );
+			conv_relu_pool_layer_t fused(&c2, &r2, &p2);
+			EXPECT_EQ(fused.get_total_memory_size(), 0u);
+
+			for (int i = 0; i < 2; i++) {
+				c1.activate(in);
+				r1.activate(c1.out);
+				p1.activate(r1.out);
+				p1.calc_grads(next_grads);
+				r1.calc_grads(p1.grads_out);
+				c1.calc_grads(r1.grads_out);
+				c1.fix_weights();
+
+				fused.activate(in);
+				fused.calc_grads(next_grads);
+				fused.fix_weights();
+
+				EXPECT_EQ(p1.out, fused.out);
+				EXPECT_EQ(p1.switches, p2.switches);
+				EXPECT_EQ(r1.mask, r2.mask);
+				EXPECT_EQ(c1.grads_out, fused.grads_out);
+				EXPECT_EQ(c1.filters, c2.filters);
+			}
+		}
+	}
+}
+#endif
@@ -0,0 +1,24 @@
+#pragma once
+#include <cstdint>
+
+/*
+  counter_rng() is a counter-based random number generator.
+  Instead of carrying state from one call to the next (like
+  rand()), each number is a hash of a key and a counter.  That
+  means the i-th number in a stream can be computed directly, in
+  any order, from any thread, and the same (key, counter) always
+  gives the same number.
+
+  Layers typically derive a key from their seed and the training
+  step, and use the element index as the counter.
+
+  The mixing function is the SplitMix64 finalizer applied to a
+  Weyl sequence.
+*/
+static inline uint64_t counter_rng(uint64_t key, uint64_t counter)
+{
+	uint64_t z = key + (counter + 1) * 0x9e3779b97f4a7c15ULL;
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
@@ -0,0 +1,221 @@
+#pragma once
+#include <memory>
+#include <set>
+#include "model_t.hpp"
+#include "parallel.hpp"
+
+class data_parallel_trainer_t
+{
+public:
+	/*
+	  data_parallel_trainer_t trains a model on several threads at
+	  once.  It makes a replica of the model for each extra
+	  thread.  The replicas have their own activations and
+	  gradients but share the master model's parameters (see
+	  layer_t::replicate()).
+
+	  train_batch() works like model_t::train_batch(), except the
+	  micro-batches are dealt out to the replicas (micro-batch m
+	  goes to replica m % threads), which each accumulate their
+	  own gradients in parallel.  Then we add the replicas'
+	  gradients together with a tree all-reduce, and the master
+	  applies one update, which every replica sees.
+
+	  The additions happen in an order that only depends on the
+	  number of threads and micro-batches, never on timing, so
+	  training is reproducible.  With one thread, it's exactly
+	  model_t::train_batch().
+	*/
+	model_t & master;
+	std::vector<model_t*> replicas; // replicas[0] is the master.
+	thread_pool_t pool;
+
+	data_parallel_trainer_t(model_t & master, int threads)
+		:
+		master(master),
+		pool(threads)
+	{
+		replicas.push_back(&master);
+		for (int r = 1; r < pool.thread_count; r++) {
+			owned_models.emplace_back(master.replicate(owned_layers));
+			replicas.push_back(owned_models.back().get());
+		}
+		staging.resize(replicas.size());
+	}
+
+	int train_batch(dataset_t & ds, dataset_t::iterator & start, int count) {
+		int micro_batches = master.count_micro_batches(ds, start, count);
+		if (micro_batches == 0) {
+			return 0;
+		}
+		const int batch = master.get_plan()[0]->in.size.b;
+		const int cases = batch / start->data.size.b;
+		const double scale = 1.0 / (micro_batches * batch);
+		const int active = std::min((int)replicas.size(), micro_batches);
+		dataset_t::iterator first = start;
+
+		pool.parallel_for(active, [&](int r) {
+				tracer_t::span_t span("replica", "trainer", r);
+				model_t & m = *replicas[r];
+				if (!staging[r].first) {
+					staging[r].first.reset(new tensor_t<double>(m.get_plan()[0]->in.size));
+					staging[r].second.reset(new tensor_t<double>(m.get_plan().back()->out.size));
+				}
+				for (int mb = r, k = 0; mb < micro_batches; mb += active, k++) {
+					tensor_t<double> * d;
+					tensor_t<double> * l;
+					model_t::gather_micro_batch(first + mb * cases, *staging[r].first, *staging[r].second, d, l);
+					m.accumulate_micro_batch(*d, *l, scale, k > 0);
+				}
+			});
+
+		all_reduce(active);
+		master.set_accumulate_grads(false);
+		master.fix_weights(false);
+
+		start += micro_batches * cases;
+		return micro_batches * batch;
+	}
+
+	// Sum the gradients of replicas [0, active) into replica 0
+	// (the master).  In the round with stride s, replica r adds in
+	// replica r + s, for every r that's a multiple of 2s, and the
+	// pairs in a round run in parallel.
+	void all_reduce(int active) {
+		tracer_t::span_t span("all_reduce", "trainer");
+		for (int stride = 1; stride < active; stride *= 2) {
+			std::vector<std::pair<int, int>> pairs;
+			for (int r = 0; r + stride < active; r += 2 * stride) {
+				pairs.push_back({r, r + stride});
+			}
+			pool.parallel_for(pairs.size(), [&](int p) {
+					model_t & to = *replicas[pairs[p].first];
+					model_t & from = *replicas[pairs[p].second];
+					for (uint i = 0; i < to.layers.size(); i++) {
+						to.layers[i]->add_grads(*from.layers[i]);
+					}
+				});
+		}
+	}
+
+private:
+	std::vector<std::unique_ptr<model_t>> owned_models;
+	std::vector<std::unique_ptr<layer_t>> owned_layers;
+	// Per-replica buffers for assembling micro-batches.
+	std::vector<std::pair<std::unique_ptr<tensor_t<double>>, std::unique_ptr<tensor_t<double>>>> staging;
+};
+
+#ifdef INCLUDE_TESTS
+namespace CNNTest {
+
+	static model_t * build_data_parallel_test_model(std::vector<layer_t*> & owned) {
+		srand(42);
+		std::vector<layer_t*> l;
+		l.push_back(new conv_layer_t( 1, 3, 4, 0, tdsize(12,12,2,2) ));
+		l.push_back(new relu_layer_t( l.back()->out.size ));
+		l.push_back(new pool_layer_t( 2, 2, 0, l.back()->out.size ));
+		l.push_back(new fc_layer_t( l.back()->out.size, 5 ));
+		model_t * m = new model_t;
+		for (auto i: l) {
+			m->add_layer(*i);
+			owned.push_back(i);
+		}
+		return m;
+	}
+
+	TEST_F(CNNTest, data_parallel) {
+		dataset_t ds;
+		srand(7);
+		for (int i = 0; i < 24; i++) {
+			tensor_t<double> data(12,12,2,1);
+			tensor_t<double> label(5,1,1,1);
+			randomize(data);
+			label(i % 5,0,0) = 1;
+			ds.add(data, label);
+		}
+
+		std::vector<layer_t*> owned;
+		model_t * serial = build_data_parallel_test_model(owned);
+		model_t * one = build_data_parallel_test_model(owned);
+		model_t * four[2] = {build_data_parallel_test_model(owned), build_data_parallel_test_model(owned)};
+
+		data_parallel_trainer_t t1(*one, 1);
+		data_parallel_trainer_t t4a(*four[0], 4);
+		data_parallel_trainer_t t4b(*four[1], 4);
+		for (int step = 0; step < 2; step++) {
+			auto a = ds.begin() + step * 12, b = a, c = a, d = a;
+			EXPECT_EQ(serial->train_batch(ds, a, 12), 12);
+			EXPECT_EQ(t1.train_batch(ds, b, 12), 12);
+			EXPECT_EQ(t4a.train_batch(ds, c, 12), 12);
+			EXPECT_EQ(t4b.train_batch(ds, d, 12), 12);
+			EXPECT_EQ(d, ds.begin() + (step + 1) * 12);
+		}
+
+		auto & serial_w = static_cast<fc_layer_t*>(serial->layers[3])->weights;
+		auto & one_w = static_cast<fc_layer_t*>(one->layers[3])->weights;
+		auto & a_w = static_cast<fc_layer_t*>(four[0]->layers[3])->weights;
+		auto & b_w = static_cast<fc_layer_t*>(four[1]->layers[3])->weights;
+
+		// One thread is the serial code, and four threads are
+		// bit-for-bit reproducible and match it up to rounding.
+		EXPECT_EQ(memcmp(serial_w.data, one_w.data, serial_w.calculate_data_size()), 0);
+		EXPECT_EQ(memcmp(a_w.data, b_w.data, a_w.calculate_data_size()), 0);
+		EXPECT_EQ(serial_w, a_w);
+		EXPECT_EQ(static_cast<conv_layer_t*>(serial->layers[0])->filters,
+			  static_cast<conv_layer_t*>(four[0]->layers[0])->filters);
+
+		// The replicas see the master's weights.
+		auto & replica_w = static_cast<fc_layer_t*>(t4a.replicas[3]->layers[3])->weights;
+		EXPECT_EQ(replica_w.data, a_w.data);
+
+		for (auto l: owned) {
+			delete l;
+		}
+		delete serial;
+		delete one;
+		delete four[0];
+		delete four[1];
+	}
+
+	TEST_F(CNNTest, data_parallel_trace) {
+		dataset_t ds;
+		for (int i = 0; i < 8; i++) {
+			tensor_t<double> data(12,12,2,1);
+			tensor_t<double> label(5,1,1,1);
+			randomize(data);
+			label(i % 5,0,0) = 1;
+			ds.add(data, label);
+		}
+		std::vector<layer_t*> owned;
+		std::unique_ptr<model_t> model(build_data_parallel_test_model(owned));
+		data_parallel_trainer_t trainer(*model, 4);
+
+		tracer_t::clear();
+		auto start = ds.begin();
+		trainer.train_batch(ds, start, 8);
+		EXPECT_EQ(tracer_t::size(), 0u);
+
+		tracer_t::enable(true);
+		start = ds.begin();
+		trainer.train_batch(ds, start, 8);
+		tracer_t::enable(false);
+
+		std::string json = tracer_t::json();
+		for (auto name: {"replica", "micro_batch", "gather", "all_reduce", "update", "activate", "calc_grads", "fix_weights"}) {
+			EXPECT_NE(json.find(std::string("\"name\": \"") + name + "\""), std::string::npos) << name;
+		}
+		// Each of the four threads ran a replica.
+		std::set<std::string> tids;
+		for (size_t p = json.find("\"replica\""); p != std::string::npos; p = json.find("\"replica\"", p + 1)) {
+			size_t t = json.find("\"tid\": ", p) + 7;
+			tids.insert(json.substr(t, json.find(',', t) - t));
+		}
+		EXPECT_EQ(tids.size(), 4u);
+		tracer_t::clear();
+
+		for (auto l: owned) {
+			delete l;
+		}
+	}
+}
+#endif
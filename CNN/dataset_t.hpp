@@ -1,6 +1,7 @@
 #pragma once
 
 #include"tensor_t.hpp"
+#include "tracer_t.hpp"
 #include <fstream>
 
 // test_case_t holds an input and it's label, both as tensors.
@@ -120,36 +121,40 @@ struct dataset_t
 		}
 	}
 
+	// Group the test cases into batches of `new_batch_size`.  If
+	// the last batch would be short, those test cases are left
+	// out.
 	dataset_t batched_copy(int new_batch_size) {
 		throw_assert(data_size.b==1, "Trying to batch an already batched dataset.");
+		tracer_t::span_t span("batched_copy", "data");
 		dataset_t n;
 
 		// new sizes
 		tdsize new_data_size = data_size;
 		new_data_size.b = new_batch_size;
 
-		//tdsize new_label_size = label_size;
-		//new_label_size.b = new_batch_size;
+		tdsize new_label_size = label_size;
+		new_label_size.b = new_batch_size;
 
 		// batches
+		tensor_t<double> batch_data(new_data_size);
+		tensor_t<double> batch_label(new_label_size);
 		int batch_index = 0;
 		for (auto& t : test_cases ) {
-			tensor_t<double>* batch_data = new tensor_t<double>(new_data_size);
-			tensor_t<double>* batch_label = new tensor_t<double>(new_data_size);
 			for (int x = 0; x < data_size.x; x++ )
 				for (int y = 0; y < data_size.y; y++ )
 					for (int z = 0; z < data_size.z; z++ )
-						(*batch_data)(x, y, z, batch_index) = t.data(x, y, z);
+						batch_data(x, y, z, batch_index) = t.data(x, y, z);
 
 			for (int x = 0; x < label_size.x; x++ )
 				for (int y = 0; y < label_size.y; y++ )
 					for (int z = 0; z < label_size.z; z++ )
-						(*batch_label)(x, y, z, batch_index) = t.label(x, y, z);
+						batch_label(x, y, z, batch_index) = t.label(x, y, z);
 
 			batch_index += 1;
 
 			if (batch_index >= new_batch_size) {
-				n.add(*batch_data, *batch_label);
+				n.add(batch_data, batch_label);
 				batch_index = 0;
 			}
 		}
@@ -166,6 +171,7 @@ struct dataset_t
 
 	static dataset_t read(std::ifstream & in, std::vector<test_case_t>::size_type max_count = std::numeric_limits<std::vector<test_case_t>::size_type>::max()) {
 		throw_assert(in.good(), "Input file descriptor in bad state");
+		tracer_t::span_t span("read dataset", "data");
 		int file_version;
 		in.read((char*)&file_version, sizeof(file_version));
 		throw_assert(VERSION == file_version, "Reloading from old dataset version is not supported.  Current version: " << VERSION << ";  file version: " << file_version);
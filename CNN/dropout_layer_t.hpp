@@ -1,17 +1,56 @@
 #pragma once
-#include "layer_t.hpp"
+#include "elementwise_layer_t.hpp"
+#include "counter_rng.hpp"
+#include "parallel.hpp"
 
-class dropout_layer_t : public layer_t
+class dropout_layer_t : public elementwise_layer_t
 {
 public:
-	tensor_t<bool> hitmap;
+	/*
+	  dropout_layer_t zeros a random subset of its inputs during
+	  training.  Each element survives with probability
+	  `p_activation`, and survivors are scaled by 1/p_activation
+	  so the expected output matches the input.  That means that
+	  at inference time the layer is the identity, and it gets
+	  skipped entirely (see set_training()).
+
+	  The random choices come from counter_rng(), keyed by the
+	  layer's `seed` and the forward pass number (`step`), with
+	  the element index as the counter.  Every element's choice
+	  is independent of the others, so the mask can be computed
+	  in any order (or split across threads), and there's no
+	  shared state like rand()'s.  `hitmap` records the choices,
+	  one bit per element of the whole batch.
+
+	  The mask is built a 64-bit word at a time without
+	  branches.  If `pool` is set, spans of at least
+	  `parallel_min` elements are split across its threads, on
+	  word boundaries so no two threads share a word of
+	  `hitmap`.  The mask doesn't depend on the number of
+	  threads.
+	*/
+	bitmask_t hitmap;
 	const float p_activation;
+	uint64_t seed;
+	uint64_t step;
+	bool training;
+	bool bypassed; // True if the last activate() skipped the layer.
+	bool replaying;
+	thread_pool_t * pool; // Not owned.  Replicas don't get it.
 
-	dropout_layer_t( tdsize in_size, float p_activation )
+	static const size_t parallel_min = 1 << 16;
+
+	dropout_layer_t( tdsize in_size, float p_activation, bool in_place = false )
 		:
-		layer_t(in_size, in_size),
-		hitmap( in_size.x, in_size.y, in_size.z ),
-		p_activation( p_activation )
+		elementwise_layer_t(in_size, in_place),
+		hitmap( in.element_count() ),
+		p_activation( p_activation ),
+		seed( (uint64_t(rand()) << 32) ^ uint64_t(rand()) ),
+		step( 0 ),
+		training( true ),
+		bypassed( false ),
+		replaying( false ),
+		pool( nullptr )
 		{
 			throw_assert(p_activation >= 0 && p_activation <= 1.0, "activation level should be betwene 0.0 and 1.0");
 		}
@@ -20,6 +59,14 @@ public:
 		return hitmap.get_total_memory_size() + layer_t::get_total_memory_size();
 	}
 	
+	// Replicas draw their own masks.
+	layer_t * replicate() const {
+		dropout_layer_t * r = new dropout_layer_t(*this);
+		r->seed = (uint64_t(rand()) << 32) ^ uint64_t(rand());
+		r->pool = nullptr;
+		return r;
+	}
+
 	std::string kind_str() const {
 		return "dropout_layer_t";
 	}
@@ -42,26 +89,118 @@ public:
 		return !(*this == o);
 	}
 
+	void change_batch_size(int new_batch_size) {
+		elementwise_layer_t::change_batch_size(new_batch_size);
+		hitmap.resize(in.element_count());
+	}
+
+	void set_training(bool training) {
+		this->training = training;
+	}
+
+	bool aliases_input() const {
+		return in_place || !training;
+	}
+
+	// Replaying uses the same step, and so the same mask.
+	void set_replaying(bool replaying) {
+		this->replaying = replaying;
+	}
+
+	void use_buffers(double * out, double * grads_out) {
+		elementwise_layer_t::use_buffers(out, grads_out);
+		bypassed = false;
+	}
+
 	void activate(tensor_t<double>& in ) {
-		copy_input(in);
-		for ( int i = 0; i < in.size.x*in.size.y*in.size.z; i++ )
-		{
-			bool active = (rand() % RAND_MAX) / double( RAND_MAX ) <= p_activation;
-			hitmap.data[i] = active;
-			out.data[i] = active ? in.data[i] : 0.0f;
+		if (!training) {
+			bind_input(in);
+			out.view(in);
+			bypassed = true;
+			return;
 		}
+		if (!in_place && bypassed) {
+			// We were skipped last time, so we need our own
+			// buffer back.
+			out = tensor_t<double>(this->in.size);
+			bypassed = false;
+		}
+		elementwise_layer_t::activate(in);
 	}
 
-	void fix_weights()
-		{
-		
+	void begin_forward() {
+		if (training && !replaying) {
+			step++;
 		}
+	}
 
-	void calc_grads(const tensor_t<double>& grad_next_layer )
-		{
-			for ( int i = 0; i < in.size.x*in.size.y*in.size.z; i++ )
-				grads_out.data[i] = hitmap.data[i] ? grad_next_layer.data[i] : 0.0f;
+	// Elements survive if their 32 bits of random number are
+	// below this.  Element i gets the top half of
+	// counter_rng(key, i / 2) if i is even, the bottom if odd.
+	uint64_t keep_threshold() const {
+		return uint64_t(double(p_activation) * 4294967296.0);
+	}
+
+	double keep_scale() const {
+		return p_activation > 0 ? 1.0 / p_activation : 0.0;
+	}
+
+	void forward_span(double * data, size_t begin, size_t end) {
+		if (!training) {
+			return;
+		}
+		if (!pool || pool->thread_count == 1 || end - begin < parallel_min) {
+			mask_span(data, begin, end);
+			return;
+		}
+		const int parts = pool->thread_count;
+		const size_t chunk = ROUND_UP_IDIV(end - begin, (size_t)parts);
+		auto cut = [&](int p) {
+			return p == parts ? end : std::min(end, (begin + p * chunk + 63) / 64 * 64);
+		};
+		pool->parallel_for(parts, [&](int p) {
+				mask_span(data, cut(p), cut(p + 1));
+			});
+	}
+
+	// Draw the mask for data[begin, end) into `hitmap` and apply it.
+	void mask_span(double * data, size_t begin, size_t end) {
+		const uint64_t key = counter_rng(seed, step);
+		const uint64_t threshold = keep_threshold();
+		const double scale = keep_scale();
+		size_t i = begin;
+		while (i < end) {
+			// Bits [first, last) of word w.
+			const size_t w = i / 64;
+			const size_t base = w * 64;
+			const size_t first = i - base;
+			const size_t last = std::min(end - base, (size_t)64);
+			// The whole word, two elements per random number
+			// (one per half), then keep the part we own.
+			uint64_t bits = 0;
+			for (size_t j = 0; j < 64; j += 2) {
+				uint64_t r = counter_rng(key, (base + j) / 2);
+				bits |= uint64_t((r >> 32) < threshold) << j;
+				bits |= uint64_t((r & 0xffffffff) < threshold) << (j + 1);
+			}
+			const uint64_t span = (last == 64 ? ~uint64_t(0) : (uint64_t(1) << last) - 1) & ~((uint64_t(1) << first) - 1);
+			bits &= span;
+			hitmap.words[w] = (hitmap.words[w] & ~span) | bits;
+			for (size_t j = first; j < last; j++) {
+				data[base + j] = (bits >> j) & 1 ? data[base + j] * scale : 0.0;
+			}
+			i = base + last;
+		}
+	}
+
+	void backward_span(double * data, size_t begin, size_t end) {
+		if (!training) {
+			return;
 		}
+		const double scale = keep_scale();
+		for ( size_t i = begin; i < end; i++ )
+			data[i] = hitmap.get(i) ? data[i] * scale : 0.0;
+	}
 	
 	std::string regression_code() const {
 		std::stringstream ss;
@@ -118,6 +257,124 @@ namespace CNNTest{
 
 	}
 
+	TEST_F(CNNTest, dropout_in_place) {
+		tdsize size(10,10,10,2);
+		tensor_t<double> in(size);
+		randomize(in);
+		tensor_t<double> next_grads(size);
+		randomize(next_grads);
+
+		srand(42);
+		dropout_layer_t copying(size, 0.5);
+		copying.activate(in);
+		copying.calc_grads(next_grads);
+
+		srand(42);
+		dropout_layer_t in_place(size, 0.5, true);
+		tensor_t<double> producer_out(in);
+		in_place.activate(producer_out);
+		in_place.calc_grads(next_grads);
+
+		EXPECT_EQ(in_place.out.data, producer_out.data);
+		EXPECT_EQ(copying.out, producer_out);
+		EXPECT_EQ(copying.hitmap, in_place.hitmap);
+		EXPECT_EQ(copying.grads_out, in_place.grads_out);
+	}
+
+	TEST_F(CNNTest, dropout_counter_rng) {
+		tdsize size(16,16,4,4);
+		tensor_t<double> in(size);
+		for (size_t i = 0; i < in.element_count(); i++)
+			in.data[i] = 1.0;
+
+		dropout_layer_t a(size, 0.25);
+		dropout_layer_t b(size, 0.25);
+		b.seed = a.seed;
+
+		// Same seed and step, same mask.
+		a.activate(in);
+		b.activate(in);
+		EXPECT_EQ(a.hitmap, b.hitmap);
+		EXPECT_EQ(a.out, b.out);
+
+		// The next step gets a new one.
+		bitmask_t first = a.hitmap;
+		a.activate(in);
+		EXPECT_NE(first, a.hitmap);
+
+		// Roughly p_activation of the elements survive, and
+		// they are scaled up so the expected sum is unchanged.
+		int kept = 0;
+		double sum = 0;
+		for (size_t i = 0; i < a.hitmap.size(); i++) {
+			kept += a.hitmap.get(i);
+			sum += a.out.data[i];
+		}
+		double n = in.element_count();
+		EXPECT_NEAR(kept / n, 0.25, 0.03);
+		EXPECT_NEAR(sum / n, 1.0, 0.12);
+
+		// Each item in the batch gets its own mask.
+		size_t per_item = size.x * size.y * size.z;
+		bool same = true;
+		for (size_t i = 0; i < per_item; i++)
+			same = same && a.hitmap.get(i) == a.hitmap.get(i + per_item);
+		EXPECT_FALSE(same);
+	}
+
+	TEST_F(CNNTest, dropout_parallel) {
+		// Big enough to split, and not a multiple of 64.
+		tdsize size(61,37,10,3);
+		ASSERT_GE(size.x * size.y * size.z * size.b, (int)dropout_layer_t::parallel_min);
+		tensor_t<double> in(size);
+		randomize(in);
+
+		dropout_layer_t serial(size, 0.3);
+		serial.activate(in);
+		for (int threads: {2, 3, 4, 7}) {
+			thread_pool_t pool(threads);
+			dropout_layer_t split(size, 0.3);
+			split.seed = serial.seed;
+			split.pool = &pool;
+			split.activate(in);
+			EXPECT_EQ(split.hitmap, serial.hitmap) << threads;
+			EXPECT_EQ(split.out, serial.out) << threads;
+		}
+
+		// Unaligned spans (like fused_elementwise_layer_t's
+		// blocks) leave the rest of the word alone.
+		dropout_layer_t pieces(size, 0.3);
+		pieces.seed = serial.seed;
+		pieces.begin_forward();
+		tensor_t<double> data(in);
+		for (size_t b = 0; b < data.element_count(); b += 1000) {
+			pieces.forward_span(data.data, b, std::min(data.element_count(), b + 1000));
+		}
+		EXPECT_EQ(pieces.hitmap, serial.hitmap);
+		EXPECT_EQ(data, serial.out);
+	}
+
+	TEST_F(CNNTest, dropout_inference) {
+		tdsize size(10,10,3,2);
+		tensor_t<double> in(size);
+		randomize(in);
+		tensor_t<double> next_grads(size);
+		randomize(next_grads);
+
+		dropout_layer_t l(size, 0.5);
+		l.set_training(false);
+		l.activate(in);
+		EXPECT_EQ(l.out.data, in.data);
+		l.calc_grads(next_grads);
+		EXPECT_EQ(l.grads_out, next_grads);
+
+		// Back in training mode the layer owns its output again.
+		l.set_training(true);
+		l.activate(in);
+		EXPECT_NE(l.out.data, in.data);
+		EXPECT_NE(l.out, in);
+	}
+
 
 
 }  // namespace
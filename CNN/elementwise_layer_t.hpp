@@ -0,0 +1,100 @@
+#pragma once
+#include "layer_t.hpp"
+#include "bitmask_t.hpp"
+
+class elementwise_layer_t : public layer_t
+{
+public:
+	/*
+	  elementwise_layer_t is the base class for layers (like relu
+	  and dropout) where each output depends only on the input at
+	  the same position.
+
+	  Subclasses implement forward_span() and backward_span(),
+	  which transform a range of a buffer in place.  The base
+	  class takes care of getting the data into that buffer.
+
+	  Because the math is per-element, these layers can run "in
+	  place": if `in_place` is set, activate() overwrites the
+	  previous layer's `out` instead of copying it, and `in` and
+	  `out` are both views of that buffer.  The layer then only
+	  holds `grads_out` and whatever small per-element state (e.g.,
+	  a bitmask) it needs for calc_grads().
+
+	  In-place layers destroy their input, so they should only
+	  follow layers whose calc_grads() doesn't look at their own
+	  `out` (everything except softmax), and not be the first
+	  layer in a model if you want to keep the input.
+	*/
+	const bool in_place;
+
+	elementwise_layer_t(const tdsize & in_size, bool in_place)
+		:
+		layer_t(in_size, in_size),
+		in_place(in_place)
+	{
+		if (in_place) {
+			// There's no producer to alias until the first
+			// activate(), so don't hang on to two buffers we
+			// will never use.
+			out.view(grads_out);
+			in.view(grads_out);
+		}
+	}
+
+	// Apply the layer to data[begin, end) in place.  The indexes
+	// are positions in the whole (batched) tensor, so subclasses
+	// can use them to index their per-element state.
+	virtual void forward_span(double * data, size_t begin, size_t end) = 0;
+
+	// Turn the incoming gradients in data[begin, end) into this
+	// layer's gradients, in place.
+	virtual void backward_span(double * data, size_t begin, size_t end) = 0;
+
+	bool aliases_input() const {
+		return in_place;
+	}
+
+	// Called once per forward pass, before the forward_span()
+	// calls that make it up.
+	virtual void begin_forward() {}
+
+	void activate(tensor_t<double>& in ) {
+		begin_forward();
+		bind_input(in);
+		if (in_place) {
+			out.view(in);
+		} else {
+			memcpy(out.data, in.data, in.calculate_data_size());
+		}
+		forward_span(out.data, 0, out.element_count());
+	}
+
+	void fix_weights()
+	{
+
+	}
+
+	void calc_grads(const tensor_t<double>& grad_next_layer )
+	{
+		throw_assert(grad_next_layer.size == out.size, "mismatched input");
+		memcpy(grads_out.data, grad_next_layer.data, grad_next_layer.calculate_data_size());
+		backward_span(grads_out.data, 0, grads_out.element_count());
+	}
+
+	void freeze() {
+		layer_t::freeze();
+		if (in_place) {
+			out.view(grads_out);
+			in.view(grads_out);
+		}
+	}
+
+	void change_batch_size(int new_batch_size) {
+		layer_t::change_batch_size(new_batch_size);
+		if (in_place) {
+			out.view(grads_out);
+			in.view(grads_out);
+		}
+	}
+};
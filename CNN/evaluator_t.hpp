@@ -0,0 +1,282 @@
+#pragma once
+#include <memory>
+#include <vector>
+#include <string.h>
+#include "exec_context_t.hpp"
+#include "parallel.hpp"
+
+class evaluator_t
+{
+public:
+	/*
+	  evaluator_t measures how well a model does on a test set.
+	  It packs the test cases into batches, and runs the batches
+	  on several threads at once, each with its own
+	  exec_context_t, so the model only needs to be set up for
+	  inference (set_training(false) or freeze()), and its own
+	  batch size doesn't matter.
+
+	  Each thread tallies its own result_t, and we add them up at
+	  the end, so the threads never share anything they write.
+	  The tallies are counts, so the result doesn't depend on the
+	  number of threads or the batch size.
+	*/
+	struct result_t {
+		int k;                      // For top_k_correct.
+		int classes;
+		size_t cases;
+		size_t correct;
+		size_t top_k_correct;       // The answer was among the k highest outputs.
+		std::vector<size_t> confusion; // classes x classes.  Row is the answer, column the guess.
+
+		result_t(int classes = 0, int k = 1)
+			: k(k), classes(classes), cases(0), correct(0), top_k_correct(0), confusion(classes * classes, 0) {}
+
+		size_t & confused(int answer, int guess) {
+			return confusion[answer * classes + guess];
+		}
+
+		size_t confused(int answer, int guess) const {
+			return confusion[answer * classes + guess];
+		}
+
+		double accuracy() const {
+			return cases ? (correct + 0.0) / cases : 0;
+		}
+
+		double top_k_accuracy() const {
+			return cases ? (top_k_correct + 0.0) / cases : 0;
+		}
+
+		result_t & operator+=(const result_t & other) {
+			cases += other.cases;
+			correct += other.correct;
+			top_k_correct += other.top_k_correct;
+			for (uint i = 0; i < confusion.size(); i++) {
+				confusion[i] += other.confusion[i];
+			}
+			return *this;
+		}
+
+		// The confusion matrix as CSV, one row per answer.
+		std::string confusion_csv() const {
+			std::stringstream ss;
+			ss << "answer";
+			for (int g = 0; g < classes; g++) {
+				ss << "," << g;
+			}
+			ss << "\n";
+			for (int a = 0; a < classes; a++) {
+				ss << a;
+				for (int g = 0; g < classes; g++) {
+					ss << "," << confused(a, g);
+				}
+				ss << "\n";
+			}
+			return ss.str();
+		}
+
+		std::string report() const {
+			std::stringstream ss;
+			ss << "Accuracy: " << accuracy() << ": " << correct << "/" << cases << "\n";
+			ss << "Top-" << k << " accuracy: " << top_k_accuracy() << ": " << top_k_correct << "/" << cases << "\n";
+			return ss.str();
+		}
+	};
+
+	const model_t & model;
+	const int batch_size;
+	thread_pool_t pool;
+
+	evaluator_t(const model_t & model, int threads, int batch_size = 32)
+		:
+		model(model),
+		batch_size(batch_size),
+		pool(threads)
+	{
+		throw_assert(batch_size > 0, "Batch size must be positive: " << batch_size);
+		tdsize batch_in = model.layers.front()->in.size;
+		batch_in.b = batch_size;
+		for (int t = 0; t < pool.thread_count; t++) {
+			contexts.emplace_back(new exec_context_t(model, batch_size));
+			batches.emplace_back(batch_in);
+		}
+	}
+
+	// Classes are the elements of the labels, and the answer is
+	// the biggest one (like the guess).
+	result_t evaluate(const dataset_t & ds, int k = 5) {
+		throw_assert(ds.data_size.b == 1, "evaluator_t needs an unbatched dataset.");
+		const tdsize & in = batches[0].size;
+		throw_assert(ds.data_size.x == in.x && ds.data_size.y == in.y && ds.data_size.z == in.z, "Dataset doesn't match the model. dataset: " << ds.data_size << "; model: " << in);
+		const int classes = ds.label_size.x * ds.label_size.y * ds.label_size.z;
+		const tdsize & outputs = model.layers.back()->out.size;
+		throw_assert(outputs.x * outputs.y * outputs.z == classes, "The model has " << outputs.x * outputs.y * outputs.z << " outputs, but the labels have " << classes << " classes.");
+		const int batch_count = ROUND_UP_IDIV((int)ds.size(), batch_size);
+		const size_t case_bytes = ds.data_size.x * ds.data_size.y * ds.data_size.z * sizeof(double);
+		std::vector<result_t> tallies(pool.thread_count, result_t(classes, k));
+
+		pool.parallel_for(batch_count, [&](int i) {
+				tracer_t::span_t span("evaluate", "evaluator", i);
+				// parallel_for()'s schedule is static, so this is
+				// the only iteration running on this thread.
+				const int t = i % pool.thread_count;
+				tensor_t<double> & batch = batches[t];
+				result_t & tally = tallies[t];
+				const int first = i * batch_size;
+				const int count = std::min(batch_size, (int)ds.size() - first);
+
+				// A short last batch leaves stale inputs in the
+				// rest of the rows, and we ignore their outputs.
+				for (int b = 0; b < count; b++) {
+					memcpy(&batch.data[b * case_bytes / sizeof(double)], ds.test_cases[first + b].data.data, case_bytes);
+				}
+				tensor_t<double> & out = contexts[t]->apply(batch);
+				std::vector<tdsize> guesses = out.argmax_b();
+
+				for (int b = 0; b < count; b++) {
+					const tensor_t<double> & label = ds.test_cases[first + b].label;
+					tdsize a = label.argmax();
+					tdsize g = guesses[b];
+					int answer = label.linearize(a.x, a.y, a.z);
+					int guess = out.linearize(g.x, g.y, g.z);
+					tally.cases++;
+					tally.correct += guess == answer;
+					tally.confused(answer, guess)++;
+
+					// It's in the top k if fewer than k outputs beat it.
+					const double * row = &out.data[b * classes];
+					int beaten_by = 0;
+					for (int c = 0; c < classes; c++) {
+						beaten_by += row[c] > row[answer];
+					}
+					tally.top_k_correct += beaten_by < k;
+				}
+			});
+
+		result_t result(classes, k);
+		for (auto & t: tallies) {
+			result += t;
+		}
+		return result;
+	}
+
+private:
+	std::vector<std::unique_ptr<exec_context_t>> contexts;
+	std::vector<tensor_t<double>> batches; // One input buffer per thread.
+};
+
+#ifdef INCLUDE_TESTS
+namespace CNNTest {
+
+	TEST_F(CNNTest, evaluator) {
+		srand(17);
+		conv_layer_t  l1( 1, 5, 8, 0, tdsize(28,28,1,1) );
+		relu_layer_t  l2( l1.out.size );
+		pool_layer_t  l3( 2, 2, 0, l2.out.size );
+		fc_layer_t    l4( l3.out.size, 10 );
+		model_t model;
+		model.add_layer(l1);
+		model.add_layer(l2);
+		model.add_layer(l3);
+		model.add_layer(l4);
+
+		// 103 cases, so the last batch is short.
+		dataset_t ds;
+		for (int i = 0; i < 103; i++) {
+			tensor_t<double> data(28,28,1,1);
+			randomize(data);
+			tensor_t<double> label(10,1,1,1);
+			label.clear();
+			label(rand() % 10, 0, 0) = 1;
+			ds.add(data, label);
+		}
+
+		for (bool frozen: {false, true}) {
+			if (frozen) {
+				model.freeze();
+			} else {
+				model.set_training(false);
+			}
+
+			// The serial loop from simple().
+			evaluator_t::result_t expected(10, 3);
+			for (auto & t: ds) {
+				tensor_t<double> & out = model.apply(t.data);
+				int answer = t.label.argmax().x;
+				int guess = out.argmax().x;
+				int beaten_by = 0;
+				for (int c = 0; c < 10; c++) {
+					beaten_by += out(c, 0, 0) > out(answer, 0, 0);
+				}
+				expected.cases++;
+				expected.correct += guess == answer;
+				expected.top_k_correct += beaten_by < 3;
+				expected.confused(answer, guess)++;
+			}
+			EXPECT_LT(expected.top_k_correct, expected.cases);
+
+			for (int threads: {1, 4}) {
+				for (int batch: {1, 16}) {
+					evaluator_t evaluator(model, threads, batch);
+					evaluator_t::result_t r = evaluator.evaluate(ds, 3);
+					EXPECT_EQ(r.cases, 103u);
+					EXPECT_EQ(r.correct, expected.correct) << threads << " " << batch;
+					EXPECT_EQ(r.top_k_correct, expected.top_k_correct) << threads << " " << batch;
+					EXPECT_EQ(r.confusion, expected.confusion) << threads << " " << batch;
+					EXPECT_DOUBLE_EQ(r.accuracy(), (expected.correct + 0.0) / 103);
+				}
+			}
+			std::string csv = expected.confusion_csv();
+			EXPECT_EQ(std::count(csv.begin(), csv.end(), '\n'), 11);
+		}
+
+		// Labels with fewer classes than the model has outputs.
+		dataset_t small;
+		for (auto & t: ds) {
+			tensor_t<double> label(4,1,1,1);
+			label(t.label.argmax().x % 4, 0, 0) = 1;
+			small.add(t.data, label);
+		}
+		evaluator_t evaluator(model, 2);
+		EXPECT_THROW(evaluator.evaluate(small), AssertionFailureException);
+	}
+
+	// simple()'s order: train, then evaluate.  The model's first
+	// layer was last run on train_batch()'s staging buffer, which
+	// is gone by the time the evaluator replicates it.
+	TEST_F(CNNTest, evaluator_after_training) {
+		srand(19);
+		conv_layer_t  l1( 1, 5, 4, 0, tdsize(12,12,1,4) );
+		fc_layer_t    l2( l1.out.size, 10 );
+		model_t model;
+		model.add_layer(l1);
+		model.add_layer(l2);
+
+		dataset_t ds;
+		for (int i = 0; i < 40; i++) {
+			tensor_t<double> data(12,12,1,1);
+			randomize(data);
+			tensor_t<double> label(10,1,1,1);
+			label.clear();
+			label(rand() % 10, 0, 0) = 1;
+			ds.add(data, label);
+		}
+		dataset_t::iterator it = ds.begin();
+		EXPECT_EQ(model.train_batch(ds, it, 8), 8);
+		model.set_training(false);
+
+		evaluator_t evaluator(model, 2, 8);
+		evaluator_t::result_t r = evaluator.evaluate(ds, 3);
+
+		// One at a time.
+		exec_context_t single(model, 1);
+		size_t correct = 0;
+		for (auto & t: ds) {
+			correct += single.apply(t.data).argmax().x == t.label.argmax().x;
+		}
+		EXPECT_EQ(r.cases, 40u);
+		EXPECT_EQ(r.correct, correct);
+	}
+}
+#endif
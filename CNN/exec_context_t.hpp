@@ -0,0 +1,142 @@
+#pragma once
+#include <memory>
+#include <vector>
+#include "model_t.hpp"
+
+class exec_context_t
+{
+public:
+	/*
+	  exec_context_t holds everything one inference needs apart
+	  from the weights: each layer's activations and scratch
+	  buffers, the plan, and the memory arena.  Each thread that
+	  wants to run a model makes its own context, and then any
+	  number of threads can run the same model at once without
+	  locks, each with its own context.
+
+	  Under the hood, a context is a replica of the model (see
+	  model_t::replicate()) in inference mode, whose layers share
+	  the model's parameters and drop their gradients and
+	  optimizer state (layer_t::release_gradients()).  So a
+	  context costs about as much memory as the model's
+	  activations, not its weights.  For the smallest contexts,
+	  freeze() the model first.
+
+	  The contexts see updates to the weights (e.g., if the model
+	  keeps training), but they hold pointers to the model's
+	  parameter tensors, so make them after anything that
+	  replaces those tensors (freeze(), or weight_file_t::load()),
+	  and don't let them outlive the model.  Making a context
+	  reads the model, so don't do it while the model itself is
+	  running.
+
+	  A context can also run a different batch size than the
+	  model (e.g., to evaluate a model that was trained one input
+	  at a time in big batches).  Pass it as `batch_size`.
+	*/
+	const model_t & model;
+
+	exec_context_t(const model_t & model, int batch_size = 0)
+		: model(model), replica(model.replicate(owned_layers))
+	{
+		if (batch_size && batch_size != model.layers.front()->in.size.b) {
+			replica->change_batch_size(batch_size);
+		}
+		for (auto & l: owned_layers) {
+			l->release_gradients();
+		}
+		replica->set_training(false);
+	}
+
+	// model_t::apply(), with our buffers.  The result is ours too,
+	// until the next call.
+	tensor_t<double> & apply(tensor_t<double> & data) {
+		return replica->apply(data);
+	}
+
+	size_t get_total_memory_size() const {
+		return replica->get_total_memory_size();
+	}
+
+private:
+	std::vector<std::unique_ptr<layer_t>> owned_layers;
+	std::unique_ptr<model_t> replica;
+};
+
+#ifdef INCLUDE_TESTS
+namespace CNNTest {
+
+	TEST_F(CNNTest, exec_context) {
+		srand(13);
+		conv_layer_t  l1( 1, 5, 8, 0, tdsize(28,28,1,1) );
+		relu_layer_t  l2( l1.out.size );
+		pool_layer_t  l3( 2, 2, 0, l2.out.size );
+		fc_layer_t    l4( l3.out.size, 100 );
+		relu_layer_t  l5( l4.out.size, true );
+		fc_layer_t    l6( l5.out.size, 10 );
+		model_t model;
+		model.add_layer(l1);
+		model.add_layer(l2);
+		model.add_layer(l3);
+		model.add_layer(l4);
+		model.add_layer(l5);
+		model.add_layer(l6);
+
+		std::vector<tensor_t<double>> inputs;
+		for (int i = 0; i < 32; i++) {
+			inputs.emplace_back(28,28,1,1);
+			randomize(inputs.back());
+		}
+
+		for (bool frozen: {false, true}) {
+			if (frozen) {
+				model.freeze();
+			} else {
+				model.set_training(false);
+			}
+			// Run copies that go away right after, so the model's
+			// first layer is left viewing freed memory when the
+			// contexts replicate it.
+			std::vector<tensor_t<double>> expected;
+			for (auto & in: inputs) {
+				tensor_t<double> copy(in);
+				expected.push_back(model.apply(copy));
+			}
+
+			// Four threads run the model at once, each with its
+			// own context.
+			const int threads = 4;
+			std::vector<int> wrong(threads, 0);
+			std::vector<size_t> memory(threads);
+			std::vector<std::thread> workers;
+			for (int t = 0; t < threads; t++) {
+				workers.emplace_back([&, t]() {
+						exec_context_t context(model);
+						for (int rep = 0; rep < 5; rep++) {
+							for (uint i = t; i < inputs.size(); i += threads) {
+								wrong[t] += context.apply(inputs[i]) != expected[i];
+							}
+						}
+						memory[t] = context.get_total_memory_size();
+					});
+			}
+			for (auto & w: workers) {
+				w.join();
+			}
+
+			// A context doesn't copy the weights (l4's alone are
+			// 1152x100 doubles).
+			size_t weights = 0;
+			for (auto l: model.layers) {
+				for (auto p: l->parameter_tensors()) {
+					weights += p->calculate_data_size();
+				}
+			}
+			for (int t = 0; t < threads; t++) {
+				EXPECT_EQ(wrong[t], 0) << "frozen=" << frozen;
+				EXPECT_LT(memory[t], weights / 2) << "frozen=" << frozen;
+			}
+		}
+	}
+}
+#endif
@@ -10,33 +10,90 @@ public:
 	tensor_t<double> activator_input; // Output the sum-the-weights stage.. 
 	tensor_t<double> weights; // 2d array of weight (tensor with depth == 1)
 	tensor_t<double> act_grad; // gradients for back prop.
-        tensor_t<double> old_act_grad;
+        tensor_t<double> old_act_grad; // Momentum, summed over the batch.
+	tensor_t<double> weight_grads; // Sum over the batch of act_grad * in.
+	tensor_t<double> act_grad_sum; // Sum over the batch of act_grad.
+	tensor_t<double> in_sum; // Sum over the batch of in.
+	tensor_t<double> packed_weights; // `weights` transposed, output-innermost (see freeze()).
 
 	fc_layer_t( tdsize in_size, int out_size)
 		:
 		layer_t(in_size, tdsize(out_size, 1, 1, in_size.b)),
 		activator_input(tdsize(out_size, 1, 1, in_size.b)),
-		weights( in_size.x*in_size.y*in_size.z, out_size, 1 ),
+		weights(new_parameters(tdsize( in_size.x*in_size.y*in_size.z, out_size, 1 ))),
         	act_grad(tdsize(out_size, 1, 1, in_size.b)),
-        	old_act_grad(act_grad.size)
+        	old_act_grad(tdsize(out_size, 1, 1, 1)),
+		weight_grads(weights.size),
+		act_grad_sum(old_act_grad.size),
+		in_sum(tdsize(in_size.x*in_size.y*in_size.z, 1, 1, 1)),
+		packed_weights(1,1,1,1)
 		{
 			int maxval = in_size.x * in_size.y * in_size.z;
 
+			if (!weights.is_released())
 			for ( int i = 0; i < out_size; i++ )
 				for ( int h = 0; h < in_size.x*in_size.y*in_size.z; h++ )
 					weights( h, i, 0 ) = 2.19722f / maxval * rand() / double( RAND_MAX );
 			// 2.19722f = f^-1(0.9) => x where [1 / (1 + exp(-x) ) = 0.9]
+			packed_weights.release(); // Until freeze().
 		}
 
 	void change_batch_size(int new_batch_size) {
-		std::cout << "Changing fc_layer batch_size" << std::endl;
 		layer_t::change_batch_size(new_batch_size);
-                tensor_t<double> new_act(tdsize(activator_input.size.x, 1, 1, new_batch_size));
-                activator_input = new_act;
-		tensor_t<double> new_act_grad(tdsize(out.size.x, 1, 1, in.size.b));
-		act_grad = new_act_grad;
-		tensor_t<double> new_old_act_grad(act_grad.size);
-		old_act_grad = new_old_act_grad;
+		if (frozen) {
+			return; // freeze() dropped them.
+		}
+		activator_input = tensor_t<double>(tdsize(out.size.x, 1, 1, new_batch_size));
+		act_grad = tensor_t<double>(tdsize(out.size.x, 1, 1, new_batch_size));
+	}
+
+	layer_t * replicate() const {
+		fc_layer_t * r = new fc_layer_t(*this);
+		r->weights.view(weights);
+		if (frozen) {
+			r->packed_weights.view(packed_weights);
+		}
+		return r;
+	}
+
+	// activate() walks the weights for each input across all the
+	// outputs, which is a stride of a whole row in `weights`.
+	// Transpose them so that's unit stride, and drop the
+	// gradients, momentum, and activator_input, which only back
+	// propagation needs.
+	void freeze() {
+		layer_t::freeze();
+		const bool unloaded = weights.is_released();
+		packed_weights = unloaded ? tensor_t<double>::released(tdsize(weights.size.y, weights.size.x, 1))
+			: tensor_t<double>(weights.size.y, weights.size.x, 1);
+		if (!unloaded)
+		for ( int n = 0; n < weights.size.y; n++ )
+			for ( int i = 0; i < weights.size.x; i++ )
+				packed_weights( n, i, 0 ) = weights( i, n, 0 );
+		weights.release();
+		activator_input.release();
+		release_gradients();
+	}
+
+	void release_gradients() {
+		act_grad.release();
+		old_act_grad.release();
+		weight_grads.release();
+		act_grad_sum.release();
+		in_sum.release();
+	}
+
+	void add_grads(const layer_t & other) {
+		auto & o = static_cast<const fc_layer_t &>(other);
+		for ( size_t n = 0; n < weight_grads.element_count(); n++ ) {
+			weight_grads.data[n] += o.weight_grads.data[n];
+		}
+		for ( size_t n = 0; n < act_grad_sum.element_count(); n++ ) {
+			act_grad_sum.data[n] += o.act_grad_sum.data[n];
+		}
+		for ( size_t n = 0; n < in_sum.element_count(); n++ ) {
+			in_sum.data[n] += o.in_sum.data[n];
+		}
 	}
 
 	double activator_function( double x ) {
@@ -51,7 +108,7 @@ public:
 	}
 #if(0)
 	void activate( tensor_t<double>& in ) {
-		copy_input(in);
+		bind_input(in);
 
 		for ( uint n = 0; n < activator_input.element_count(); n++ ) {
 			activator_input.data[n] = 0;
@@ -93,7 +150,11 @@ public:
 #endif
 
 	void activate( tensor_t<double>& in ) {
-		copy_input(in);
+		bind_input(in);
+		if (frozen) {
+			activate_packed(in);
+			return;
+		}
 
 		tdsize old_size = in.size;
 		tdsize old_out_size = out.size;
@@ -137,9 +198,30 @@ public:
 		out.size = old_out_size;
 	}
 
+	// Same arithmetic as activate(), with the sums going straight
+	// into `out`.
+	void activate_packed( const tensor_t<double>& in ) {
+		const int N = packed_weights.size.x;
+		const int I = packed_weights.size.y;
+		for ( int b = 0; b < out.size.b; b++ ) {
+			double * o = &out( 0, 0, 0, b );
+			const double * x = &in.data[(size_t)b * I];
+			std::fill(o, o + N, 0.0);
+			for ( int i = 0; i < I; i++ ) {
+				const double * w = &packed_weights( 0, i, 0 );
+				for ( int n = 0; n < N; n++ ) {
+					o[n] += x[i] * w[n];
+				}
+			}
+			for ( int n = 0; n < N; n++ ) {
+				o[n] = activator_function( o[n] );
+			}
+		}
+	}
+
 	void calc_grads( const tensor_t<double>& grad_next_layer ) {
-		
-		memset( grads_out.data, 0, grads_out.size.x * grads_out.size.y * grads_out.size.z * sizeof( double ) );
+		throw_assert(!frozen, "Can't compute gradients for a frozen fc_layer_t.");
+		grads_out.clear();
 
 		// Using the notation from activate():
 		//
@@ -215,6 +297,32 @@ public:
                 }
 
 		grads_out.size = in.size;
+
+		// Finally, collect what fix_weights() needs, summed over
+		// the batch (and over earlier calls, if we are
+		// accumulating).
+		tdsize old_in_size = in.size;
+		in.size.x = in.size.x * in.size.y * in.size.z;
+		in.size.y = 1;
+		in.size.z = 1;
+		if (!accumulate_grads) {
+			weight_grads.clear();
+			act_grad_sum.clear();
+			in_sum.clear();
+		}
+		for ( int b = 0; b < out.size.b; b++ ) {
+			for ( int i = 0; i < in.size.x; i++ ) {
+				in_sum(i, 0, 0) += in(i, 0, 0, b);
+			}
+			for ( int n = 0; n < weights.size.y; n++ ) {
+				double ag = act_grad(n, 0, 0, b);
+				act_grad_sum(n, 0, 0) += ag;
+				for ( int i = 0; i < weights.size.x; i++ ) {
+					weight_grads( i, n, 0 ) += ag * in(i, 0, 0, b);
+				}
+			}
+		}
+		in.size = old_in_size;
 	}
 	
 	void fix_weights() {
@@ -265,38 +373,76 @@ public:
 		// update_gradient() updates the old gradient with the
 		// new value.
 
-		tdsize old_in_size = in.size;
-		in.size.x = in.size.x * in.size.y * in.size.z;
-		in.size.y = 1;
-		in.size.z = 1;
-
-                for ( int b = 0; b < out.size.b; b++ ) {
-                //{ int b = 1;
-                        for ( int n = 0; n < weights.size.y; n++ ) {
-                                for ( int i = 0; i < weights.size.x; i++ ) {
-                                        double& w = weights( i, n, 0 );
-                                        double m = (act_grad(n, 0, 0, b) + old_act_grad(n, 0, 0, b) * MOMENTUM);
-                                        double g_weight = w - (LEARNING_RATE * m * in(i, 0, 0, b) + LEARNING_RATE * WEIGHT_DECAY * w);
-                                        w = g_weight;
-                                }
-                                old_act_grad(n, 0, 0, b) = act_grad(n, 0, 0, b) + old_act_grad(n, 0, 0, b) * MOMENTUM;
-                        }
-                }
-		in.size = old_in_size;
+		// For a batch, we apply one update using the sums from
+		// calc_grads().  The momentum term gets the same
+		// treatment:
+		//
+		// m * input = gradient * input + old_gradient * momentum * input
+		//
+		// so we use weight_grads for the first part and in_sum
+		// for the second.  With a single input, this is exactly
+		// the update above.
+		throw_assert(!frozen, "Can't update a frozen fc_layer_t.");
+		for ( int n = 0; n < weights.size.y; n++ ) {
+			double old_m = old_act_grad(n, 0, 0) * MOMENTUM;
+			for ( int i = 0; i < weights.size.x; i++ ) {
+				double& w = weights( i, n, 0 );
+				double m_in = weight_grads( i, n, 0 ) + old_m * in_sum(i, 0, 0);
+				double g_weight = w - (LEARNING_RATE * m_in + LEARNING_RATE * WEIGHT_DECAY * w);
+				w = g_weight;
+			}
+			old_act_grad(n, 0, 0) = act_grad_sum(n, 0, 0) + old_m;
+		}
 	}
 
 	// The rest is just utility functions
 	size_t get_total_memory_size() const {
 		return weights.get_total_memory_size() +
-			act_grad.element_count() * sizeof(double) +
-			old_act_grad.element_count() * sizeof(double) +
-			activator_input.element_count() * sizeof(double) +
+			act_grad.get_total_memory_size() +
+			old_act_grad.get_total_memory_size() +
+			weight_grads.get_total_memory_size() +
+			act_grad_sum.get_total_memory_size() +
+			in_sum.get_total_memory_size() +
+			activator_input.get_total_memory_size() +
+			packed_weights.get_total_memory_size() +
 			layer_t::get_total_memory_size();
 	}
 
 	std::string kind_str() const {
 		return "fc_layer_t";
 	}
+
+	using layer_t::parameter_tensors;
+	std::vector<tensor_t<double>*> parameter_tensors() {
+		return {frozen ? &packed_weights : &weights};
+	}
+
+	void label_tensors(const std::string & prefix) const {
+		layer_t::label_tensors(prefix);
+		access_trace_t::label(&activator_input, prefix + "activator_input");
+		access_trace_t::label(&weights, prefix + "weights");
+		access_trace_t::label(&act_grad, prefix + "act_grad");
+		access_trace_t::label(&old_act_grad, prefix + "old_act_grad");
+		access_trace_t::label(&weight_grads, prefix + "weight_grads");
+		access_trace_t::label(&act_grad_sum, prefix + "act_grad_sum");
+		access_trace_t::label(&in_sum, prefix + "in_sum");
+		access_trace_t::label(&packed_weights, prefix + "packed_weights");
+	}
+
+	layer_cost_t cost() const {
+		const double I = in.size.x * in.size.y * in.size.z;
+		const double N = out.size.x;
+		const double B = in.size.b;
+		layer_cost_t c;
+		// The matrix-vector product, plus a few operations for
+		// each logistic function.
+		c[layer_phase::activate] = {2 * I * N * B + 4 * N * B, 8 * (I * B + I * N + 2 * N * B)};
+		// grads_out and weight_grads are each another product
+		// with the weights' shape.
+		c[layer_phase::calc_grads] = {4 * I * N * B + I * B + 6 * N * B, 8 * (3 * I * N + 2 * I * B + 3 * N * B)};
+		c[layer_phase::fix_weights] = {6 * I * N, 8 * (3 * I * N + I + 3 * N)};
+		return c;
+	}
 	std::string param_str() const {
 		std::stringstream ss;
 		return ss.str();
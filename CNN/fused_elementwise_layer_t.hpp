@@ -0,0 +1,167 @@
+#pragma once
+#include "elementwise_layer_t.hpp"
+#include <vector>
+
+class fused_elementwise_layer_t : public elementwise_layer_t
+{
+public:
+	/*
+	  fused_elementwise_layer_t runs a chain of adjacent
+	  elementwise layers (e.g., relu followed by dropout) as a
+	  single layer.  Instead of each layer making its own pass over
+	  the whole activation tensor, it walks the tensor in blocks
+	  small enough to stay in the L1 cache and applies every stage
+	  to a block before moving on.  calc_grads() does the same
+	  thing with the stages in reverse.
+
+	  The stages still own all the state: their masks record what
+	  happened, and the fused layer's `in`, `out`, and `grads_out`
+	  are views of the stages' buffers, so the fused layer doesn't
+	  add any memory.  model_t builds these in finalize(); you
+	  shouldn't usually need to make one yourself.
+	*/
+	std::vector<elementwise_layer_t*> stages;
+
+	// Elements per block.  A multiple of 64 so blocks never share
+	// a word of a stage's bitmask.
+	static const size_t block_size = 2048;
+
+	fused_elementwise_layer_t(const std::vector<elementwise_layer_t*> & stages)
+		:
+		elementwise_layer_t(stages.front()->in.size, stages.front()->in_place),
+		stages(stages)
+	{
+		for (auto &s: stages) {
+			throw_assert(s->in.size == this->in.size, "Fused elementwise layers must all be the same size.");
+		}
+		bind_stages();
+	}
+
+	std::string kind_str() const {
+		return "fused_elementwise_layer_t";
+	}
+
+	std::string param_str() const {
+		std::stringstream ss;
+		for (uint i = 0; i < stages.size(); i++) {
+			ss << (i ? " -> " : "") << stages[i]->kind_str();
+		}
+		return ss.str();
+	}
+
+	// The stages' work, but only one pass over memory.
+	layer_cost_t cost() const {
+		layer_cost_t c = layer_t::cost();
+		for (auto p: {layer_phase::activate, layer_phase::calc_grads}) {
+			c[p].flops = 0;
+			for (auto &s: stages) {
+				c[p].flops += s->cost()[p].flops;
+			}
+		}
+		return c;
+	}
+
+	void set_training(bool training) {
+		for (auto &s: stages) {
+			s->set_training(training);
+		}
+	}
+
+	void set_replaying(bool replaying) {
+		for (auto &s: stages) {
+			s->set_replaying(replaying);
+		}
+	}
+
+	void begin_forward() {
+		for (auto &s: stages) {
+			s->begin_forward();
+		}
+	}
+
+	void forward_span(double * data, size_t begin, size_t end) {
+		for (size_t b = begin; b < end; b += block_size) {
+			size_t e = std::min(end, b + block_size);
+			for (auto &s: stages) {
+				s->forward_span(data, b, e);
+			}
+		}
+	}
+
+	void backward_span(double * data, size_t begin, size_t end) {
+		for (size_t b = begin; b < end; b += block_size) {
+			size_t e = std::min(end, b + block_size);
+			for (int i = (int)stages.size() - 1; i >= 0; i--) {
+				stages[i]->backward_span(data, b, e);
+			}
+		}
+	}
+
+	void change_batch_size(int new_batch_size) {
+		for (auto &s: stages) {
+			s->change_batch_size(new_batch_size);
+		}
+		bind_stages();
+	}
+
+	std::string regression_code() const {
+		std::stringstream ss;
+		for (auto &s: stages) {
+			ss << s->regression_code() << "\n";
+		}
+		return ss.str();
+	}
+
+private:
+	// Borrow the stages' buffers.  The first stage's `in` and
+	// `grads_out` are always its own, and so is the last stage's
+	// `grads_out`, which isn't needed until our calc_grads() has
+	// already finished with our `out`.  Frozen stages don't have
+	// `grads_out`, so then we use the last stage's `out`.
+	void bind_stages() {
+		frozen = stages.front()->frozen;
+		grads_out.view(stages.front()->grads_out);
+		if (in_place) {
+			out.view(grads_out);
+			in.view(grads_out);
+		} else {
+			in.view(stages.front()->in);
+			out.view(frozen ? stages.back()->out : stages.back()->grads_out);
+		}
+	}
+};
+
+#ifdef INCLUDE_TESTS
+namespace CNNTest {
+
+	TEST_F(CNNTest, fused_elementwise) {
+		tdsize size(30,30,4,3);
+		tensor_t<double> in(size);
+		randomize(in);
+		tensor_t<double> next_grads(size);
+		randomize(next_grads);
+
+		srand(42);
+		relu_layer_t r1(size);
+		dropout_layer_t d1(size, 0.5);
+		r1.activate(in);
+		d1.activate(r1.out);
+		d1.calc_grads(next_grads);
+		r1.calc_grads(d1.grads_out);
+
+		srand(42);
+		relu_layer_t r2(size);
+		dropout_layer_t d2(size, 0.5);
+		fused_elementwise_layer_t fused({&r2, &d2});
+		EXPECT_EQ(fused.get_total_memory_size(), 0u);
+		fused.activate(in);
+		fused.calc_grads(next_grads);
+
+		EXPECT_EQ(d1.out, fused.out);
+		EXPECT_EQ(r1.mask, r2.mask);
+		EXPECT_EQ(d1.hitmap, d2.hitmap);
+		EXPECT_EQ(r1.grads_out, fused.grads_out);
+		EXPECT_EQ(fused.grads_out.data, r2.grads_out.data);
+	}
+}
+#endif
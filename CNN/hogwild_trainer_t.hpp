@@ -0,0 +1,135 @@
+#pragma once
+#include <memory>
+#include "model_t.hpp"
+#include "parallel.hpp"
+
+class hogwild_trainer_t
+{
+public:
+	/*
+	  hogwild_trainer_t trains a model on several threads with no
+	  synchronization at all ("Hogwild!" SGD).  Like
+	  data_parallel_trainer_t, each extra thread gets a replica of
+	  the model that shares the master's parameters.  But here each
+	  thread runs model_t::train() on its own test cases, and its
+	  fix_weights() writes straight into the shared parameters
+	  while the other threads are reading and writing them too.
+
+	  Updates can interleave or occasionally overwrite each other,
+	  which is the point: for small models (e.g., the perceptron
+	  and two_layer models in examples/simple.cpp), the per-sample
+	  updates are so cheap that any synchronization would cost
+	  more than the occasional lost update.  Aligned doubles don't
+	  tear on the machines we run on, so the worst case is a stale
+	  value.
+
+	  The races are deliberate, so results aren't reproducible
+	  across runs (use data_parallel_trainer_t for that), and
+	  tools like ThreadSanitizer will complain.  Each thread keeps
+	  its own momentum.  examples/hogwild.cpp compares throughput
+	  and accuracy with serial training.
+	*/
+	model_t & master;
+	std::vector<model_t*> replicas; // replicas[0] is the master.
+	thread_pool_t pool;
+
+	hogwild_trainer_t(model_t & master, int threads)
+		:
+		master(master),
+		pool(threads)
+	{
+		replicas.push_back(&master);
+		for (int r = 1; r < pool.thread_count; r++) {
+			owned_models.emplace_back(master.replicate(owned_layers));
+			replicas.push_back(owned_models.back().get());
+		}
+	}
+
+	// Train on up to `count` test cases starting at `start`, one
+	// at a time, with test case i going to thread i % threads.
+	// Returns how many we trained on and advances `start` past
+	// them.
+	int train(dataset_t & ds, dataset_t::iterator & start, int count) {
+		count = std::min<int>(count, std::distance(start, ds.end()));
+		dataset_t::iterator first = start;
+		const int threads = replicas.size();
+		pool.parallel_for(threads, [&](int r) {
+				tracer_t::span_t span("worker", "trainer", r);
+				for (int i = r; i < count; i += threads) {
+					replicas[r]->train(first[i]);
+				}
+			});
+		start += count;
+		return count;
+	}
+
+private:
+	std::vector<std::unique_ptr<model_t>> owned_models;
+	std::vector<std::unique_ptr<layer_t>> owned_layers;
+};
+
+#ifdef INCLUDE_TESTS
+namespace CNNTest {
+
+	TEST_F(CNNTest, hogwild) {
+		// Five classes, each a noisy copy of its own pattern.
+		srand(3);
+		std::vector<tensor_t<double>> patterns;
+		for (int c = 0; c < 5; c++) {
+			patterns.emplace_back(8,8,1,1);
+			randomize(patterns.back());
+		}
+		dataset_t ds;
+		for (int i = 0; i < 400; i++) {
+			tensor_t<double> data(patterns[i % 5]);
+			for (size_t n = 0; n < data.element_count(); n++) {
+				data.data[n] += (rand() / double(RAND_MAX) - 0.5) * 0.3;
+			}
+			tensor_t<double> label(5,1,1,1);
+			label(i % 5,0,0) = 1;
+			ds.add(data, label);
+		}
+
+		auto accuracy = [&](model_t & m) {
+			int correct = 0;
+			for (auto & tc: ds) {
+				correct += m.apply(tc.data).argmax() == tc.label.argmax();
+			}
+			return correct / double(ds.size());
+		};
+
+		srand(42);
+		fc_layer_t serial_fc(tdsize(8,8,1,1), 5);
+		model_t serial;
+		serial.add_layer(serial_fc);
+		srand(42);
+		fc_layer_t one_fc(tdsize(8,8,1,1), 5);
+		model_t one;
+		one.add_layer(one_fc);
+		srand(42);
+		fc_layer_t four_fc(tdsize(8,8,1,1), 5);
+		model_t four;
+		four.add_layer(four_fc);
+
+		// One thread is just serial training.
+		for (auto & tc: ds) {
+			serial.train(tc);
+		}
+		hogwild_trainer_t t1(one, 1);
+		auto s = ds.begin();
+		EXPECT_EQ(t1.train(ds, s, 1000), 400);
+		EXPECT_EQ(s, ds.end());
+		EXPECT_EQ(serial_fc.weights, one_fc.weights);
+
+		// Four threads still learn.
+		hogwild_trainer_t t4(four, 4);
+		double before = accuracy(four);
+		for (int epoch = 0; epoch < 3; epoch++) {
+			s = ds.begin();
+			t4.train(ds, s, ds.size());
+		}
+		EXPECT_GT(accuracy(four), before);
+		EXPECT_GT(accuracy(four), 0.9);
+	}
+}
+#endif
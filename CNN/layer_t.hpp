@@ -11,6 +11,32 @@ enum class layer_type
 	dropout_layer
 };
 
+// The three things a layer does.
+enum class layer_phase
+{
+	activate = 0,
+	calc_grads,
+	fix_weights
+};
+
+static const int layer_phase_count = 3;
+
+// How much work one call to each phase does, worked out from the
+// layer's shapes (see layer_t::cost()): floating point operations
+// and bytes of tensor data touched, counting each tensor once.
+struct layer_cost_t
+{
+	struct work_t {
+		double flops;
+		double bytes;
+		work_t(double flops = 0, double bytes = 0) : flops(flops), bytes(bytes) {}
+	};
+	work_t phases[layer_phase_count];
+
+	work_t & operator[](layer_phase p) { return phases[(int)p]; }
+	const work_t & operator[](layer_phase p) const { return phases[(int)p]; }
+};
+
 #define DUMP(x) #x " = " << x
 #define RAND_R(x,y) ((x)+ (rand() % ((y)-(x))))
 #define RAND_LARGE(x) RAND_R(x/2, x)
@@ -24,28 +50,148 @@ public:
 	tensor_t<double> out;
 	tensor_t<double> grads_out;
 
+	// If this is set, bind_input() keeps a private copy of the
+	// input instead of a view of it.
+	bool snapshot_input;
+
+	// Layers with parameters sum their gradients over the batch
+	// in calc_grads(), and fix_weights() applies one update.  If
+	// this is set, calc_grads() adds to the gradients from the
+	// previous call instead of starting over, so several
+	// micro-batches can contribute to one update.
+	bool accumulate_grads;
+
+	// Set by freeze().  A frozen layer can only run activate().
+	bool frozen;
+
 	// These are key methods a layer must implement.
 	virtual void activate(tensor_t<double>& in) = 0;
 	virtual void fix_weights() = 0;
 	virtual void calc_grads(const tensor_t<double>& grad_next_layer ) = 0;
 
+	// When this is the last layer in a model, model_t::train()
+	// asks it for the gradient of the loss with respect to its
+	// output and hands the result to calc_grads().  By default
+	// that's just the error.  Loss layers override the first
+	// version, which writes into `grads` (the same size as `out`)
+	// so callers can reuse a buffer.
+	virtual void loss_gradient(const tensor_t<double>& expected, tensor_t<double>& grads) const {
+		throw_assert(expected.size == out.size && grads.size == out.size, "Mismatched sizes in loss_gradient");
+		for ( size_t n = 0; n < out.element_count(); n++ ) {
+			grads.data[n] = out.data[n] - expected.data[n];
+		}
+	}
+
+	tensor_t<double> loss_gradient(const tensor_t<double>& expected) const {
+		tensor_t<double> grads(out.size);
+		loss_gradient(expected, grads);
+		return grads;
+	}
+
 	// Everything else is utility functions.
 	virtual void change_batch_size(int new_batch_size) {
 		tdsize new_in_size = in.size;
 		tdsize new_out_size = out.size;
 		new_in_size.b = new_batch_size;
 		new_out_size.b = new_batch_size;
-		tensor_t<double> new_in(new_in_size);
-		in = new_in; 
-		tensor_t<double> new_out(new_out_size);
-		out = new_out;
-		tensor_t<double> new_grads_out(new_in_size);
-		grads_out = new_grads_out;
+		out = tensor_t<double>(new_out_size);
+		if (frozen) {
+			// freeze() dropped these, so just fix their sizes.
+			in.release();
+			in.size = new_in_size;
+			grads_out.release();
+			grads_out.size = new_in_size;
+			return;
+		}
+		in = tensor_t<double>(new_in_size);
+		grads_out = tensor_t<double>(new_in_size);
 	}
 
-	void copy_input(const tensor_t<double>& in ) {
+	// Most layers need their input again in calc_grads() or
+	// fix_weights().  Instead of copying it, `in` becomes a view
+	// of it: that's either the previous layer's `out` or the
+	// caller's tensor, and neither changes until the next forward
+	// pass.  If the caller might reuse its buffer before
+	// calc_grads(), set `snapshot_input`.
+	void bind_input(const tensor_t<double>& in ) {
 		throw_assert(this->in.size == in.size, "Passed incorrectly-sized inputs to layer. Expected: " << this->in.size << " Got: " << in.size);
-		this->in = in;
+		if (&in == &this->in) {
+			return;
+		}
+		if (!snapshot_input) {
+			this->in.view(in);
+			return;
+		}
+		if (this->in.is_view()) {
+			this->in = tensor_t<double>(in.size);
+		}
+		if (this->in.data != in.data) {
+			memcpy(this->in.data, in.data, in.calculate_data_size());
+		}
+	}
+
+	// The work each phase does (for profiler_t).  The default is
+	// right for simple elementwise layers: one operation per
+	// element, reading and writing each element once.
+	virtual layer_cost_t cost() const {
+		layer_cost_t c;
+		c[layer_phase::activate] = {double(out.element_count()),
+					    8.0 * (in.element_count() + out.element_count())};
+		c[layer_phase::calc_grads] = {double(in.element_count()),
+					      8.0 * (out.element_count() + in.element_count())};
+		return c;
+	}
+
+	// The tensors that hold our trained parameters, in a fixed
+	// order (for weight_file_t).  Frozen layers return their
+	// packed versions.
+	virtual std::vector<tensor_t<double>*> parameter_tensors() {
+		return {};
+	}
+
+	std::vector<const tensor_t<double>*> parameter_tensors() const {
+		std::vector<tensor_t<double>*> p = const_cast<layer_t*>(this)->parameter_tensors();
+		return {p.begin(), p.end()};
+	}
+
+	// While one of these is alive, layers built on this thread
+	// don't allocate or randomize their parameters.  They're
+	// released (see tensor_t::release()) until
+	// weight_file_t::load() points them at the weights it loads,
+	// and running the model before then throws.  Building a big
+	// model to load into is much cheaper that way.
+	class unloaded_parameters_t {
+	public:
+		unloaded_parameters_t() : outer(building_unloaded()) {
+			building_unloaded() = true;
+		}
+		~unloaded_parameters_t() {
+			building_unloaded() = outer;
+		}
+	private:
+		bool outer;
+	};
+
+	static bool & building_unloaded() {
+		static thread_local bool unloaded = false;
+		return unloaded;
+	}
+
+	// A new parameter tensor: zeroed, or released if we're
+	// building an unloaded layer.
+	static tensor_t<double> new_parameters(const tdsize & size) {
+		if (building_unloaded()) {
+			return tensor_t<double>::released(size);
+		}
+		return tensor_t<double>(size);
+	}
+
+	// Name our tensors for access_trace_t's reports, each
+	// starting with `prefix`.
+	virtual void label_tensors(const std::string & prefix) const {
+		access_trace_t::label(&in, prefix + "in");
+		access_trace_t::label(&out, prefix + "out");
+		access_trace_t::label(&grads_out, prefix + "grads_out");
 	}
 
 	virtual size_t get_total_memory_size() const {
@@ -63,12 +209,96 @@ public:
 		return "";
 	}
 
+	// Make this an inference-only layer: drop everything that
+	// only calc_grads() and fix_weights() need and repack the
+	// parameters however activate() likes them best.  There's no
+	// going back.  Layers with parameters or extra training state
+	// extend this; see model_t::freeze().
+	virtual void freeze() {
+		frozen = true;
+		snapshot_input = false;
+		// `in` is just a view once we've run, and `grads_out`
+		// is only for back propagation.
+		in.release();
+		grads_out.release();
+	}
+
+	// Layers that behave differently during training and
+	// inference (e.g., dropout) override this.
+	virtual void set_training(bool) {}
+
+	// While this is set, activate() is re-running a forward pass
+	// (for gradient checkpointing) and must reproduce what it did
+	// last time.  Layers with randomness (e.g., dropout) override
+	// this.
+	virtual void set_replaying(bool) {}
+
+	// Make a copy of this layer for another thread to run (see
+	// data_parallel_trainer_t).  The copy has its own buffers and
+	// gradients but shares this layer's parameters, so updating
+	// them here updates every replica.
+	virtual layer_t * replicate() const {
+		throw_assert(false, kind_str() << " doesn't support replicate().");
+		return nullptr;
+	}
+
+	// Drop the parameter gradients and optimizer state, for
+	// replicas that will only ever run activate() (see
+	// exec_context_t).  Unlike freeze(), this leaves the
+	// parameters alone, so the replica still shares them.
+	virtual void release_gradients() {}
+
+	// Add the gradient sums that `other` (a replica of this
+	// layer) computed in calc_grads() to ours.  Layers without
+	// parameters have nothing to add.
+	virtual void add_grads(const layer_t & /* other */) {}
+
+	// model_t's memory planner (see memory_plan_t) uses these to
+	// place layers' buffers in a shared arena.
+
+	// True if activate() points `out` at the input instead of
+	// writing a buffer of its own.
+	virtual bool aliases_input() const { return false; }
+
+	// Point `out` and `grads_out` at memory someone else manages.
+	// nullptr means leave that one alone.
+	virtual void use_buffers(double * out, double * grads_out) {
+		if (out) {
+			this->out.view(out, this->out.size);
+		}
+		if (grads_out) {
+			this->grads_out.view(grads_out, this->grads_out.size);
+		}
+	}
+
 	virtual void configure(const tdsize & in_size) {
 		in = tensor_t<double>(in_size);
 		grads_out = tensor_t<double>(in_size);
 	}
 
-	layer_t(const tdsize & in_size, const tdsize & out_size) :  in(in_size), out(out_size), grads_out(in_size) {}
+	layer_t(const tdsize & in_size, const tdsize & out_size) :  in(in_size), out(out_size), grads_out(in_size), snapshot_input(false), accumulate_grads(false), frozen(false) {}
+
+	// Copies (see replicate()) get new buffers instead of copying
+	// ours: `in` and `out` may be views of memory that's gone by
+	// now (e.g., the caller's input, or a staging buffer).
+	layer_t(const layer_t & other)
+		:
+		in(buffer_like(other.in)),
+		out(buffer_like(other.out)),
+		grads_out(buffer_like(other.grads_out)),
+		snapshot_input(other.snapshot_input),
+		accumulate_grads(other.accumulate_grads),
+		frozen(other.frozen)
+	{}
+
+	// A zeroed buffer the size of `t`, or a released one if `t`
+	// is released.  Never reads `t`'s data.
+	static tensor_t<double> buffer_like(const tensor_t<double> & t) {
+		if (t.is_released()) {
+			return tensor_t<double>(t);
+		}
+		return tensor_t<double>(t.size);
+	}
 	
 	virtual ~layer_t(){}
 
@@ -91,7 +321,10 @@ public:
 	}
 
 
+	// The test functions make up their own inputs and let them go,
+	// so layers need to keep copies.
 	virtual void test_me() {
+		snapshot_input = true;
 		tensor_t<double> in(this->in.size);
 		randomize(in);
 		tensor_t<double> next_grads(this->out.size);
@@ -102,6 +335,7 @@ public:
 	}
 
 	virtual void test_activate() {
+		snapshot_input = true;
 		tensor_t<double> _in(this->in.size);
 		randomize(_in);
 		activate(_in);
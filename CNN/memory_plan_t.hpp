@@ -0,0 +1,168 @@
+#pragma once
+#include <vector>
+#include <algorithm>
+#include <sstream>
+#include "tensor_t.hpp"
+
+struct memory_plan_t
+{
+	/*
+	  memory_plan_t packs a set of buffers into one arena.  Each
+	  buffer has a size and a lifetime (the first and last steps
+	  where it's used, inclusive), and buffers whose lifetimes
+	  don't overlap can share memory.
+
+	  solve() places the buffers largest-first, each at the lowest
+	  offset that doesn't collide with an already-placed buffer
+	  that's alive at the same time.  That's not always optimal,
+	  but it's simple and does well on layer chains, where most
+	  buffers only live for a step or two.
+
+	  Sizes are in doubles.  model_t uses this to lay out
+	  activations and gradients; see model_t::plan_memory().
+	*/
+	struct buffer_t {
+		size_t size;
+		int first;
+		int last;
+		size_t offset;
+	};
+
+	std::vector<buffer_t> buffers;
+	std::vector<double> arena;
+
+	// Buffers start on cache line boundaries.
+	static const size_t alignment = 64 / sizeof(double);
+
+	// Add a buffer and return its index.
+	int add(size_t size, int first, int last) {
+		throw_assert(first <= last, "Buffer lifetime ends before it starts.");
+		buffers.push_back({size, first, last, 0});
+		return buffers.size() - 1;
+	}
+
+	// Make sure buffer `b` is alive through `step`.
+	void extend(int b, int step) {
+		buffers[b].last = std::max(buffers[b].last, step);
+	}
+
+	void solve() {
+		std::vector<int> order(buffers.size());
+		for (uint i = 0; i < order.size(); i++) {
+			order[i] = i;
+		}
+		std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+				return buffers[a].size > buffers[b].size;
+			});
+
+		std::vector<int> placed;
+		size_t end = 0;
+		for (auto b: order) {
+			buffer_t & buf = buffers[b];
+			size_t length = padded(buf.size);
+
+			// Collect the placed buffers that are alive at
+			// the same time, in address order, and take the
+			// first gap that's big enough.
+			std::vector<int> conflicts;
+			for (auto p: placed) {
+				if (buffers[p].first <= buf.last && buf.first <= buffers[p].last) {
+					conflicts.push_back(p);
+				}
+			}
+			std::sort(conflicts.begin(), conflicts.end(), [&](int x, int y) {
+					return buffers[x].offset < buffers[y].offset;
+				});
+			size_t offset = 0;
+			for (auto c: conflicts) {
+				if (offset + length <= buffers[c].offset) {
+					break;
+				}
+				offset = std::max(offset, buffers[c].offset + padded(buffers[c].size));
+			}
+			buf.offset = offset;
+			end = std::max(end, offset + length);
+			placed.push_back(b);
+		}
+		arena.assign(end, 0.0);
+	}
+
+	double * address(int b) {
+		return arena.data() + buffers[b].offset;
+	}
+
+	// What the buffers would take on their own.
+	size_t unplanned_size() const {
+		size_t sum = 0;
+		for (auto & b: buffers) {
+			sum += b.size * sizeof(double);
+		}
+		return sum;
+	}
+
+	// The most memory that's actually alive at once.  The arena
+	// can't be smaller than this.
+	size_t peak_live_size() const {
+		size_t peak = 0;
+		for (auto & b: buffers) {
+			size_t live = 0;
+			for (auto & o: buffers) {
+				if (o.first <= b.first && b.first <= o.last) {
+					live += o.size * sizeof(double);
+				}
+			}
+			peak = std::max(peak, live);
+		}
+		return peak;
+	}
+
+	size_t get_total_memory_size() const {
+		return arena.size() * sizeof(double);
+	}
+
+	std::string report() const {
+		std::stringstream ss;
+		ss << "Arena " << buffers.size() << " buffers: " << get_total_memory_size()/1024.0 << " kB"
+		   << " (peak live " << peak_live_size()/1024.0 << " kB, unplanned " << unplanned_size()/1024.0 << " kB)\n";
+		return ss.str();
+	}
+
+private:
+	static size_t padded(size_t size) {
+		return (size + alignment - 1) / alignment * alignment;
+	}
+};
+
+#ifdef INCLUDE_TESTS
+namespace CNNTest {
+
+	TEST_F(CNNTest, memory_plan) {
+		// A chain where each buffer lives for two steps only
+		// needs two slots.
+		memory_plan_t plan;
+		int a = plan.add(100, 0, 1);
+		int b = plan.add(80, 1, 2);
+		int c = plan.add(100, 2, 3);
+		int d = plan.add(60, 3, 4);
+		plan.solve();
+
+		EXPECT_EQ(plan.address(a), plan.address(c));
+		EXPECT_EQ(plan.address(b), plan.address(d));
+		EXPECT_NE(plan.address(a), plan.address(b));
+		EXPECT_GE(plan.get_total_memory_size(), plan.peak_live_size());
+		EXPECT_EQ(plan.get_total_memory_size(), (104 + 80) * sizeof(double));
+		EXPECT_EQ(plan.unplanned_size(), 340 * sizeof(double));
+
+		// Buffers that are alive together never overlap.
+		for (uint i = 0; i < plan.buffers.size(); i++) {
+			for (uint j = i + 1; j < plan.buffers.size(); j++) {
+				auto & x = plan.buffers[i];
+				auto & y = plan.buffers[j];
+				if (x.first <= y.last && y.first <= x.last) {
+					EXPECT_TRUE(x.offset + x.size <= y.offset || y.offset + y.size <= x.offset);
+				}
+			}
+		}
+	}
+}
+#endif
@@ -1,8 +1,14 @@
 #pragma once
 #include "tensor_t.hpp"
 #include "layer_t.hpp"
+#include "fused_elementwise_layer_t.hpp"
+#include "conv_relu_pool_layer_t.hpp"
+#include "memory_plan_t.hpp"
+#include "profiler_t.hpp"
 #include "dataset_t.hpp"
 #include <vector>
+#include <memory>
+#include <typeinfo>
 #include <sstream>
 
 class model_t
@@ -15,20 +21,387 @@ public:
 
 	   It also holds the basic algorithms for classification and
 	   back propagation.
+
+	   The layers keep their activations, so a model runs one
+	   input at a time.  To run it from several threads at once,
+	   give each thread an exec_context_t.
 	*/
 
 	std::vector<layer_t*> layers;
 
+	// If this is set, finalize() replaces conv -> relu -> pool
+	// sequences with a conv_relu_pool_layer_t and collapses runs
+	// of adjacent elementwise layers (e.g., relu followed by
+	// dropout) into a single fused_elementwise_layer_t.
+	bool enable_fusion = true;
+
+	// The layers we actually run.  It's built from `layers` by
+	// finalize(), which happens automatically the first time we
+	// need it.
+	mutable std::vector<layer_t*> plan;
+	mutable std::vector<std::unique_ptr<layer_t>> fused_layers;
+	mutable bool finalized = false;
+
+	// If this is set, finalize() also moves the layers' outputs
+	// (and, when training, their gradients) into a shared arena
+	// where buffers that are never needed at the same time share
+	// memory.  The price is that intermediate layers' `out` (or
+	// `grads_out`) gets overwritten later in the pass, so only
+	// the final output is safe to look at afterwards.
+	bool enable_memory_planning = false;
+	bool training = true;
+
+	// Set by freeze(): the model is for inference only.
+	bool frozen = false;
+
+	// If this is set (see set_profiler()), we time every layer
+	// and training step.
+	profiler_t * profiler = nullptr;
+
+	// If our weights were loaded by weight_file_t, they are views
+	// of this mapping of the file, which we keep open.
+	std::shared_ptr<void> mapped_weights;
+
+	// train() and train_batch() put the loss gradient here.
+	tensor_t<double> error_buffer{1,1,1,1};
+	mutable memory_plan_t memory_plan;
+	mutable std::vector<double*> forward_out;
+	mutable std::vector<double*> grads_in_arena;
+
+	// If this is set (in bytes), training uses gradient
+	// checkpointing to keep the arena under budget.  Only the
+	// outputs at the ends of `segments` are kept through the
+	// forward pass, and backward recomputes the rest one segment
+	// at a time.  This implies enable_memory_planning.
+	size_t checkpoint_budget = 0;
+	mutable std::vector<int> segments; // The first layer in each segment.
+	mutable std::vector<double*> replay_out;
+	mutable int recomputed_layers = 0;
+
 	// Add a layer to the model.  We start at the input end.
 	void add_layer(layer_t & l) {
 		layers.push_back(&l);
+		finalized = false;
+	}
+
+	// Make a model out of replicas of our layers (see
+	// layer_t::replicate()), with the same settings.  The caller
+	// owns the new model, and the new layers go in `owned_layers`.
+	model_t * replicate(std::vector<std::unique_ptr<layer_t>> & owned_layers) const {
+		model_t * m = new model_t;
+		m->enable_fusion = enable_fusion;
+		m->enable_memory_planning = enable_memory_planning;
+		m->checkpoint_budget = checkpoint_budget;
+		m->training = training;
+		m->frozen = frozen;
+		m->mapped_weights = mapped_weights;
+		for (auto l: layers) {
+			owned_layers.emplace_back(l->replicate());
+			m->add_layer(*owned_layers.back());
+		}
+		return m;
+	}
+
+	// Build `plan`.
+	void finalize() const {
+		for (auto l: layers) {
+			for (auto p: l->parameter_tensors()) {
+				throw_assert(!p->is_released(), l->spec_str() << " was built with layer_t::unloaded_parameters_t, but nothing loaded its weights.");
+			}
+		}
+		plan.clear();
+		segments.clear();
+		fused_layers.clear();
+		uint i = 0;
+		while (i < layers.size()) {
+			if (enable_fusion && i + 2 < layers.size() &&
+			    typeid(*layers[i]) == typeid(conv_layer_t) && !layers[i]->frozen &&
+			    typeid(*layers[i + 1]) == typeid(relu_layer_t) &&
+			    typeid(*layers[i + 2]) == typeid(pool_layer_t)) {
+				// Exact types only: subclasses (e.g., the
+				// opt_* layers) may compute things differently.
+				fused_layers.emplace_back(new conv_relu_pool_layer_t(static_cast<conv_layer_t*>(layers[i]),
+										      static_cast<relu_layer_t*>(layers[i + 1]),
+										      static_cast<pool_layer_t*>(layers[i + 2])));
+				plan.push_back(fused_layers.back().get());
+				i += 3;
+				continue;
+			}
+			std::vector<elementwise_layer_t*> run;
+			while (enable_fusion && i + run.size() < layers.size()) {
+				auto e = dynamic_cast<elementwise_layer_t*>(layers[i + run.size()]);
+				if (!e) {
+					break;
+				}
+				run.push_back(e);
+			}
+			if (run.size() > 1) {
+				fused_layers.emplace_back(new fused_elementwise_layer_t(run));
+				plan.push_back(fused_layers.back().get());
+				i += run.size();
+			} else {
+				plan.push_back(layers[i]);
+				i++;
+			}
+		}
+		if (enable_memory_planning || checkpoint_budget) {
+			plan_memory();
+		}
+		if (profiler) {
+			profiler->attach(plan);
+		}
+		finalized = true;
+	}
+
+	// Record where the time goes in `profiler` (nullptr to stop).
+	// It's indexed by position in the plan.
+	void set_profiler(profiler_t * profiler) {
+		this->profiler = profiler;
+		finalized = false;
+	}
+
+	// Name every layer and its tensors for access_trace_t's
+	// reports.  The tensors of the layer at position i in the plan
+	// are "L<i> <name>".
+	void label_tensors() const {
+		const std::vector<layer_t*> & plan = get_plan();
+		for (uint i = 0; i < plan.size(); i++) {
+			access_trace_t::name_layer(i, plan[i]->spec_str());
+			plan[i]->label_tensors("L" + std::to_string(i) + " ");
+		}
+	}
+
+	// The gradient of the loss for `expected` (see
+	// layer_t::loss_gradient()), in a buffer we reuse.
+	tensor_t<double> & loss_gradient(const tensor_t<double> & expected) {
+		const layer_t * last = get_plan().back();
+		if (error_buffer.size != last->out.size) {
+			error_buffer = tensor_t<double>(last->out.size);
+		}
+		last->loss_gradient(expected, error_buffer);
+		return error_buffer;
+	}
+
+	// Lay out `plan`'s buffers in `memory_plan` and point the
+	// layers at them.  When checkpointing, this also picks the
+	// segments.
+	void plan_memory() const {
+		segments = {0};
+		if (training && checkpoint_budget) {
+			segments = choose_segments();
+		}
+		layout_memory(segments);
+		for (uint i = 0; i < plan.size(); i++) {
+			plan[i]->use_buffers(forward_out[i], grads_in_arena[i]);
+		}
+	}
+
+	// Figure out when each buffer is needed and solve for a
+	// layout.  Time advances one step per layer activate() or
+	// calc_grads().  In inference, an output just has to last
+	// until the next layer reads it, so activations ping-pong
+	// between two buffers.  When training, outputs have to last
+	// until backward (and fix_weights()) is done with them, and
+	// each gradient lives until the layer before it has consumed
+	// it.
+	//
+	// With checkpointing, backward works through the segments
+	// from the output end.  Each segment but the last is first
+	// re-run forward from its input (the previous segment's
+	// output, which we keep), and then backward and fix_weights()
+	// run for its layers.  Outputs inside a re-run segment only
+	// have to survive one step during the first forward pass, and
+	// get a second buffer for the re-run.
+	void layout_memory(const std::vector<int> & segments) const {
+		memory_plan = memory_plan_t();
+		int n = plan.size();
+		int K = segments.size();
+		std::vector<int> fwd(n), replay(n, -1), bwd(n, -1), fix(n, -1), last_in_segment(n, false);
+
+		int t = 0;
+		for (int i = 0; i < n; i++) {
+			fwd[i] = t++;
+		}
+		for (int k = K - 1; training && k >= 0; k--) {
+			int s = segments[k];
+			int e = k + 1 < K ? segments[k + 1] : n;
+			last_in_segment[e - 1] = true;
+			if (k < K - 1) {
+				for (int i = s; i < e; i++) {
+					replay[i] = t++;
+				}
+			}
+			for (int i = e - 1; i >= s; i--) {
+				bwd[i] = t++;
+			}
+			for (int i = s; i < e; i++) {
+				fix[i] = t;
+			}
+		}
+		int end = t;
+
+		std::vector<int> out_fwd(n, -1), out_replay(n, -1), grads(n, -1);
+		for (int i = 0; i < n; i++) {
+			// When the output stops being needed by the
+			// first forward pass, and for good.
+			int fwd_last = i == n - 1 ? end : fwd[i + 1];
+			int last = fwd_last;
+			if (training && i < n - 1) {
+				last = std::max({last, replay[i + 1], bwd[i + 1], fix[i + 1]});
+			}
+			last = std::max(last, bwd[i]);
+
+			bool recomputed = replay[i] >= 0 && !last_in_segment[i];
+			if (plan[i]->aliases_input()) {
+				// Writes into whatever the previous layer
+				// wrote (or into the caller's input).
+				out_fwd[i] = i ? out_fwd[i - 1] : -1;
+				out_replay[i] = i ? out_replay[i - 1] : -1;
+			} else if (recomputed) {
+				out_fwd[i] = memory_plan.add(plan[i]->out.element_count(), fwd[i], fwd[i]);
+				out_replay[i] = memory_plan.add(plan[i]->out.element_count(), replay[i], replay[i]);
+			} else {
+				out_fwd[i] = memory_plan.add(plan[i]->out.element_count(), fwd[i], fwd[i]);
+				out_replay[i] = out_fwd[i];
+			}
+			if (out_fwd[i] >= 0) {
+				memory_plan.extend(out_fwd[i], recomputed ? fwd_last : last);
+			}
+			if (out_replay[i] >= 0) {
+				memory_plan.extend(out_replay[i], last);
+			}
+			if (training) {
+				grads[i] = memory_plan.add(plan[i]->grads_out.element_count(), bwd[i], i ? bwd[i - 1] : end);
+			}
+		}
+		memory_plan.solve();
+
+		forward_out.assign(n, nullptr);
+		replay_out.assign(n, nullptr);
+		grads_in_arena.assign(n, nullptr);
+		recomputed_layers = 0;
+		for (int i = 0; i < n; i++) {
+			if (!plan[i]->aliases_input()) {
+				forward_out[i] = memory_plan.address(out_fwd[i]);
+				replay_out[i] = memory_plan.address(out_replay[i]);
+			}
+			if (grads[i] >= 0) {
+				grads_in_arena[i] = memory_plan.address(grads[i]);
+			}
+			recomputed_layers += replay[i] >= 0;
+		}
+	}
+
+	// Find the fewest segments (i.e., the least recomputation)
+	// that fit in `checkpoint_budget`.  For k segments, we put the
+	// boundaries where they split the activation memory most
+	// evenly.  A boundary can't go next to a layer that works in
+	// place, since re-running it would clobber the checkpoint.  If
+	// nothing fits, we take the smallest layout we found.
+	std::vector<int> choose_segments() const {
+		int n = plan.size();
+		std::vector<int> allowed;
+		std::vector<size_t> before(n + 1, 0); // Activation bytes before each layer.
+		for (int i = 0; i < n; i++) {
+			before[i + 1] = before[i] + plan[i]->out.calculate_data_size();
+			if (i > 0 && !plan[i]->aliases_input() && !plan[i - 1]->aliases_input()) {
+				allowed.push_back(i);
+			}
+		}
+
+		std::vector<int> best = {0};
+		layout_memory(best);
+		size_t best_size = memory_plan.get_total_memory_size();
+		for (uint k = 2; best_size > checkpoint_budget && k <= allowed.size() + 1; k++) {
+			std::vector<int> segments = {0};
+			for (uint j = 1; j < k; j++) {
+				size_t target = before[n] * j / k;
+				int pick = -1;
+				for (auto a: allowed) {
+					if (a > segments.back() &&
+					    (pick < 0 || std::abs((double)before[a] - target) < std::abs((double)before[pick] - target))) {
+						pick = a;
+					}
+				}
+				if (pick >= 0) {
+					segments.push_back(pick);
+				}
+			}
+			layout_memory(segments);
+			if (memory_plan.get_total_memory_size() < best_size) {
+				best = segments;
+				best_size = memory_plan.get_total_memory_size();
+			}
+		}
+		return best;
+	}
+
+	std::string checkpoint_report() const {
+		std::stringstream ss;
+		ss << "Checkpointing: " << segments.size() << " segments, recomputing "
+		   << recomputed_layers << "/" << plan.size() << " layers in backward; arena "
+		   << memory_plan.get_total_memory_size()/1024.0 << " kB (budget " << checkpoint_budget/1024.0 << " kB)\n";
+		return ss.str();
+	}
+
+	// Re-run segment [s, e) forward from its checkpointed input.
+	void replay_segment(int s, int e, bool debug) {
+		for (int i = s; i < e; i++) {
+			plan[i]->use_buffers(replay_out[i], nullptr);
+			plan[i]->set_replaying(true);
+			{
+				profiler_t::scope_t timer(profiler, i, layer_phase::activate);
+				plan[i]->activate(i == s ? plan[s]->in : plan[i - 1]->out);
+			}
+			plan[i]->set_replaying(false);
+			if (debug) {
+				std::cout << plan[i]->spec_str() << "\n" << "Replayed output: " << plan[i]->out << "\n";
+			}
+		}
+	}
+
+	void backward_checkpointed(const tensor_t<double> & error, bool debug, bool fix) {
+		for (int k = (int)segments.size() - 1; k >= 0; k--) {
+			int s = segments[k];
+			int e = k + 1 < (int)segments.size() ? segments[k + 1] : plan.size();
+			if (k < (int)segments.size() - 1) {
+				replay_segment(s, e, debug);
+			}
+			for (int i = e - 1; i >= s; i--) {
+				{
+					profiler_t::scope_t timer(profiler, i, layer_phase::calc_grads);
+					plan[i]->calc_grads(i == (int)plan.size() - 1 ? error : plan[i + 1]->grads_out);
+				}
+				if (debug) {
+					std::cout << plan[i]->spec_str() << "\n" << "Gradients: " << plan[i]->grads_out << "\n";
+				}
+			}
+			// Nothing later needs these layers' weights, so
+			// we can update them now.
+			for (int i = s; fix && i < e; i++) {
+				profiler_t::scope_t timer(profiler, i, layer_phase::fix_weights);
+				plan[i]->fix_weights();
+			}
+		}
+	}
+
+	const std::vector<layer_t*> & get_plan() const {
+		if (!finalized) {
+			finalize();
+		}
+		return plan;
 	}
 
 	// Run one instance forward through the model.
 	void forward_one(tensor_t<double> & data, bool debug) {
-		
+		const std::vector<layer_t*> & layers = get_plan();
 		for ( uint i = 0; i < layers.size(); i++ )
 		{
+			if (segments.size() > 1) {
+				// The last backward pass left re-run
+				// segments in their other buffers.
+				layers[i]->use_buffers(forward_out[i], nullptr);
+			}
 			tensor_t<double> * d;
 			if ( i == 0 ) { // First layer gets the input instance
 				d = &data;
@@ -39,7 +412,10 @@ public:
 				std::cout << layers[i]->spec_str() << "\n" << "Input: " << *d << "\n";
 				std::cout << "Weights: " << layers[i]->internal_state() <<"\n";
 			}
-			layers[i]->activate(*d); // Apply the layer to *d (a tensor).  This sets layer[i]->out
+			{
+				profiler_t::scope_t timer(profiler, i, layer_phase::activate);
+				layers[i]->activate(*d); // Apply the layer to *d (a tensor).  This sets layer[i]->out
+			}
 			
 			if (debug) {
 				std::cout << "Output: " << layers[i]->out << "\n";
@@ -47,8 +423,16 @@ public:
 		}
 	}
 
-	//  Back propogate an error vector through the layers.
-	void backward(const tensor_t<double> & error, bool debug) {
+	//  Back propogate an error vector through the layers.  If
+	//  `fix` is false, we just compute the gradients and leave
+	//  the weights alone (see train_batch()).
+	void backward(const tensor_t<double> & error, bool debug, bool fix = true) {
+		throw_assert(!frozen, "Can't train a frozen model.");
+		const std::vector<layer_t*> & layers = get_plan();
+		if (segments.size() > 1) {
+			backward_checkpointed(error, debug, fix);
+			return;
+		}
 		// Back propagation is in two phases.
 
 		// First we compute gradients for each layer starting
@@ -62,17 +446,32 @@ public:
 			} else {
 				g = &layers[i + 1]->grads_out;
 			}
-			layers[i]->calc_grads( *g );
+			{
+				profiler_t::scope_t timer(profiler, i, layer_phase::calc_grads);
+				layers[i]->calc_grads( *g );
+			}
 			if (debug) {
 				std::cout << layers[i]->spec_str() << "\n" << "Gradients: " << *g << "\n";
 			}
 		}
 
-		// then we adjust the weights (i.e., parameters) in
-		// each layer starting from the input layer.
+		if (fix) {
+			fix_weights(debug);
+		}
+	}
+
+	// Adjust the weights (i.e., parameters) in each layer,
+	// starting from the input layer.
+	void fix_weights(bool debug) {
+		throw_assert(!frozen, "Can't train a frozen model.");
+		const std::vector<layer_t*> & layers = get_plan();
+		tracer_t::span_t span("update", "model");
 		for ( uint i = 0; i < layers.size(); i++ )
 		{
-			layers[i]->fix_weights();
+			{
+				profiler_t::scope_t timer(profiler, i, layer_phase::fix_weights);
+				layers[i]->fix_weights();
+			}
 			if (debug) {
 				std::cout << layers[i]->spec_str() << "\n" << "Weights: " << layers[i]->internal_state() << "\n";
 			}
@@ -83,23 +482,23 @@ public:
 		return train(tc.data, tc.label, debug);
 	}
 	
-	// Train on one input/lable pair.
+	// Train on one input/lable pair.  If they are batched, we
+	// make one update using the average gradient over the batch.
 	double train(tensor_t<double>& data, const tensor_t<double>& expected, bool debug=false) {
+		throw_assert(!frozen, "Can't train a frozen model.");
+		profiler_t::scope_t timer(profiler);
 
 		// Run one instance farward.
 		forward_one(data, debug);
 
 		// Compute the error.
-		tensor_t<double> error = layers.back()->out - expected;
+		tensor_t<double> & error = loss_gradient(expected);
 
 		if (debug) {
 			std::cout << "Expected: " << expected <<"\n";
 			std::cout << "Error   : " << error <<"\n";
 		}
 
-		// Run the error back through the network to adjust the parameters.
-		backward(error, debug);
-
 		// Sum up the error tensor.  I think this code might not be needed anymore.
 		double err = 0;
 		for ( int i = 0; i < error.size.x * error.size.y * error.size.z; i++ )
@@ -108,13 +507,124 @@ public:
 			if ( f > 0.5 )
 				err += abs(error.data[i]);
 		}
+
+		scale(error, 1.0 / error.size.b);
+
+		// Run the error back through the network to adjust the parameters.
+		backward(error, debug);
+
 		return err * 100;
 	}
 
+	static void scale(tensor_t<double> & t, double s) {
+		if (s != 1.0) {
+			for ( size_t i = 0; i < t.element_count(); i++ ) {
+				t.data[i] *= s;
+			}
+		}
+	}
+
+	void set_accumulate_grads(bool accumulate) {
+		for(auto &r: layers) {
+			r->accumulate_grads = accumulate;
+		}
+	}
+
+	// Train on up to `count` test cases from `ds`, starting at
+	// `start`, with a single weight update that uses the average
+	// gradient over all of them.
+	//
+	// The test cases run through the model in micro-batches of
+	// the model's batch size (see change_batch_size()), and the
+	// layers accumulate gradients across micro-batches.  The test
+	// cases can be unbatched, or already batched to match the
+	// model.  If there aren't enough left to fill the last
+	// micro-batch, they are left for next time.
+	//
+	// Returns the number of test cases (or for batched datasets,
+	// inputs) used, and advances `start` past them.
+	int train_batch(dataset_t & ds, dataset_t::iterator & start, int count, bool debug=false) {
+		int micro_batches = count_micro_batches(ds, start, count);
+		if (micro_batches == 0) {
+			return 0;
+		}
+		profiler_t::scope_t timer(profiler);
+		const int batch = get_plan()[0]->in.size.b;
+		const int cases = batch / start->data.size.b;
+		tensor_t<double> data(get_plan()[0]->in.size);
+		tensor_t<double> label(get_plan().back()->out.size);
+		for (int m = 0; m < micro_batches; m++) {
+			tensor_t<double> * d;
+			tensor_t<double> * l;
+			gather_micro_batch(start + m * cases, data, label, d, l);
+			accumulate_micro_batch(*d, *l, 1.0 / (micro_batches * batch), m > 0, debug);
+		}
+		start += micro_batches * cases;
+		set_accumulate_grads(false);
+		fix_weights(debug);
+		return micro_batches * batch;
+	}
+
+	// How many whole micro-batches train_batch() can make from
+	// `count` test cases starting at `start`.
+	int count_micro_batches(dataset_t & ds, dataset_t::iterator start, int count) const {
+		if (start == ds.end()) {
+			return 0;
+		}
+		const int batch = get_plan()[0]->in.size.b;
+		const int per_case = start->data.size.b;
+		throw_assert(per_case == 1 || per_case == batch, "Dataset batch size (" << per_case << ") doesn't match the model (" << batch << ").");
+		int available = std::distance(start, ds.end()) * per_case;
+		return std::min(count, available) / batch;
+	}
+
+	// Point `d` and `l` at the micro-batch that starts at `start`.
+	// If the dataset is batched to match, that's just the test
+	// case.  Otherwise, we copy test cases into `data` and
+	// `label`.
+	static void gather_micro_batch(dataset_t::iterator start,
+				       tensor_t<double> & data, tensor_t<double> & label,
+				       tensor_t<double> *& d, tensor_t<double> *& l) {
+		if (start->data.size.b == data.size.b) {
+			d = &start->data;
+			l = &start->label;
+			return;
+		}
+		tracer_t::span_t span("gather", "data");
+		const size_t data_stride = data.size.x * data.size.y * data.size.z;
+		const size_t label_stride = label.size.x * label.size.y * label.size.z;
+		for (int b = 0; b < data.size.b; b++, start++) {
+			memcpy(&data.data[b * data_stride], start->data.data, data_stride * sizeof(double));
+			memcpy(&label.data[b * label_stride], start->label.data, label_stride * sizeof(double));
+		}
+		d = &data;
+		l = &label;
+	}
+
+	// Run one micro-batch forward and backward, scaling the error
+	// by `scale`, and leave the weights alone.  If `accumulate` is
+	// set, the gradients add to those from earlier micro-batches.
+	void accumulate_micro_batch(tensor_t<double> & data, const tensor_t<double> & label, double scale, bool accumulate, bool debug=false) {
+		tracer_t::span_t span("micro_batch", "model");
+		set_accumulate_grads(accumulate);
+		forward_one(data, debug);
+		tensor_t<double> & error = loss_gradient(label);
+		this->scale(error, scale);
+		if (debug) {
+			std::cout << "Error   : " << error <<"\n";
+		}
+		backward(error, debug, false);
+	}
+
 
         tensor_t<double> & apply(tensor_t<double>& data ) const {
+		const std::vector<layer_t*> & layers = get_plan();
 		for ( uint i = 0; i < layers.size(); i++ )
 		{
+			if (segments.size() > 1) {
+				layers[i]->use_buffers(forward_out[i], nullptr);
+			}
+			profiler_t::scope_t timer(profiler, i, layer_phase::activate);
 			if ( i == 0 ) {
 				//std::cout << "Initial layer activating in: " << layers[i]->in.size << " out: " << layers[i]->out.size << std::endl;
 				layers[i]->activate(data );
@@ -131,34 +641,42 @@ public:
 		for (uint i = 0; i < layers.size(); i ++ ) {
 			layers[i]->change_batch_size(new_batch_size);
 		}
+		finalized = false;
 	}
 
-	size_t get_total_memory_size() const {
-		size_t sum = 0;
-
+	// Switch every layer between training and inference
+	// behavior.
+	void set_training(bool training) {
+		throw_assert(!(frozen && training), "Can't train a frozen model.");
+		this->training = training;
 		for(auto &r: layers) {
-			sum += r->get_total_memory_size();
+			r->set_training(training);
 		}
-		return sum;
+		finalized = false;
 	}
 
-	int train_batch(dataset_t & ds, dataset_t::iterator & start, int count, bool debug=false) {
-		throw_assert(false, "THis code doesn't terminate correctly.");
-		tensor_t<double> error(layers.back()->out.size);
-		int i = 0;
-		while(start != ds.end() && i < count) {
-			forward_one(start->data, debug);
-			error = error + layers.back()->out - start->label;
-			i++;
-			start++;
-		}
-		
-		if (debug) {
-			std::cout << "Error   : " << error <<"\n";
+	// Make this an inference-only model (e.g., for serving).  Every
+	// layer drops its gradients, momentum, and other training
+	// state and repacks its parameters for activate() (see
+	// layer_t::freeze()), which roughly halves the memory the
+	// model needs.  Outputs don't change.  After this, the model
+	// can only run apply(), and there's no going back.
+	void freeze() {
+		set_training(false);
+		for (auto &l: layers) {
+			l->freeze();
 		}
+		frozen = true;
+		finalized = false;
+	}
 
-		backward(error, debug);
-		return i;
+	size_t get_total_memory_size() const {
+		size_t sum = 0;
+
+		for(auto &r: layers) {
+			sum += r->get_total_memory_size();
+		}
+		return sum + memory_plan.get_total_memory_size();
 	}
 
 	std::string regression_code() const {
@@ -173,11 +691,24 @@ public:
 		std::stringstream ss;
 		int i = 0;
 		ss << "IN    " << layers[0]->in.size << "\n";
+		double flops = 0;
 		for(auto &r: layers) {
 			auto s = r->get_total_memory_size();
-			ss << "layer[" << i << "]  ->" << r->out.size << " " << (s+0.0)/(1024.0) << " kB (" << (s+0.0)/get_total_memory_size()*100.0 << "%) : " << r->spec_str() << "\n"; 
+			// Forward work and arithmetic intensity (see roofline_t).
+			auto fwd = r->cost()[layer_phase::activate];
+			flops += fwd.flops;
+			ss << "layer[" << i << "]  ->" << r->out.size << " " << (s+0.0)/(1024.0) << " kB (" << (s+0.0)/get_total_memory_size()*100.0 << "%) "
+			   << fwd.flops/1e6 << " MFLOP " << (fwd.bytes ? fwd.flops/fwd.bytes : 0) << " flop/B : " << r->spec_str() << "\n"; 
 			i++;
 		}
+		ss << "Forward " << flops/1e6 << " MFLOP\n";
+		if (enable_memory_planning || checkpoint_budget) {
+			get_plan();
+			ss << memory_plan.report();
+			if (segments.size() > 1) {
+				ss << checkpoint_report();
+			}
+		}
 	        ss << "Total " << i << ": " << get_total_memory_size()/1024.0 << " kB\n";
 		return ss.str();
 	}
@@ -202,6 +733,539 @@ namespace CNNTest {
 		model.add_layer(layer4 );
 		model.geometry();
 	}
+
+	TEST_F(CNNTest, model_in_place) {
+		tensor_t<double> data(28,28,1,1);
+		tensor_t<double> label(10,1,1,1);
+		randomize(data);
+		label(3,0,0) = 1;
+
+		srand(42);
+		conv_layer_t  a1( 1, 5, 8, 0, data.size );
+		relu_layer_t  a2( a1.out.size );
+		pool_layer_t  a3( 2, 2, 0, a2.out.size );
+		fc_layer_t    a4( a3.out.size, 10 );
+		model_t a;
+		a.add_layer(a1);
+		a.add_layer(a2);
+		a.add_layer(a3);
+		a.add_layer(a4);
+
+		srand(42);
+		conv_layer_t  b1( 1, 5, 8, 0, data.size );
+		relu_layer_t  b2( b1.out.size, true );
+		pool_layer_t  b3( 2, 2, 0, b2.out.size );
+		fc_layer_t    b4( b3.out.size, 10 );
+		model_t b;
+		b.add_layer(b1);
+		b.add_layer(b2);
+		b.add_layer(b3);
+		b.add_layer(b4);
+
+		EXPECT_LT(b.get_total_memory_size(), a.get_total_memory_size());
+		for (int i = 0; i < 3; i++) {
+			a.train(data, label);
+			b.train(data, label);
+		}
+		EXPECT_EQ(a.apply(data), b.apply(data));
+	}
+
+	TEST_F(CNNTest, model_fusion) {
+		tensor_t<double> data(28,28,1,2);
+		tensor_t<double> label(10,1,1,2);
+		randomize(data);
+		label(3,0,0,0) = 1;
+		label(5,0,0,1) = 1;
+
+		model_t * models[2];
+		std::vector<layer_t*> owned;
+		for (int m = 0; m < 2; m++) {
+			srand(42);
+			auto l1 = new conv_layer_t( 1, 5, 8, 0, data.size );
+			auto l2 = new relu_layer_t( l1->out.size );
+			auto l3 = new dropout_layer_t( l2->out.size, 0.8 );
+			auto l4 = new pool_layer_t( 2, 2, 0, l3->out.size );
+			auto l5 = new fc_layer_t( l4->out.size, 10 );
+			models[m] = new model_t;
+			for (auto l: std::vector<layer_t*>{l1, l2, l3, l4, l5}) {
+				models[m]->add_layer(*l);
+				owned.push_back(l);
+			}
+		}
+		models[1]->enable_fusion = false;
+
+		EXPECT_EQ(models[0]->get_plan().size(), 4u);
+		EXPECT_EQ(models[0]->get_plan()[1]->kind_str(), "fused_elementwise_layer_t");
+		EXPECT_EQ(models[1]->get_plan().size(), 5u);
+		EXPECT_EQ(models[0]->get_total_memory_size(), models[1]->get_total_memory_size());
+
+		for (int i = 0; i < 3; i++) {
+			models[0]->train(data, label);
+			models[1]->train(data, label);
+		}
+		EXPECT_EQ(models[0]->apply(data), models[1]->apply(data));
+
+		models[0]->set_training(false);
+		models[1]->set_training(false);
+		EXPECT_EQ(models[0]->apply(data), models[1]->apply(data));
+
+		for (auto l: owned) {
+			delete l;
+		}
+		delete models[0];
+		delete models[1];
+	}
+
+	TEST_F(CNNTest, model_conv_relu_pool) {
+		tensor_t<double> data(28,28,1,2);
+		tensor_t<double> label(10,1,1,2);
+		for (size_t i = 0; i < data.element_count(); i++)
+			data.data[i] = rand() / double(RAND_MAX) - 0.5;
+		label(3,0,0,0) = 1;
+		label(5,0,0,1) = 1;
+
+		model_t * models[2];
+		std::vector<layer_t*> owned;
+		for (int m = 0; m < 2; m++) {
+			srand(42);
+			auto l1 = new conv_layer_t( 1, 5, 8, 0, data.size );
+			auto l2 = new relu_layer_t( l1->out.size );
+			auto l3 = new pool_layer_t( 2, 2, 0, l2->out.size );
+			auto l4 = new fc_layer_t( l3->out.size, 10 );
+			models[m] = new model_t;
+			for (auto l: std::vector<layer_t*>{l1, l2, l3, l4}) {
+				models[m]->add_layer(*l);
+				owned.push_back(l);
+			}
+		}
+		models[1]->enable_fusion = false;
+
+		EXPECT_EQ(models[0]->get_plan().size(), 2u);
+		EXPECT_EQ(models[0]->get_plan()[0]->kind_str(), "conv_relu_pool_layer_t");
+
+		for (int i = 0; i < 3; i++) {
+			models[0]->train(data, label);
+			models[1]->train(data, label);
+		}
+		EXPECT_EQ(models[0]->apply(data), models[1]->apply(data));
+
+		for (auto l: owned) {
+			delete l;
+		}
+		delete models[0];
+		delete models[1];
+	}
+
+	TEST_F(CNNTest, model_input_views) {
+		tensor_t<double> data(28,28,1,1);
+		randomize(data);
+		conv_layer_t  l1( 1, 5, 8, 0, data.size );
+		pool_layer_t  l2( 2, 2, 0, l1.out.size );
+		fc_layer_t    l3( l2.out.size, 10 );
+		model_t model;
+		model.add_layer(l1);
+		model.add_layer(l2);
+		model.add_layer(l3);
+
+		size_t before = model.get_total_memory_size();
+		model.apply(data);
+		EXPECT_EQ(l1.in.data, data.data);
+		EXPECT_EQ(l2.in.data, l1.out.data);
+		EXPECT_EQ(l3.in.data, l2.out.data);
+		EXPECT_LT(model.get_total_memory_size(), before);
+
+		// Snapshots survive the caller changing its input.
+		l1.snapshot_input = true;
+		model.apply(data);
+		EXPECT_NE(l1.in.data, data.data);
+		EXPECT_EQ(l1.in, data);
+		data.data[0] += 1;
+		EXPECT_NE(l1.in, data);
+	}
+
+	TEST_F(CNNTest, model_replicate_after_apply) {
+		conv_layer_t  l1( 1, 5, 8, 0, tdsize(28,28,1,1) );
+		relu_layer_t  l2( l1.out.size );
+		pool_layer_t  l3( 2, 2, 0, l2.out.size );
+		fc_layer_t    l4( l3.out.size, 10 );
+		model_t model;
+		model.add_layer(l1);
+		model.add_layer(l2);
+		model.add_layer(l3);
+		model.add_layer(l4);
+
+		tensor_t<double> data(28,28,1,1);
+		randomize(data);
+		tensor_t<double> expected = model.apply(data);
+		{
+			// l1.in is left viewing this after it's gone.
+			tensor_t<double> gone(data);
+			model.apply(gone);
+		}
+
+		// The replica gets its own buffers without reading the
+		// old ones.
+		std::vector<std::unique_ptr<layer_t>> owned;
+		std::unique_ptr<model_t> replica(model.replicate(owned));
+		EXPECT_FALSE(owned[0]->in.is_view());
+		EXPECT_FALSE(owned[3]->in.is_view());
+		EXPECT_EQ(replica->apply(data), expected);
+	}
+
+	TEST_F(CNNTest, model_memory_plan) {
+		tensor_t<double> data(32,32,3,2);
+		tensor_t<double> label(10,1,1,2);
+		randomize(data);
+		label(3,0,0,0) = 1;
+		label(5,0,0,1) = 1;
+
+		model_t * models[2];
+		std::vector<layer_t*> owned;
+		for (int m = 0; m < 2; m++) {
+			srand(42);
+			std::vector<layer_t*> l;
+			l.push_back(new conv_layer_t( 1, 3, 8, 0, data.size ));
+			l.push_back(new relu_layer_t( l.back()->out.size ));
+			l.push_back(new pool_layer_t( 2, 2, 0, l.back()->out.size ));
+			l.push_back(new conv_layer_t( 1, 3, 8, 0, l.back()->out.size ));
+			l.push_back(new relu_layer_t( l.back()->out.size ));
+			l.push_back(new pool_layer_t( 2, 2, 0, l.back()->out.size ));
+			l.push_back(new fc_layer_t( l.back()->out.size, 10 ));
+			models[m] = new model_t;
+			models[m]->enable_fusion = false;
+			for (auto i: l) {
+				models[m]->add_layer(*i);
+				owned.push_back(i);
+			}
+		}
+		models[0]->enable_memory_planning = true;
+
+		// Training only shares the gradients.
+		for (int i = 0; i < 3; i++) {
+			models[0]->train(data, label);
+			models[1]->train(data, label);
+		}
+		EXPECT_EQ(models[0]->apply(data), models[1]->apply(data));
+		EXPECT_LT(models[0]->memory_plan.get_total_memory_size(), models[0]->memory_plan.unplanned_size());
+
+		// Inference only needs two activation buffers: the
+		// first conv's output and the relu's.
+		models[0]->set_training(false);
+		models[1]->set_training(false);
+		EXPECT_EQ(models[0]->apply(data), models[1]->apply(data));
+		size_t biggest = models[0]->layers[0]->out.calculate_data_size();
+		EXPECT_EQ(models[0]->memory_plan.get_total_memory_size(), 2 * biggest);
+		EXPECT_LT(models[0]->get_total_memory_size(), models[1]->get_total_memory_size());
+
+		for (auto l: owned) {
+			delete l;
+		}
+		delete models[0];
+		delete models[1];
+	}
+
+	TEST_F(CNNTest, model_checkpointing) {
+		tensor_t<double> data(32,32,3,2);
+		tensor_t<double> label(10,1,1,2);
+		randomize(data);
+		label(3,0,0,0) = 1;
+		label(5,0,0,1) = 1;
+
+		model_t * models[3];
+		std::vector<layer_t*> owned;
+		for (int m = 0; m < 3; m++) {
+			srand(42);
+			std::vector<layer_t*> l;
+			l.push_back(new conv_layer_t( 1, 3, 8, 0, data.size ));
+			l.push_back(new relu_layer_t( l.back()->out.size ));
+			l.push_back(new pool_layer_t( 2, 2, 0, l.back()->out.size ));
+			l.push_back(new conv_layer_t( 1, 3, 8, 0, l.back()->out.size ));
+			l.push_back(new relu_layer_t( l.back()->out.size, true ));
+			l.push_back(new dropout_layer_t( l.back()->out.size, 0.7 ));
+			l.push_back(new pool_layer_t( 2, 2, 0, l.back()->out.size ));
+			l.push_back(new conv_layer_t( 1, 3, 8, 0, l.back()->out.size ));
+			l.push_back(new pool_layer_t( 2, 2, 0, l.back()->out.size ));
+			l.push_back(new fc_layer_t( l.back()->out.size, 10 ));
+			models[m] = new model_t;
+			models[m]->enable_fusion = false;
+			for (auto i: l) {
+				models[m]->add_layer(*i);
+				owned.push_back(i);
+			}
+		}
+		// Plain, planned, and checkpointed.
+		models[1]->enable_memory_planning = true;
+		models[1]->get_plan();
+		size_t planned = models[1]->memory_plan.get_total_memory_size();
+		models[2]->checkpoint_budget = planned * 7 / 8;
+
+		for (int i = 0; i < 3; i++) {
+			models[0]->train(data, label);
+			models[2]->train(data, label);
+		}
+		EXPECT_GT(models[2]->segments.size(), 1u);
+		EXPECT_GT(models[2]->recomputed_layers, 0);
+		EXPECT_LE(models[2]->memory_plan.get_total_memory_size(), models[2]->checkpoint_budget);
+		EXPECT_EQ(models[0]->apply(data), models[2]->apply(data));
+		for (uint i = 0; i < models[0]->layers.size(); i++) {
+			if (models[0]->layers[i]->kind_str() == "conv_layer_t") {
+				EXPECT_EQ(static_cast<conv_layer_t*>(models[0]->layers[i])->filters,
+					  static_cast<conv_layer_t*>(models[2]->layers[i])->filters);
+			}
+		}
+		EXPECT_NE(models[2]->geometry().find("Checkpointing"), std::string::npos);
+
+		for (auto l: owned) {
+			delete l;
+		}
+		for (auto m: models) {
+			delete m;
+		}
+	}
+
+	TEST_F(CNNTest, model_train_batch) {
+		dataset_t ds;
+		srand(7);
+		for (int i = 0; i < 10; i++) {
+			tensor_t<double> data(12,12,2,1);
+			tensor_t<double> label(5,1,1,1);
+			randomize(data);
+			label(i % 5,0,0) = 1;
+			ds.add(data, label);
+		}
+		dataset_t batched = ds.batched_copy(4);
+		EXPECT_EQ(batched.size(), 2u); // The last two are dropped.
+		EXPECT_EQ(batched.begin()->label.size, tdsize(5,1,1,4));
+		EXPECT_EQ(batched.begin()->label(1,0,0,1), 1);
+
+		// Micro-batches of 1, micro-batches of 2 on unbatched
+		// data, and one batch of 4.
+		model_t * models[3];
+		std::vector<layer_t*> owned;
+		int batch_sizes[] = {1, 2, 4};
+		for (int m = 0; m < 3; m++) {
+			srand(42);
+			std::vector<layer_t*> l;
+			l.push_back(new conv_layer_t( 1, 3, 4, 0, tdsize(12,12,2,batch_sizes[m]) ));
+			l.push_back(new relu_layer_t( l.back()->out.size ));
+			l.push_back(new pool_layer_t( 2, 2, 0, l.back()->out.size ));
+			l.push_back(new fc_layer_t( l.back()->out.size, 5 ));
+			models[m] = new model_t;
+			for (auto i: l) {
+				models[m]->add_layer(*i);
+				owned.push_back(i);
+			}
+		}
+
+		for (int step = 0; step < 2; step++) {
+			auto a = ds.begin() + step * 4;
+			auto b = ds.begin() + step * 4;
+			auto c = batched.begin() + step;
+			EXPECT_EQ(models[0]->train_batch(ds, a, 4), 4);
+			EXPECT_EQ(models[1]->train_batch(ds, b, 4), 4);
+			EXPECT_EQ(models[2]->train_batch(batched, c, 4), 4);
+			EXPECT_EQ(a, ds.begin() + (step + 1) * 4);
+			EXPECT_EQ(c, batched.begin() + step + 1);
+		}
+		// Not enough left for a micro-batch of 4.
+		auto rest = ds.begin() + 8;
+		tensor_t<double> filters_before = static_cast<conv_layer_t*>(models[2]->layers[0])->filters[0];
+		dataset_t tail;
+		tail.add(ds.begin()[8]);
+		auto t = tail.begin();
+		EXPECT_EQ(models[2]->train_batch(tail, t, 4), 0);
+		EXPECT_EQ(t, tail.begin());
+
+		for (int m = 1; m < 3; m++) {
+			EXPECT_EQ(static_cast<conv_layer_t*>(models[0]->layers[0])->filters,
+				  static_cast<conv_layer_t*>(models[m]->layers[0])->filters);
+			EXPECT_EQ(static_cast<fc_layer_t*>(models[0]->layers[3])->weights,
+				  static_cast<fc_layer_t*>(models[m]->layers[3])->weights);
+		}
+		EXPECT_EQ(static_cast<conv_layer_t*>(models[2]->layers[0])->filters[0], filters_before);
+		EXPECT_EQ(models[0]->train_batch(ds, rest, 4), 2);
+		EXPECT_EQ(rest, ds.end());
+
+		for (auto l: owned) {
+			delete l;
+		}
+		for (auto m: models) {
+			delete m;
+		}
+	}
+
+	TEST_F(CNNTest, model_softmax_cross_entropy) {
+		srand(42);
+		fc_layer_t fc(tdsize(6,1,1,1), 4);
+		softmax_cross_entropy_layer_t sm(fc.out.size);
+		model_t model;
+		model.add_layer(fc);
+		model.add_layer(sm);
+
+		// Training pushes the right answer's probability up.
+		tensor_t<double> in(6,1,1,1);
+		randomize(in);
+		tensor_t<double> y(4,1,1,1);
+		y(2,0,0) = 1;
+		double before = model.apply(in)(2,0,0);
+		for (int i = 0; i < 20; i++) {
+			model.train(in, y);
+		}
+		EXPECT_GT(model.apply(in)(2,0,0), before);
+	}
+
+	TEST_F(CNNTest, model_profiler) {
+		tensor_t<double> data(28,28,1,1);
+		tensor_t<double> label(10,1,1,1);
+		randomize(data);
+		label(3,0,0) = 1;
+
+		conv_layer_t  l1( 1, 5, 8, 0, data.size );
+		relu_layer_t  l2( l1.out.size );
+		pool_layer_t  l3( 2, 2, 0, l2.out.size );
+		fc_layer_t    l4( l3.out.size, 10 );
+		model_t model;
+		model.add_layer(l1);
+		model.add_layer(l2);
+		model.add_layer(l3);
+		model.add_layer(l4);
+		profiler_t profiler;
+		model.set_profiler(&profiler);
+		for (int i = 0; i < 3; i++) {
+			model.train(data, label);
+		}
+		model.apply(data);
+		model.apply(data);
+
+		ASSERT_EQ(profiler.layers.size(), 2u); // conv_relu_pool, fc
+		EXPECT_EQ(profiler.steps, 3u);
+		EXPECT_GT(profiler.step_seconds, 0);
+		for (uint l = 0; l < profiler.layers.size(); l++) {
+			EXPECT_EQ(profiler.layers[l].phases[(int)layer_phase::activate].calls, 5u);
+			EXPECT_EQ(profiler.layers[l].phases[(int)layer_phase::calc_grads].calls, 3u);
+			EXPECT_EQ(profiler.layers[l].phases[(int)layer_phase::fix_weights].calls, 3u);
+		}
+		// 2 flops per tap for each of the 24x24x8 conv outputs.
+		EXPECT_GE(profiler.flops(0, (int)layer_phase::activate), 5 * 2.0 * 25 * 24 * 24 * 8);
+		EXPECT_GT(profiler.bytes(1, (int)layer_phase::fix_weights), 0);
+
+		std::string csv = profiler.csv();
+		EXPECT_EQ(std::count(csv.begin(), csv.end(), '\n'), 2 * 3 + 2);
+		EXPECT_NE(profiler.json().find("\"steps\": 3"), std::string::npos);
+
+		// Changing the plan starts over.
+		model.enable_fusion = false;
+		model.set_training(false);
+		model.apply(data);
+		EXPECT_EQ(profiler.layers.size(), 4u);
+		EXPECT_EQ(profiler.layers[0].phases[(int)layer_phase::activate].calls, 1u);
+	}
+
+	TEST_F(CNNTest, model_freeze) {
+		tdsize size(28,28,1,2);
+		tensor_t<double> label(10,1,1,2);
+		label(3,0,0,0) = 1;
+		label(5,0,0,1) = 1;
+		std::vector<tensor_t<double>> inputs;
+		for (int i = 0; i < 4; i++) {
+			inputs.emplace_back(size);
+			randomize(inputs.back());
+		}
+
+		// Unfused conv, relu -> dropout fused without running in
+		// place, and an in-place relu.
+		srand(42);
+		conv_layer_t    l1( 1, 5, 8, 0, size );
+		relu_layer_t    l2( l1.out.size, true );
+		pool_layer_t    l3( 2, 2, 0, l2.out.size );
+		fc_layer_t      l4( l3.out.size, 30 );
+		relu_layer_t    l5( l4.out.size );
+		dropout_layer_t l6( l5.out.size, 0.5 );
+		fc_layer_t      l7( l6.out.size, 10 );
+		model_t model;
+		model.add_layer(l1);
+		model.add_layer(l2);
+		model.add_layer(l3);
+		model.add_layer(l4);
+		model.add_layer(l5);
+		model.add_layer(l6);
+		model.add_layer(l7);
+		for (int i = 0; i < 3; i++) {
+			model.train(inputs[i], label);
+		}
+		model.set_training(false);
+		std::vector<tensor_t<double>> expected;
+		for (auto & in: inputs) {
+			expected.push_back(model.apply(in));
+		}
+		size_t before = model.get_total_memory_size();
+
+		model.freeze();
+		EXPECT_LT(model.get_total_memory_size(), before * 0.6);
+		for (uint i = 0; i < inputs.size(); i++) {
+			tensor_t<double> & out = model.apply(inputs[i]);
+			EXPECT_EQ(memcmp(out.data, expected[i].data, out.calculate_data_size()), 0);
+		}
+		EXPECT_TRUE(l1.filter_grads.empty());
+		EXPECT_TRUE(l4.weight_grads.is_released());
+		EXPECT_TRUE(l4.grads_out.is_released());
+		EXPECT_ANY_THROW(model.train(inputs[0], label));
+		EXPECT_ANY_THROW(model.set_training(true));
+
+		// Frozen replicas share the packed parameters.
+		std::vector<std::unique_ptr<layer_t>> owned;
+		std::unique_ptr<model_t> replica(model.replicate(owned));
+		EXPECT_EQ(static_cast<fc_layer_t*>(owned[3].get())->packed_weights.data, l4.packed_weights.data);
+		EXPECT_EQ(replica->apply(inputs[1]), expected[1]);
+
+		// Resizing doesn't bring back what freeze() dropped.
+		replica->change_batch_size(1);
+		tensor_t<double> one(28,28,1,1);
+		randomize(one);
+		EXPECT_EQ(replica->apply(one).size, tdsize(10,1,1,1));
+		for (auto & l: owned) {
+			EXPECT_TRUE(l->grads_out.is_released()) << l->kind_str();
+		}
+	}
+
+#ifdef TRACE_TENSOR_ACCESSES
+	TEST_F(CNNTest, model_access_trace) {
+		conv_layer_t l1( 1, 3, 2, 0, tdsize(6,6,1,1) );
+		fc_layer_t   l2( l1.out.size, 5 );
+		model_t model;
+		model.add_layer(l1);
+		model.add_layer(l2);
+		tensor_t<double> in(6,6,1,1);
+		randomize(in);
+
+		cache_sim_t cache;
+		access_trace_t::reset();
+		model.label_tensors();
+		access_trace_t::start(&cache);
+		model.apply(in);
+		access_trace_t::stop();
+
+		auto totals = access_trace_t::totals();
+		auto count = [&](int layer, const char * tensor) {
+			auto & t = totals[std::make_tuple(layer, (int)layer_phase::activate, std::string(tensor))];
+			return t.reads + t.writes;
+		};
+		// 6x6 outputs (the conv pads) for each of 2 filters, 3x3
+		// taps each.
+		EXPECT_EQ(count(0, "L0 filters"), 6u * 6 * 2 * 9);
+		EXPECT_EQ(count(0, "L0 out"), 6u * 6 * 2);
+		// The fc layer reads its input (the conv's output) once
+		// per weight.
+		EXPECT_EQ(count(1, "L0 out"), 72u * 5);
+		EXPECT_EQ(count(1, "L1 weights"), 72u * 5);
+		// It all fits in L1, so only the first touch of each
+		// line misses.
+		auto & w = totals[std::make_tuple(1, (int)layer_phase::activate, std::string("L1 weights"))];
+		EXPECT_LE(w.served[1] + w.served[2] + w.served[3], 360u * 8 / 64 + 1);
+		EXPECT_NE(access_trace_t::report().find("fc_layer_t"), std::string::npos);
+		access_trace_t::reset();
+	}
+#endif
 }
 
 #endif
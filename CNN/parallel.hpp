@@ -0,0 +1,198 @@
+#pragma once
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <vector>
+#include <string>
+#include <exception>
+#include "tracer_t.hpp"
+
+class thread_pool_t
+{
+public:
+	/*
+	  thread_pool_t keeps `thread_count - 1` worker threads around
+	  so we don't pay to start threads every time we need them.
+	  The calling thread does its share of the work too.
+
+	  parallel_for(n, body) runs body(i) for each i in [0, n) and
+	  returns when they are all done.  The schedule is static:
+	  iteration i always runs on thread i % thread_count, so work
+	  that depends on which thread it's on (e.g., one model
+	  replica per thread) is deterministic.
+
+	  A parallel_for() from inside body() (e.g., a layer that
+	  splits its work over the same pool its model is running
+	  on) runs serially on that thread instead of deadlocking.
+
+	  If body() throws, the rest of that thread's share is
+	  skipped, the other threads finish theirs, and then
+	  parallel_for() rethrows the first exception on the calling
+	  thread.
+	*/
+	const int thread_count;
+
+	thread_pool_t(int thread_count)
+		:
+		thread_count(std::max(1, thread_count)),
+		generation(0),
+		remaining(0),
+		stopping(false),
+		body(nullptr),
+		count(0)
+	{
+		for (int t = 1; t < this->thread_count; t++) {
+			workers.emplace_back([this, t]() { worker(t); });
+		}
+	}
+
+	~thread_pool_t() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		start.notify_all();
+		for (auto & w: workers) {
+			w.join();
+		}
+	}
+
+	void parallel_for(int n, const std::function<void(int)> & body) {
+		if (thread_count == 1 || n <= 1 || current() == this) {
+			for (int i = 0; i < n; i++) {
+				body(i);
+			}
+			return;
+		}
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			this->body = &body;
+			count = n;
+			remaining = thread_count - 1;
+			error = nullptr;
+			generation++;
+		}
+		start.notify_all();
+		run_share(0);
+		// Always wait: the workers are still using `body`.
+		std::unique_lock<std::mutex> lock(mutex);
+		done.wait(lock, [this]() { return remaining == 0; });
+		this->body = nullptr;
+		if (error) {
+			std::exception_ptr e = error;
+			error = nullptr;
+			std::rethrow_exception(e);
+		}
+	}
+
+private:
+	std::vector<std::thread> workers;
+	std::mutex mutex;
+	std::condition_variable start;
+	std::condition_variable done;
+	uint64_t generation;
+	int remaining;
+	bool stopping;
+	const std::function<void(int)> * body;
+	int count;
+	std::exception_ptr error; // The first exception body() threw.
+
+	// The pool whose body() this thread is running, if any.
+	static const thread_pool_t *& current() {
+		static thread_local const thread_pool_t * pool = nullptr;
+		return pool;
+	}
+
+	void run_share(int t) {
+		current() = this;
+		try {
+			for (int i = t; i < count; i += thread_count) {
+				(*body)(i);
+			}
+			current() = nullptr;
+		} catch (...) {
+			current() = nullptr;
+			std::lock_guard<std::mutex> lock(mutex);
+			if (!error) {
+				error = std::current_exception();
+			}
+		}
+	}
+
+	void worker(int t) {
+		tracer_t::name_thread("pool worker " + std::to_string(t));
+		uint64_t seen = 0;
+		while (true) {
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				start.wait(lock, [&]() { return stopping || generation != seen; });
+				if (stopping) {
+					return;
+				}
+				seen = generation;
+			}
+			run_share(t);
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				remaining--;
+			}
+			done.notify_one();
+		}
+	}
+};
+
+#ifdef INCLUDE_TESTS
+namespace CNNTest {
+
+	TEST_F(CNNTest, thread_pool) {
+		thread_pool_t pool(4);
+		for (int n : {0, 1, 3, 17}) {
+			std::vector<int> hits(n, 0);
+			std::vector<std::thread::id> who(n);
+			pool.parallel_for(n, [&](int i) {
+					hits[i]++;
+					who[i] = std::this_thread::get_id();
+				});
+			for (int i = 0; i < n; i++) {
+				EXPECT_EQ(hits[i], 1);
+				if (n > 1) {
+					// Static schedule.
+					EXPECT_EQ(who[i], who[i % pool.thread_count]);
+				}
+			}
+		}
+
+		// Exceptions from any thread come back to the caller, after
+		// every other iteration has run, and the pool still works.
+		for (int thrower: {0, 1, 2}) {
+			std::vector<int> hits(17, 0);
+			EXPECT_THROW(pool.parallel_for(17, [&](int i) {
+						if (i == thrower) {
+							throw_assert(false, "iteration " << i);
+						}
+						hits[i]++;
+					}), AssertionFailureException);
+			for (int i = 0; i < 17; i++) {
+				if (i % pool.thread_count != thrower % pool.thread_count) {
+					EXPECT_EQ(hits[i], 1) << i;
+				}
+			}
+		}
+		int total = 0;
+		std::mutex m;
+		pool.parallel_for(8, [&](int i) { std::lock_guard<std::mutex> lock(m); total += i; });
+		EXPECT_EQ(total, 28);
+
+		// Nested calls run on the thread that made them.
+		std::vector<int> inner_ok(4, 0);
+		pool.parallel_for(4, [&](int i) {
+				std::thread::id me = std::this_thread::get_id();
+				bool ok = true;
+				pool.parallel_for(5, [&](int) { ok = ok && std::this_thread::get_id() == me; });
+				inner_ok[i] = ok;
+			});
+		EXPECT_EQ(inner_ok, std::vector<int>(4, 1));
+	}
+}
+#endif
@@ -0,0 +1,253 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <sstream>
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <cerrno>
+#endif
+
+class perf_counters_t
+{
+public:
+	/*
+	  perf_counters_t reads hardware performance counters for the
+	  calling thread through Linux's perf_event interface: cycles,
+	  instructions, last-level cache misses, L1 data cache read
+	  misses, data TLB read misses, and branch misses.
+
+	  The counters are opened once, as a group, so one read()
+	  gets all of them at the same instant.  They count user-space
+	  work only, and they keep running; callers read() before and
+	  after the code they care about and take the difference (see
+	  profiler_t::set_counters()).
+
+	  Containers and VMs often don't allow perf events (see
+	  /proc/sys/kernel/perf_event_paranoid) or don't have some of
+	  the hardware events.  Events that won't open are just left
+	  out: has() tells you which ones we got, and read() gives
+	  zeros for the rest.  If none open, available() is false and
+	  status() says why, and profiling goes on with timing only.
+
+	  Opening isn't the same as counting, though.  If the group
+	  needs more hardware counters than are free (e.g., the NMI
+	  watchdog holds one), the kernel takes turns between it and
+	  other events, or never schedules it at all.  We ask for
+	  how long the group was enabled and how long it actually
+	  ran, and scale the counts up by enabled / running time, so
+	  they are estimates, which status() mentions.  If it never
+	  ran, the sample isn't valid, has() is false for every
+	  event from then on, and status() says so.
+	*/
+	enum event_t {
+		cycles = 0,
+		instructions,
+		cache_misses,
+		l1d_misses,
+		dtlb_misses,
+		branch_misses,
+		event_count
+	};
+
+	struct sample_t {
+		uint64_t values[event_count] = {};
+		bool valid = false; // The group was counting.
+	};
+
+	static const char * event_name(int e) {
+		static const char * names[] = {"cycles", "instructions", "cache_misses", "l1d_misses", "dtlb_misses", "branch_misses"};
+		return names[e];
+	}
+
+	perf_counters_t() {
+		for (int e = 0; e < event_count; e++) {
+			fds[e] = -1;
+		}
+#ifdef __linux__
+		for (int e = 0; e < event_count; e++) {
+			int fd = open_event(e, leader);
+			if (fd < 0) {
+				errors << (errors.tellp() > 0 ? "; " : "") << event_name(e) << ": " << strerror(errno);
+				continue;
+			}
+			fds[e] = fd;
+			if (leader < 0) {
+				leader = fd;
+			}
+			order[opened++] = e;
+		}
+		if (leader >= 0) {
+			ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+			ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+		}
+#else
+		errors << "perf events need Linux";
+#endif
+	}
+
+	~perf_counters_t() {
+#ifdef __linux__
+		for (int e = 0; e < event_count; e++) {
+			if (fds[e] >= 0) {
+				close(fds[e]);
+			}
+		}
+#endif
+	}
+
+	perf_counters_t(const perf_counters_t &) = delete;
+	perf_counters_t & operator=(const perf_counters_t &) = delete;
+
+	bool available() const {
+		return opened > 0;
+	}
+
+	// Did we open `e`, and is the kernel actually counting it?
+	bool has(int e) const {
+		return fds[e] >= 0 && !unscheduled;
+	}
+
+	void read(sample_t & s) const {
+#ifdef __linux__
+		if (!available()) {
+			return;
+		}
+		uint64_t buf[3 + event_count];
+		ssize_t n = ::read(leader, buf, sizeof(buf));
+		if (n < (ssize_t)(3 * sizeof(uint64_t))) {
+			return;
+		}
+		decode(buf, order, opened, s);
+		if (!s.valid) {
+			unscheduled = true;
+		} else if (buf[2] < buf[1]) {
+			multiplexed = true;
+		}
+#endif
+	}
+
+	// Unpack a read() of the group into `s`.  The format
+	// (PERF_FORMAT_GROUP with both total times) is the number of
+	// events, the time enabled and the time running, then one
+	// value per event in the order they joined the group
+	// (`order`).
+	static void decode(const uint64_t * buf, const int * order, int opened, sample_t & s) {
+		uint64_t enabled = buf[1];
+		uint64_t running = buf[2];
+		s.valid = running > 0;
+		if (!s.valid) {
+			return;
+		}
+		double scale = running < enabled ? double(enabled) / running : 1;
+		for (uint64_t i = 0; i < buf[0] && i < (uint64_t)opened; i++) {
+			s.values[order[i]] = uint64_t(buf[3 + i] * scale);
+		}
+	}
+
+	std::string status() const {
+		std::stringstream ss;
+		ss << "perf counters: " << opened << "/" << event_count << " events";
+		if (opened < event_count) {
+			ss << " (" << errors.str() << ")";
+		}
+		if (unscheduled) {
+			ss << "; the group was never scheduled (not enough free hardware counters?), so there are no counts";
+		} else if (multiplexed) {
+			ss << "; multiplexed with other events, so counts are scaled estimates";
+		}
+		return ss.str();
+	}
+
+private:
+	int fds[event_count];
+	int order[event_count];
+	int opened = 0;
+	int leader = -1;
+	std::stringstream errors;
+	mutable bool unscheduled = false;
+	mutable bool multiplexed = false;
+
+#ifdef __linux__
+	static int open_event(int e, int group) {
+		perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = PERF_TYPE_HARDWARE;
+		switch (e) {
+		case cycles:        attr.config = PERF_COUNT_HW_CPU_CYCLES; break;
+		case instructions:  attr.config = PERF_COUNT_HW_INSTRUCTIONS; break;
+		case cache_misses:  attr.config = PERF_COUNT_HW_CACHE_MISSES; break;
+		case branch_misses: attr.config = PERF_COUNT_HW_BRANCH_MISSES; break;
+		case l1d_misses:
+		case dtlb_misses:
+			attr.type = PERF_TYPE_HW_CACHE;
+			attr.config = (e == l1d_misses ? PERF_COUNT_HW_CACHE_L1D : PERF_COUNT_HW_CACHE_DTLB) |
+				(PERF_COUNT_HW_CACHE_OP_READ << 8) |
+				(PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+			break;
+		}
+		attr.disabled = group < 0; // The leader starts the group.
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+		return syscall(__NR_perf_event_open, &attr, 0, -1, group, 0);
+	}
+#endif
+};
+
+#ifdef INCLUDE_TESTS
+namespace CNNTest {
+
+	TEST_F(CNNTest, perf_counters) {
+		// We may or may not get counters here, but it must
+		// never fail.
+		perf_counters_t counters;
+		EXPECT_FALSE(counters.status().empty());
+		perf_counters_t::sample_t before, after;
+		counters.read(before);
+		volatile double x = 0;
+		for (int i = 0; i < 100000; i++) {
+			x = x + i;
+		}
+		counters.read(after);
+		for (int e = 0; e < perf_counters_t::event_count; e++) {
+			if (!counters.has(e)) {
+				EXPECT_EQ(after.values[e], 0u);
+			}
+		}
+		if (counters.has(perf_counters_t::instructions)) {
+			EXPECT_TRUE(after.valid);
+			EXPECT_GT(after.values[perf_counters_t::instructions], before.values[perf_counters_t::instructions] + 100000);
+		}
+	}
+
+	TEST_F(CNNTest, perf_counters_decode) {
+		int order[] = {perf_counters_t::instructions, perf_counters_t::cycles};
+		perf_counters_t::sample_t s;
+
+		// Counted the whole time.
+		uint64_t full[] = {2, 1000, 1000, 50, 70};
+		perf_counters_t::decode(full, order, 2, s);
+		EXPECT_TRUE(s.valid);
+		EXPECT_EQ(s.values[perf_counters_t::instructions], 50u);
+		EXPECT_EQ(s.values[perf_counters_t::cycles], 70u);
+
+		// Multiplexed: ran a quarter of the time.
+		uint64_t shared[] = {2, 1000, 250, 50, 70};
+		perf_counters_t::decode(shared, order, 2, s);
+		EXPECT_TRUE(s.valid);
+		EXPECT_EQ(s.values[perf_counters_t::instructions], 200u);
+		EXPECT_EQ(s.values[perf_counters_t::cycles], 280u);
+
+		// Never scheduled.
+		perf_counters_t::sample_t never;
+		uint64_t none[] = {2, 1000, 0, 0, 0};
+		perf_counters_t::decode(none, order, 2, never);
+		EXPECT_FALSE(never.valid);
+	}
+}
+#endif
@@ -0,0 +1,267 @@
+#pragma once
+#include <chrono>
+#include <memory>
+#include <functional>
+#include "model_t.hpp"
+#include "parallel.hpp"
+#include "spsc_queue_t.hpp"
+
+class pipeline_t
+{
+public:
+	/*
+	  pipeline_t streams inputs through a model with the layers
+	  split into stages that run on separate threads.  model_t::apply()
+	  runs one input through every layer before it starts on the
+	  next, so only one layer is ever busy.  Here, while stage 1 is
+	  working on frame n, stage 0 can start on frame n+1, so in
+	  steady state the throughput is limited by the slowest stage
+	  rather than the sum of all of them.
+
+	  Each stage is a contiguous run of the model's plan (so fused
+	  layers stay together).  We time each layer on a sample input
+	  and then split the layers so that the slowest stage is as
+	  fast as possible.  Adjacent stages are connected by an
+	  spsc_queue_t: a stage copies its last layer's output into a
+	  free slot, and the next stage runs its first layer on that
+	  slot.
+
+	  Each layer only ever runs on its stage's thread, so the
+	  layers need no locking, but they can't share memory either:
+	  memory planning and checkpointing must be off.  Build the
+	  pipeline once the model is done changing, and don't use the
+	  model yourself while run() is going.
+	*/
+
+	struct stage_t {
+		int first;    // Index into `plan` of the stage's first layer.
+		int last;     // One past the stage's last layer.
+		double cost;  // Estimated seconds per frame.
+
+		// From the last run().
+		int frames;
+		double busy;     // Seconds running layers.
+		double starved;  // Seconds waiting for input.
+		double blocked;  // Seconds waiting for room in the output queue.
+	};
+
+	model_t & model;
+	std::vector<layer_t*> plan;
+	std::vector<stage_t> stages;
+	double last_run_seconds;
+
+	pipeline_t(model_t & model, int stage_count, tensor_t<double> & sample, int queue_capacity = 4)
+		:
+		model(model),
+		plan(model.get_plan()),
+		last_run_seconds(0),
+		pool(std::max(1, std::min<int>(stage_count, model.get_plan().size())))
+	{
+		throw_assert(!model.enable_memory_planning && !model.checkpoint_budget,
+			     "Pipeline stages run concurrently, so they can't share a memory arena.");
+		partition(layer_costs(sample), pool.thread_count);
+		for (uint s = 0; s + 1 < stages.size(); s++) {
+			queues.emplace_back(new spsc_queue_t(plan[stages[s].last - 1]->out.size, queue_capacity));
+		}
+	}
+
+	typedef std::function<tensor_t<double> & (int)> source_t;
+	typedef std::function<void (int, const tensor_t<double> &)> sink_t;
+
+	// Run `frames` inputs through the pipeline.  source(i) provides
+	// frame i, and sink(i, out) gets its output.  source() is called
+	// on the first stage's thread and sink() on the last stage's,
+	// each in frame order.
+	void run(int frames, const source_t & source, const sink_t & sink) {
+		auto start = std::chrono::steady_clock::now();
+		pool.parallel_for(stages.size(), [&](int s) {
+				run_stage(s, frames, source, sink);
+			});
+		last_run_seconds = seconds_since(start);
+	}
+
+	void run(std::vector<tensor_t<double>> & inputs, std::vector<tensor_t<double>> & outputs) {
+		outputs.clear();
+		outputs.reserve(inputs.size());
+		run(inputs.size(),
+		    [&](int i) -> tensor_t<double> & { return inputs[i]; },
+		    [&](int, const tensor_t<double> & out) { outputs.push_back(out); });
+	}
+
+	// Fraction of the last run() that stage `s` spent running layers.
+	double utilization(int s) const {
+		return last_run_seconds > 0 ? stages[s].busy / last_run_seconds : 0;
+	}
+
+	std::string report() const {
+		std::stringstream ss;
+		ss << "Pipeline " << stages.size() << " stages";
+		if (last_run_seconds > 0) {
+			ss << ", " << stages[0].frames / last_run_seconds << " frames/s";
+		}
+		ss << "\n";
+		for (uint s = 0; s < stages.size(); s++) {
+			const stage_t & st = stages[s];
+			ss << "stage[" << s << "] layers [" << st.first << ", " << st.last << ") est "
+			   << st.cost * 1e6 << " us/frame";
+			if (last_run_seconds > 0) {
+				ss << ": utilization " << utilization(s) * 100.0 << "%"
+				   << " starved " << st.starved / last_run_seconds * 100.0 << "%"
+				   << " blocked " << st.blocked / last_run_seconds * 100.0 << "%";
+			}
+			ss << " :";
+			for (int i = st.first; i < st.last; i++) {
+				ss << " " << plan[i]->kind_str();
+			}
+			ss << "\n";
+		}
+		return ss.str();
+	}
+
+private:
+	thread_pool_t pool;
+	std::vector<std::unique_ptr<spsc_queue_t>> queues; // queues[s] goes from stage s to s+1.
+
+	static double seconds_since(std::chrono::steady_clock::time_point start) {
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	// Time each layer on `sample`.
+	std::vector<double> layer_costs(tensor_t<double> & sample) {
+		const int runs = 3;
+		std::vector<double> costs(plan.size(), 0.0);
+		for (int r = 0; r < runs; r++) {
+			for (uint i = 0; i < plan.size(); i++) {
+				auto start = std::chrono::steady_clock::now();
+				plan[i]->activate(i == 0 ? sample : plan[i - 1]->out);
+				costs[i] += seconds_since(start) / runs;
+			}
+		}
+		return costs;
+	}
+
+	// Split the layers into `k` contiguous, non-empty stages so
+	// that the most expensive stage is as cheap as possible.
+	void partition(const std::vector<double> & costs, int k) {
+		int n = costs.size();
+		std::vector<double> prefix(n + 1, 0.0);
+		for (int i = 0; i < n; i++) {
+			prefix[i + 1] = prefix[i] + costs[i];
+		}
+		// best[j][i]: the cheapest split of the first i layers
+		// into j stages, and where its last stage starts.
+		const double inf = std::numeric_limits<double>::infinity();
+		std::vector<std::vector<double>> best(k + 1, std::vector<double>(n + 1, inf));
+		std::vector<std::vector<int>> cut(k + 1, std::vector<int>(n + 1, 0));
+		best[0][0] = 0;
+		for (int j = 1; j <= k; j++) {
+			for (int i = j; i <= n; i++) {
+				for (int c = j - 1; c < i; c++) {
+					double m = std::max(best[j - 1][c], prefix[i] - prefix[c]);
+					if (m < best[j][i]) {
+						best[j][i] = m;
+						cut[j][i] = c;
+					}
+				}
+			}
+		}
+		stages.assign(k, stage_t());
+		for (int j = k, i = n; j > 0; i = cut[j][i], j--) {
+			stages[j - 1] = {cut[j][i], i, prefix[i] - prefix[cut[j][i]], 0, 0, 0, 0};
+		}
+	}
+
+	void run_stage(int s, int frames, const source_t & source, const sink_t & sink) {
+		stage_t & st = stages[s];
+		st.frames = 0;
+		st.busy = st.starved = st.blocked = 0;
+		for (int f = 0; f < frames; f++) {
+			auto start = std::chrono::steady_clock::now();
+			tensor_t<double> & in = s == 0 ? source(f) : queues[s - 1]->front();
+			auto ready = std::chrono::steady_clock::now();
+			st.starved += std::chrono::duration<double>(ready - start).count();
+
+			for (int i = st.first; i < st.last; i++) {
+				plan[i]->activate(i == st.first ? in : plan[i - 1]->out);
+			}
+			const tensor_t<double> & out = plan[st.last - 1]->out;
+			auto done = std::chrono::steady_clock::now();
+			st.busy += std::chrono::duration<double>(done - ready).count();
+			if (tracer_t::enabled()) {
+				tracer_t::record("starved", "pipeline", s, start, ready);
+				tracer_t::record("stage", "pipeline", s, ready, done);
+			}
+
+			if (s + 1 < (int)stages.size()) {
+				tensor_t<double> & slot = queues[s]->reserve();
+				st.blocked += seconds_since(done);
+				if (tracer_t::enabled()) {
+					tracer_t::record("blocked", "pipeline", s, done, std::chrono::steady_clock::now());
+				}
+				memcpy(slot.data, out.data, out.element_count() * sizeof(double));
+				queues[s]->publish();
+			} else {
+				sink(f, out);
+			}
+			if (s > 0) {
+				// Our last layer may be in place, so we
+				// can't give back our input slot until its
+				// output is copied out.
+				queues[s - 1]->pop();
+			}
+			st.frames++;
+		}
+	}
+};
+
+#ifdef INCLUDE_TESTS
+namespace CNNTest {
+
+	TEST_F(CNNTest, pipeline) {
+		conv_layer_t  l1( 1, 5, 8, 0, tdsize(28,28,1,1) );
+		relu_layer_t  l2( l1.out.size );
+		pool_layer_t  l3( 2, 2, 0, l2.out.size );
+		fc_layer_t    l4( l3.out.size, 30 );
+		relu_layer_t  l5( l4.out.size, true );
+		fc_layer_t    l6( l5.out.size, 10 );
+		model_t model;
+		model.add_layer(l1);
+		model.add_layer(l2);
+		model.add_layer(l3);
+		model.add_layer(l4);
+		model.add_layer(l5);
+		model.add_layer(l6);
+		model.set_training(false);
+
+		std::vector<tensor_t<double>> inputs;
+		std::vector<tensor_t<double>> expected;
+		for (int i = 0; i < 20; i++) {
+			inputs.emplace_back(28,28,1,1);
+			randomize(inputs.back());
+			expected.push_back(model.apply(inputs.back()));
+		}
+
+		for (int stages : {1, 3, 10}) {
+			pipeline_t pipeline(model, stages, inputs[0], 2);
+			EXPECT_EQ(pipeline.stages.size(), std::min<size_t>(stages, model.get_plan().size()));
+			EXPECT_EQ(pipeline.stages.front().first, 0);
+			EXPECT_EQ(pipeline.stages.back().last, (int)model.get_plan().size());
+			for (uint s = 1; s < pipeline.stages.size(); s++) {
+				EXPECT_EQ(pipeline.stages[s].first, pipeline.stages[s - 1].last);
+				EXPECT_LT(pipeline.stages[s].first, pipeline.stages[s].last);
+			}
+
+			std::vector<tensor_t<double>> outputs;
+			pipeline.run(inputs, outputs);
+			for (uint i = 0; i < inputs.size(); i++) {
+				EXPECT_EQ(outputs[i], expected[i]);
+			}
+			for (uint s = 0; s < pipeline.stages.size(); s++) {
+				EXPECT_EQ(pipeline.stages[s].frames, 20);
+				EXPECT_LE(pipeline.utilization(s), 1.0);
+			}
+			pipeline.report();
+		}
+	}
+}
+#endif
@@ -8,6 +8,7 @@ public:
 	const uint16_t stride;
 	const uint16_t filter_size;
 	double pad;
+	tensor_t<int> switches; // For each output, the linear index of the input that was the max (-1 for padding).
 	pool_layer_t( uint16_t stride, uint16_t filter_size, double pad, tdsize in_size )
 		:
 		layer_t(in_size, tdsize(ROUND_UP_IDIV(in_size.x, stride),
@@ -15,14 +16,47 @@ public:
 					in_size.z, in_size.b)),
 		stride(stride),
 		filter_size(filter_size),
-		pad(pad)
+		pad(pad),
+		switches(out.size)
 	{
 		throw_assert(filter_size >= stride, "Pool filter size (" << filter_size << ") must be >= stride (" << stride << ").");
+		clear_switches();
+	}
+
+	void clear_switches() {
+		for ( size_t n = 0; n < switches.element_count(); n++ ) {
+			switches.data[n] = -1;
+		}
+	}
+
+	void change_batch_size(int new_batch_size) {
+		layer_t::change_batch_size(new_batch_size);
+		switches = tensor_t<int>(out.size);
+		clear_switches();
+	}
+
+	size_t get_total_memory_size() const {
+		return switches.get_total_memory_size() + layer_t::get_total_memory_size();
 	}
 
 	std::string kind_str() const {
 		return "pool_layer_t";
 	}
+
+	void label_tensors(const std::string & prefix) const {
+		layer_t::label_tensors(prefix);
+		access_trace_t::label(&switches, prefix + "switches");
+	}
+
+	layer_cost_t cost() const {
+		const double I = in.element_count();
+		const double O = out.element_count();
+		layer_cost_t c;
+		// A comparison per candidate, and the switches.
+		c[layer_phase::activate] = {filter_size * filter_size * O, 8 * (I + O) + sizeof(int) * O};
+		c[layer_phase::calc_grads] = {O, 8 * (I + O) + sizeof(int) * O};
+		return c;
+	}
 	std::string param_str() const {
 		std::stringstream ss;
 		ss << "stride=" << stride << ", filter_size=" << filter_size  << ", pad=" << pad;
@@ -35,6 +69,7 @@ public:
 		if (o.in != in) return false;
 		if (o.grads_out != grads_out) return false;
 		if (o.out != out) return false;
+		if (o.switches != switches) return false;
 		return true;
 	}
 
@@ -42,33 +77,80 @@ public:
 		return !(*this == o);
 	}
 
+	layer_t * replicate() const {
+		return new pool_layer_t(*this);
+	}
+
 	range_t map_to_output( int x, int y )
 	{
 		return map_to_output_impl(x, y, filter_size, stride, out.size.z, out.size);
 	}
 
 	void activate(tensor_t<double>& in ) {
-		copy_input(in);
+		bind_input(in);
+		if (filter_size == 2 && stride == 2 && in.size.x % 2 == 0 && in.size.y % 2 == 0) {
+			activate_2x2(in);
+			return;
+		}
 		for ( int b = 0; b < out.size.b; b++ ) {
 			for ( int x = 0; x < out.size.x; x++ ) {
 				for ( int y = 0; y < out.size.y; y++ ) {
 					for ( int z = 0; z < out.size.z; z++ ) {
 						point_t mapped(x*stride, y*stride, 0);
 						double mval = -FLT_MAX;
+						int mloc = -1;
 						for ( int i = 0; i < filter_size; i++ )
 							for ( int j = 0; j < filter_size; j++ ) {
 								double v;
+								int loc;
 								if (mapped.x + i >= in.size.x ||
 							    	mapped.y + j >= in.size.y) {
 									v = pad;
+									loc = -1;
 								} else {
-									v = in( mapped.x + i, mapped.y + j, z );
+									v = in( mapped.x + i, mapped.y + j, z, b );
+									loc = in.linearize( mapped.x + i, mapped.y + j, z, b );
 								}
 
-								if ( v > mval )
+								if ( v > mval ) {
 									mval = v;
+									mloc = loc;
+								}
 							}
 						out( x, y, z, b ) = mval;
+						switches( x, y, z, b ) = mloc;
+					}
+				}
+			}
+		}
+	}
+
+	// The common 2x2, stride-2 case with no padding.  Each output
+	// reads two adjacent pairs from two consecutive rows, so we
+	// walk the rows with raw pointers and pick the max with
+	// selects instead of branches, which the compiler can
+	// vectorize.  The candidates are visited in the same order as
+	// the general loop above, so ties resolve the same way.
+	void activate_2x2(const tensor_t<double>& in) {
+		const int row = in.size.x;
+		for ( int b = 0; b < out.size.b; b++ ) {
+			for ( int z = 0; z < out.size.z; z++ ) {
+				for ( int y = 0; y < out.size.y; y++ ) {
+					const int base = in.linearize(0, 2 * y, z, b);
+					const double * r0 = &in.data[base];
+					const double * r1 = r0 + row;
+					double * o = &out( 0, y, z, b );
+					int * s = &switches( 0, y, z, b );
+					for ( int x = 0; x < out.size.x; x++ ) {
+						double m = -FLT_MAX;
+						int loc = -1;
+						double v;
+						v = r0[2 * x];     loc = v > m ? base + 2 * x           : loc; m = v > m ? v : m;
+						v = r1[2 * x];     loc = v > m ? base + row + 2 * x     : loc; m = v > m ? v : m;
+						v = r0[2 * x + 1]; loc = v > m ? base + 2 * x + 1       : loc; m = v > m ? v : m;
+						v = r1[2 * x + 1]; loc = v > m ? base + row + 2 * x + 1 : loc; m = v > m ? v : m;
+						o[x] = m;
+						s[x] = loc;
 					}
 				}
 			}
@@ -80,23 +162,17 @@ public:
 
 	}
 
+	// activate() recorded where each output's max came from, so
+	// the gradient just flows back to that one input.  Outputs
+	// whose max was padding don't have an input to blame.
 	void calc_grads(const tensor_t<double>& grad_next_layer )
 	{
-		for ( int b = 0; b < in.size.b; b++ ) {
-			for ( int x = 0; x < in.size.x; x++ ) {
-				for ( int y = 0; y < in.size.y; y++ ) {
-					range_t rn = map_to_output( x, y );
-					for ( int z = 0; z < in.size.z; z++ ) {
-						double sum_error = 0;
-						for ( int i = rn.min_x; i <= rn.max_x; i++ ) {
-							for ( int j = rn.min_y; j <= rn.max_y; j++ ) {
-								int is_max = in( x, y, z ) == out( i, j, z ) ? 1 : 0;
-								sum_error += is_max * grad_next_layer( i, j, z );
-							}
-						}
-						grads_out( x, y, z, b ) = sum_error;
-					}
-				}
+		throw_assert(grad_next_layer.size == out.size, "mismatch input size for calc_grads");
+		grads_out.clear();
+		for ( size_t n = 0; n < switches.element_count(); n++ ) {
+			int s = switches.data[n];
+			if ( s >= 0 ) {
+				grads_out.data[s] += grad_next_layer.data[n];
 			}
 		}
 	}
@@ -239,6 +315,46 @@ namespace CNNTest{
 		
 	}
 
+	TEST_F(CNNTest, pool_switches) {
+		tensor_t<double> in(4,4,1,2);
+		in(0,0,0,0) = 1; // tie with (1,0) below.  Only the first one gets the gradient.
+		in(1,0,0,0) = 1;
+		in(3,3,0,0) = 5;
+		in(2,1,0,1) = 7; // the second batch element is pooled on its own.
+
+		pool_layer_t layer(2, 2, 0, in.size);
+		layer.activate(in);
+		EXPECT_EQ(layer.out(0,0,0,0), 1);
+		EXPECT_EQ(layer.out(1,1,0,0), 5);
+		EXPECT_EQ(layer.out(1,0,0,1), 7);
+
+		tensor_t<double> next_grads(layer.out.size);
+		TENSOR_FOR(next_grads, x,y,z,b) next_grads(x,y,z,b) = 1;
+		layer.calc_grads(next_grads);
+		EXPECT_EQ(layer.grads_out(0,0,0,0), 1);
+		EXPECT_EQ(layer.grads_out(1,0,0,0), 0);
+		EXPECT_EQ(layer.grads_out(3,3,0,0), 1);
+		EXPECT_EQ(layer.grads_out(2,1,0,1), 1);
+		EXPECT_EQ(layer.grads_out(3,3,0,1), 0);
+	}
+
+	TEST_F(CNNTest, pool_2x2) {
+		srand(42);
+		tensor_t<double> in(8,6,3,2);
+		randomize(in);
+		pool_layer_t layer(2, 2, 0, in.size);
+		layer.activate(in);
+
+		TENSOR_FOR(layer.out, x,y,z,b) {
+			double m = -FLT_MAX;
+			for (int i = 0; i < 2; i++)
+				for (int j = 0; j < 2; j++)
+					m = std::max(m, in(2*x + i, 2*y + j, z, b));
+			EXPECT_EQ(layer.out(x,y,z,b), m);
+			EXPECT_EQ(in.data[layer.switches(x,y,z,b)], m);
+		}
+	}
+
 
 }  // namespace
 #endif
@@ -0,0 +1,280 @@
+#pragma once
+#include <chrono>
+#include <sstream>
+#include <vector>
+#include "layer_t.hpp"
+#include "perf_counters_t.hpp"
+#include "tracer_t.hpp"
+
+class profiler_t
+{
+public:
+	/*
+	  profiler_t records where a model's time goes: wall time and
+	  call counts for each layer in the model's plan and each phase
+	  (activate, calc_grads, fix_weights), plus the time for whole
+	  training steps (model_t::train() and train_batch()).  Each
+	  layer's analytic FLOP and byte counts (layer_t::cost()) come
+	  along, so the export shows achieved GFLOP/s and GB/s too.
+
+	  Hook one up with model_t::set_profiler().  Recording costs
+	  two clock reads per layer per phase, which is small next to
+	  any real layer, so it's fine to leave on.  A profiler
+	  belongs to one model and isn't thread-safe.
+
+	  With set_counters(), each layer and phase also gets hardware
+	  counter totals (cache, TLB, and branch misses, instructions,
+	  and cycles; see perf_counters_t).  That costs a read() system
+	  call at each end of every call, so it's for tuning sessions,
+	  not production.  Without counters (or if the machine won't
+	  give us any), it's timing only.
+
+	  csv() and json() export the results.
+	*/
+	struct phase_stats_t {
+		uint64_t calls = 0;
+		double seconds = 0;
+		uint64_t counts[perf_counters_t::event_count] = {};
+	};
+
+	struct layer_stats_t {
+		const layer_t * layer;
+		std::string spec;
+		layer_cost_t cost; // Per call.
+		phase_stats_t phases[layer_phase_count];
+	};
+
+	std::vector<layer_stats_t> layers;
+	uint64_t steps = 0;
+	double step_seconds = 0;
+	perf_counters_t * counters = nullptr;
+
+	// Collect hardware counters from `counters` too (nullptr to
+	// stop).  If none of its events are available, we ignore it.
+	void set_counters(perf_counters_t * counters) {
+		this->counters = counters && counters->available() ? counters : nullptr;
+	}
+
+	// Start tracking `plan` (model_t calls this whenever it
+	// rebuilds its plan).  If it's the same layers as before, we
+	// keep the numbers so far.
+	void attach(const std::vector<layer_t*> & plan) {
+		bool same = plan.size() == layers.size();
+		for (uint i = 0; same && i < plan.size(); i++) {
+			same = layers[i].layer == plan[i];
+		}
+		if (!same) {
+			layers.assign(plan.size(), layer_stats_t());
+		}
+		for (uint i = 0; i < plan.size(); i++) {
+			layers[i].layer = plan[i];
+			layers[i].spec = plan[i]->spec_str();
+			layers[i].cost = plan[i]->cost();
+		}
+	}
+
+	void reset() {
+		for (auto & l: layers) {
+			for (auto & p: l.phases) {
+				p = phase_stats_t();
+			}
+		}
+		steps = 0;
+		step_seconds = 0;
+	}
+
+	void record(int layer, layer_phase phase, double seconds) {
+		phase_stats_t & p = layers[layer].phases[(int)phase];
+		p.calls++;
+		p.seconds += seconds;
+	}
+
+	void record_counts(int layer, layer_phase phase,
+			   const perf_counters_t::sample_t & before, const perf_counters_t::sample_t & after) {
+		if (!before.valid || !after.valid) {
+			return; // The counters weren't running (see perf_counters_t::status()).
+		}
+		phase_stats_t & p = layers[layer].phases[(int)phase];
+		for (int e = 0; e < perf_counters_t::event_count; e++) {
+			// Scaled (multiplexed) counts are estimates and can
+			// step backwards.
+			if (after.values[e] > before.values[e]) {
+				p.counts[e] += after.values[e] - before.values[e];
+			}
+		}
+	}
+
+	void record_step(double seconds) {
+		steps++;
+		step_seconds += seconds;
+	}
+
+	// Times the enclosing block and records it for `layer` and
+	// `phase`, or as a step.  If `profiler` is null and tracing is
+	// off, it does nothing.
+	class scope_t {
+	public:
+		scope_t(profiler_t * profiler, int layer, layer_phase phase)
+			: profiler(profiler), layer(layer), phase(phase), tracing(tracer_t::enabled())
+		{
+#ifdef TRACE_TENSOR_ACCESSES
+			if (layer >= 0) {
+				access_trace_t::set_context(layer, (int)phase);
+			}
+#endif
+			if (!profiler && !tracing) {
+				return;
+			}
+			if (profiler && profiler->counters && layer >= 0) {
+				profiler->counters->read(counts);
+			}
+			start = std::chrono::steady_clock::now();
+		}
+
+		scope_t(profiler_t * profiler) : scope_t(profiler, -1, layer_phase::activate) {}
+
+		~scope_t() {
+#ifdef TRACE_TENSOR_ACCESSES
+			if (layer >= 0) {
+				access_trace_t::set_context(-1, -1);
+			}
+#endif
+			if (!profiler && !tracing) {
+				return;
+			}
+			auto end = std::chrono::steady_clock::now();
+			if (tracing) {
+				if (layer < 0) {
+					tracer_t::record("step", "model", -1, start, end);
+				} else {
+					tracer_t::record(phase_name((int)phase), "layer", layer, start, end);
+				}
+			}
+			if (!profiler) {
+				return;
+			}
+			double s = std::chrono::duration<double>(end - start).count();
+			if (layer < 0) {
+				profiler->record_step(s);
+				return;
+			}
+			profiler->record(layer, phase, s);
+			if (profiler->counters) {
+				perf_counters_t::sample_t now;
+				profiler->counters->read(now);
+				profiler->record_counts(layer, phase, counts, now);
+			}
+		}
+
+	private:
+		profiler_t * profiler;
+		int layer;
+		layer_phase phase;
+		bool tracing;
+		std::chrono::steady_clock::time_point start;
+		perf_counters_t::sample_t counts;
+	};
+
+	static const char * phase_name(int p) {
+		static const char * names[] = {"activate", "calc_grads", "fix_weights"};
+		return names[p];
+	}
+
+	// Totals for a phase over every call.
+	double flops(int layer, int phase) const {
+		return layers[layer].cost.phases[phase].flops * layers[layer].phases[phase].calls;
+	}
+
+	double bytes(int layer, int phase) const {
+		return layers[layer].cost.phases[phase].bytes * layers[layer].phases[phase].calls;
+	}
+
+	// Instructions per cycle, if we have both counters.
+	double ipc(int layer, int phase) const {
+		const phase_stats_t & s = layers[layer].phases[phase];
+		uint64_t c = s.counts[perf_counters_t::cycles];
+		return c ? double(s.counts[perf_counters_t::instructions]) / c : 0;
+	}
+
+	// One row per layer and phase.  The counter columns are only
+	// there if we have counters.
+	std::string csv() const {
+		std::stringstream ss;
+		ss << "layer,kind,phase,calls,seconds,flops,bytes,gflops_per_second,gbytes_per_second";
+		if (counters) {
+			for (int e = 0; e < perf_counters_t::event_count; e++) {
+				ss << "," << perf_counters_t::event_name(e);
+			}
+			ss << ",ipc";
+		}
+		ss << "\n";
+		for (uint l = 0; l < layers.size(); l++) {
+			for (int p = 0; p < layer_phase_count; p++) {
+				const phase_stats_t & s = layers[l].phases[p];
+				ss << l << ",\"" << layers[l].spec << "\"," << phase_name(p) << ","
+				   << s.calls << "," << s.seconds << ","
+				   << flops(l, p) << "," << bytes(l, p) << ","
+				   << rate(flops(l, p), s.seconds) << "," << rate(bytes(l, p), s.seconds);
+				if (counters) {
+					for (int e = 0; e < perf_counters_t::event_count; e++) {
+						ss << ",";
+						if (counters->has(e)) {
+							ss << s.counts[e];
+						}
+					}
+					ss << "," << ipc(l, p);
+				}
+				ss << "\n";
+			}
+		}
+		ss << "step,,step," << steps << "," << step_seconds << ",,,," << (counters ? std::string(perf_counters_t::event_count + 1, ',') : "") << "\n";
+		return ss.str();
+	}
+
+	std::string json() const {
+		std::stringstream ss;
+		ss << "{\"steps\": " << steps << ", \"step_seconds\": " << step_seconds << ", \"layers\": [";
+		for (uint l = 0; l < layers.size(); l++) {
+			ss << (l ? ", " : "") << "{\"index\": " << l << ", \"spec\": \"" << escape(layers[l].spec) << "\", \"phases\": {";
+			for (int p = 0; p < layer_phase_count; p++) {
+				const phase_stats_t & s = layers[l].phases[p];
+				ss << (p ? ", " : "") << "\"" << phase_name(p) << "\": {"
+				   << "\"calls\": " << s.calls
+				   << ", \"seconds\": " << s.seconds
+				   << ", \"flops\": " << flops(l, p)
+				   << ", \"bytes\": " << bytes(l, p);
+				if (counters) {
+					ss << ", \"counters\": {";
+					bool first = true;
+					for (int e = 0; e < perf_counters_t::event_count; e++) {
+						if (counters->has(e)) {
+							ss << (first ? "" : ", ") << "\"" << perf_counters_t::event_name(e) << "\": " << s.counts[e];
+							first = false;
+						}
+					}
+					ss << "}, \"ipc\": " << ipc(l, p);
+				}
+				ss << "}";
+			}
+			ss << "}}";
+		}
+		ss << "]}\n";
+		return ss.str();
+	}
+
+private:
+	static double rate(double amount, double seconds) {
+		return seconds > 0 ? amount / seconds / 1e9 : 0;
+	}
+
+	static std::string escape(const std::string & s) {
+		std::string r;
+		for (char c: s) {
+			if (c == '"' || c == '\\') {
+				r += '\\';
+			}
+			r += c;
+		}
+		return r;
+	}
+};
@@ -1,13 +1,21 @@
 #pragma once
-#include "layer_t.hpp"
+#include "elementwise_layer_t.hpp"
 
-class relu_layer_t : public layer_t
+class relu_layer_t : public elementwise_layer_t
 {
 public:
-	relu_layer_t(const tdsize & in_size )
+	bitmask_t mask; // Which elements were >= 0 (and so pass their gradient back).
+
+	relu_layer_t(const tdsize & in_size, bool in_place = false)
 		:
-		layer_t(in_size, in_size)
+		elementwise_layer_t(in_size, in_place),
+		mask(in.element_count())
 	{
+		mask.fill(true);
+	}
+
+	layer_t * replicate() const {
+		return new relu_layer_t(*this);
 	}
 
 	std::string kind_str() const {
@@ -25,41 +33,34 @@ public:
 	bool operator!=(const relu_layer_t & o) const {
 		return !(*this == o);
 	}
-	
-	void activate(tensor_t<double>& in ) {
-		copy_input(in);
-		for (int b = 0; b < in.size.b; b++ )
-			for ( int x = 0; x < in.size.x; x++ )
-				for ( int y = 0; y < in.size.y; y++ )
-					for ( int z = 0; z < in.size.z; z++ )
-					{
-						double v = in( x, y, z, b );
-						if ( v < 0 ) {
-							v = 0;
-						}
-						out( x, y, z, b ) = v;
-					}
-	}
 
-	void fix_weights()
-	{
+	size_t get_total_memory_size() const {
+		return mask.get_total_memory_size() + layer_t::get_total_memory_size();
+	}
 
+	void change_batch_size(int new_batch_size) {
+		elementwise_layer_t::change_batch_size(new_batch_size);
+		mask.resize(in.element_count());
+		mask.fill(true);
 	}
 
-	void calc_grads(const tensor_t<double>& grad_next_layer )
-	{
-		throw_assert(grad_next_layer.size == in.size, "mismatched input");
-		for ( int b = 0; b < in.size.b; b++ )
-			for ( int i = 0; i < in.size.x; i++ )
-				for ( int j = 0; j < in.size.y; j++ )
-					for ( int z = 0; z < in.size.z; z++ )
-					{
-						grads_out( i, j, z ) = (in( i, j, z ) < 0) ?
-							(0) :
-							(grad_next_layer( i, j, z ));
-					}
+	void forward_span(double * data, size_t begin, size_t end) {
+		for ( size_t i = begin; i < end; i++ ) {
+			double v = data[i];
+			bool pass = !(v < 0);
+			mask.set(i, pass);
+			data[i] = pass ? v : 0;
+		}
+	}
 
+	void backward_span(double * data, size_t begin, size_t end) {
+		for ( size_t i = begin; i < end; i++ ) {
+			if (!mask.get(i)) {
+				data[i] = 0;
+			}
+		}
 	}
+
 	std::string regression_code() const {
 		std::stringstream ss;
 		ss << "relu_test<opt_relu_layer_t>("
@@ -222,5 +223,28 @@ namespace CNNTest{
 
 	}
 	
+	TEST_F(CNNTest, relu_in_place) {
+		srand(42);
+		tensor_t<double> data(4,4,4,2);
+		randomize(data);
+		TENSOR_FOR(data, x,y,z,b) data(x,y,z,b) -= 0.5;
+		tensor_t<double> next_grads(data.size);
+		randomize(next_grads);
+
+		relu_layer_t copying(data.size);
+		copying.activate(data);
+		copying.calc_grads(next_grads);
+
+		relu_layer_t in_place(data.size, true);
+		EXPECT_LT(in_place.get_total_memory_size(), copying.get_total_memory_size());
+		tensor_t<double> producer_out(data);
+		in_place.activate(producer_out);
+		in_place.calc_grads(next_grads);
+
+		EXPECT_EQ(in_place.out.data, producer_out.data); // No copy.
+		EXPECT_EQ(copying.out, producer_out);
+		EXPECT_EQ(copying.grads_out, in_place.grads_out);
+	}
+	
 }  // namespace
 #endif
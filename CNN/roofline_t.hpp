@@ -0,0 +1,183 @@
+#pragma once
+#include <chrono>
+#include <iomanip>
+#include <sstream>
+#include <vector>
+#include "profiler_t.hpp"
+
+struct roofline_t
+{
+	/*
+	  roofline_t places layers on a roofline.  A kernel that does
+	  F floating point operations while moving B bytes has an
+	  arithmetic intensity of F/B, and it can't run faster than
+
+	     min(peak_gflops, intensity * peak_gbytes)
+
+	  so if its intensity is below the "ridge point"
+	  (peak_gflops / peak_gbytes) it's bandwidth-bound, and
+	  otherwise it's compute-bound.
+
+	  measure() probes the machine: a STREAM-style triad over
+	  arrays much bigger than the caches for bandwidth, and
+	  independent multiply-add chains for FLOPs.  Both are single
+	  threaded, like the layers, and the FLOP probe gets whatever
+	  vector instructions this build's compiler flags allow,
+	  which is the ceiling our kernels actually have.
+
+	  report() combines that with a profiler_t's numbers: each
+	  layer's FLOPs, bytes, intensity, the throughput it actually
+	  got, and how close that is to its roof.
+	*/
+	double peak_gflops;
+	double peak_gbytes; // Per second.
+
+	roofline_t(double peak_gflops, double peak_gbytes)
+		: peak_gflops(peak_gflops), peak_gbytes(peak_gbytes) {}
+
+	static roofline_t measure() {
+		return roofline_t(measure_peak_gflops(), measure_bandwidth());
+	}
+
+	double ridge() const {
+		return peak_gflops / peak_gbytes;
+	}
+
+	// The best GFLOP/s a kernel with `intensity` (flops/byte) can get.
+	double attainable(double intensity) const {
+		return std::min(peak_gflops, intensity * peak_gbytes);
+	}
+
+	// GB/s for a[i] = b[i] + s * c[i], best of `reps`.  Like
+	// STREAM, we count 24 bytes per element and don't count the
+	// write-allocate traffic for `a`.
+	static double measure_bandwidth(size_t elements = 1 << 23, int reps = 5) {
+		std::vector<double> a(elements, 0.0), b(elements, 1.0), c(elements, 2.0);
+		const double s = 3.0;
+		double best = 0;
+		for (int r = 0; r < reps; r++) {
+			auto start = std::chrono::steady_clock::now();
+			double * pa = a.data();
+			const double * pb = b.data();
+			const double * pc = c.data();
+			for (size_t i = 0; i < elements; i++) {
+				pa[i] = pb[i] + s * pc[i];
+			}
+			double t = seconds_since(start);
+			best = std::max(best, 24.0 * elements / t / 1e9);
+		}
+		sink(a[elements / 2]);
+		return best;
+	}
+
+	// GFLOP/s for many independent x = x * m + a chains, best of
+	// `reps`.  The chains are independent so the multiply-add
+	// latency doesn't limit us, only throughput.
+	static double measure_peak_gflops(long iterations = 1 << 22, int reps = 3) {
+		const int lanes = 32;
+		double x[lanes];
+		const double m = 0.9999999, a = 1e-7;
+		double best = 0;
+		for (int r = 0; r < reps; r++) {
+			for (int j = 0; j < lanes; j++) {
+				x[j] = j;
+			}
+			auto start = std::chrono::steady_clock::now();
+			for (long it = 0; it < iterations; it++) {
+				for (int j = 0; j < lanes; j++) {
+					x[j] = x[j] * m + a;
+				}
+			}
+			double t = seconds_since(start);
+			best = std::max(best, 2.0 * lanes * iterations / t / 1e9);
+			double sum = 0;
+			for (int j = 0; j < lanes; j++) {
+				sum += x[j];
+			}
+			sink(sum);
+		}
+		return best;
+	}
+
+	// One row per layer and phase that ran.
+	std::string report(const profiler_t & profiler) const {
+		std::stringstream ss;
+		ss << std::setprecision(3);
+		ss << "Roofline: peak " << peak_gflops << " GFLOP/s, " << peak_gbytes << " GB/s, ridge "
+		   << ridge() << " flop/B\n";
+		for (uint l = 0; l < profiler.layers.size(); l++) {
+			for (int p = 0; p < layer_phase_count; p++) {
+				const profiler_t::phase_stats_t & s = profiler.layers[l].phases[p];
+				const layer_cost_t::work_t & w = profiler.layers[l].cost.phases[p];
+				if (s.calls == 0 || w.bytes == 0) {
+					continue;
+				}
+				double intensity = w.flops / w.bytes;
+				double achieved = s.seconds > 0 ? profiler.flops(l, p) / s.seconds / 1e9 : 0;
+				double roof = attainable(intensity);
+				ss << "layer[" << l << "] " << profiler_t::phase_name(p)
+				   << ": " << w.flops / 1e6 << " MFLOP, " << w.bytes / 1e6 << " MB per call, "
+				   << intensity << " flop/B, " << achieved << " GFLOP/s of " << roof
+				   << " (" << (roof > 0 ? achieved / roof * 100 : 0) << "%), "
+				   << (bound(intensity)) << "-bound : " << profiler.layers[l].spec << "\n";
+			}
+		}
+		return ss.str();
+	}
+
+	const char * bound(double intensity) const {
+		return intensity < ridge() ? "bandwidth" : "compute";
+	}
+
+private:
+	static double seconds_since(std::chrono::steady_clock::time_point start) {
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	// Keep the compiler from throwing away the probes' work.
+	static void sink(double v) {
+		sunk() = v;
+	}
+
+	static volatile double & sunk() {
+		static volatile double s = 0;
+		return s;
+	}
+};
+
+#ifdef INCLUDE_TESTS
+namespace CNNTest {
+
+	TEST_F(CNNTest, roofline) {
+		double bw = roofline_t::measure_bandwidth(1 << 16, 2);
+		double flops = roofline_t::measure_peak_gflops(1 << 12, 2);
+		EXPECT_GT(bw, 0);
+		EXPECT_GT(flops, 0);
+
+		roofline_t machine(10, 5);
+		EXPECT_EQ(machine.ridge(), 2);
+		EXPECT_EQ(machine.attainable(1), 5);
+		EXPECT_EQ(machine.attainable(4), 10);
+		EXPECT_STREQ(machine.bound(1), "bandwidth");
+		EXPECT_STREQ(machine.bound(4), "compute");
+
+		// A big conv has lots of reuse; relu has none.
+		conv_layer_t conv( 1, 5, 32, 0, tdsize(28,28,16,1) );
+		relu_layer_t relu( conv.out.size );
+		layer_cost_t c = conv.cost();
+		layer_cost_t r = relu.cost();
+		EXPECT_GT(c[layer_phase::activate].flops / c[layer_phase::activate].bytes, machine.ridge());
+		EXPECT_LT(r[layer_phase::activate].flops / r[layer_phase::activate].bytes, machine.ridge());
+
+		profiler_t profiler;
+		profiler.attach({&conv, &relu});
+		profiler.record(0, layer_phase::activate, 0.01);
+		profiler.record(1, layer_phase::activate, 0.01);
+		std::string report = machine.report(profiler);
+		EXPECT_NE(report.find("layer[0] activate"), std::string::npos);
+		EXPECT_NE(report.find("compute-bound : conv_layer_t"), std::string::npos);
+		EXPECT_NE(report.find("bandwidth-bound : relu_layer_t"), std::string::npos);
+		EXPECT_EQ(report.find("calc_grads"), std::string::npos);
+	}
+}
+#endif
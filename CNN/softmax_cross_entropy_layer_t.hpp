@@ -0,0 +1,104 @@
+#pragma once
+#include "softmax_layer_t.hpp"
+
+class softmax_cross_entropy_layer_t : public softmax_layer_t
+{
+public:
+	/*
+	  softmax_cross_entropy_layer_t is softmax followed by the
+	  cross-entropy loss.  It belongs at the end of a model.
+
+	  Back propagating through softmax on its own means
+	  multiplying by its Jacobian.  But the gradient of
+	  cross-entropy through softmax, with respect to the logits
+	  (this layer's input), collapses to
+
+	    p - y
+
+	  for each sample (p is our output, y is the label; in
+	  general it's p*sum(y) - y, which is the same thing when
+	  each label sums to 1).  So loss_gradient() returns that,
+	  and calc_grads() passes it straight through.
+	*/
+
+	softmax_cross_entropy_layer_t(const tdsize & in_size )
+		:
+		softmax_layer_t(in_size)
+	{
+	}
+
+	layer_t * replicate() const {
+		return new softmax_cross_entropy_layer_t(*this);
+	}
+
+	std::string kind_str() const {
+		return "softmax_cross_entropy";
+	}
+
+	// calc_grads() is just a copy.
+	layer_cost_t cost() const {
+		layer_cost_t c = softmax_layer_t::cost();
+		c[layer_phase::calc_grads] = {0, 8 * 2.0 * in.element_count()};
+		return c;
+	}
+
+	using layer_t::loss_gradient;
+
+	void loss_gradient(const tensor_t<double>& expected, tensor_t<double>& grads) const {
+		throw_assert(expected.size == out.size, "Expected output has the wrong size. Expected: " << out.size << " Got: " << expected.size);
+		throw_assert(grads.size == out.size, "Mismatched sizes in loss_gradient");
+		size_t n = sample_size();
+		for ( int b = 0; b < out.size.b; b++ ) {
+			const double * p = &out.data[b * n];
+			const double * y = &expected.data[b * n];
+			double * d = &grads.data[b * n];
+			double y_sum = 0;
+			for ( size_t i = 0; i < n; i++ ) {
+				y_sum += y[i];
+			}
+			for ( size_t i = 0; i < n; i++ ) {
+				d[i] = p[i] * y_sum - y[i];
+			}
+		}
+	}
+
+	// The cross-entropy, summed over the batch.
+	double loss(const tensor_t<double>& expected) const {
+		double l = 0;
+		for ( size_t i = 0; i < out.element_count(); i++ ) {
+			if (expected.data[i] != 0) {
+				l -= expected.data[i] * log(std::max(out.data[i], std::numeric_limits<double>::min()));
+			}
+		}
+		return l;
+	}
+
+	void calc_grads(const tensor_t<double>& grad_next_layer )
+	{
+		throw_assert(grad_next_layer.size == in.size, "mismatched input");
+		memcpy(grads_out.data, grad_next_layer.data, grad_next_layer.calculate_data_size());
+	}
+};
+
+
+#ifdef INCLUDE_TESTS
+namespace CNNTest{
+
+	TEST_F(CNNTest, softmax_cross_entropy) {
+		srand(42);
+		tensor_t<double> data(4,1,1,2);
+		randomize(data);
+		tensor_t<double> label(4,1,1,2);
+		label(1,0,0,0) = 1;
+		label(3,0,0,1) = 1;
+
+		softmax_cross_entropy_layer_t layer(data.size);
+		layer.activate(data);
+		auto g = layer.loss_gradient(label);
+		EXPECT_EQ(g, layer.out - label);
+		layer.calc_grads(g);
+		EXPECT_EQ(layer.grads_out, layer.out - label);
+		EXPECT_NEAR(layer.loss(label), -log(layer.out(1,0,0,0)) - log(layer.out(3,0,0,1)), 1e-12);
+	}
+}
+#endif
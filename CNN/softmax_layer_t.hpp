@@ -10,9 +10,23 @@ public:
 	{
 	}
 
+	layer_t * replicate() const {
+		return new softmax_layer_t(*this);
+	}
+
 	std::string kind_str() const {
 		return "softmax";
 	}
+
+	// Max, exp, sum, and scale on the way forward; a dot product
+	// and an update per element on the way back.
+	layer_cost_t cost() const {
+		const double n = in.element_count();
+		layer_cost_t c;
+		c[layer_phase::activate] = {4 * n, 8 * 2 * n};
+		c[layer_phase::calc_grads] = {4 * n, 8 * 3 * n};
+		return c;
+	}
 	std::string param_str() const {
 		std::stringstream ss;
 		return ss.str();
@@ -26,14 +40,35 @@ public:
 		return !(*this == o);
 	}
 	
-	void activate(tensor_t<double>& in ) {
-		copy_input(in);
+	// Each batch element is a separate distribution, stored in
+	// `n` consecutive doubles.
+	size_t sample_size() const {
+		return in.size.x * in.size.y * in.size.z;
+	}
+
+	// Subtracting the max before exp() keeps large inputs from
+	// overflowing.  It cancels out in the division.
+	static void softmax(const double * x, double * p, size_t n) {
+		double m = x[0];
+		for ( size_t i = 1; i < n; i++ ) {
+			m = x[i] > m ? x[i] : m;
+		}
 		double s = 0;
-		TENSOR_FOR(in, x,y,z,b) {
-			s += exp(in(x,y,z,b));
+		for ( size_t i = 0; i < n; i++ ) {
+			p[i] = exp(x[i] - m);
+			s += p[i];
+		}
+		double inv = 1.0 / s;
+		for ( size_t i = 0; i < n; i++ ) {
+			p[i] *= inv;
 		}
-		TENSOR_FOR(in, x,y,z,b) {
-			out(x,y,z,b) = exp(in(x,y,z,b))/s;
+	}
+
+	void activate(tensor_t<double>& in ) {
+		bind_input(in);
+		size_t n = sample_size();
+		for ( int b = 0; b < in.size.b; b++ ) {
+			softmax(&in.data[b * n], &out.data[b * n], n);
 		}
 	}
 
@@ -42,14 +77,27 @@ public:
 
 	}
 
+	// The Jacobian of softmax is J(i,j) = p(i) * (k(i,j) - p(j)),
+	// where k is the Kronecker delta, so multiplying it by the
+	// gradient, g, gives
+	//
+	//   grads_out(i) = p(i) * (g(i) - sum_j(p(j) * g(j)))
+	//
+	// which is O(n) per sample instead of O(n^2).
 	void calc_grads(const tensor_t<double>& grad_next_layer )
 	{
 		throw_assert(grad_next_layer.size == in.size, "mismatched input");
-		TENSOR_FOR(in, ix,iy,iz,ib) {
-			grads_out(ix,iy,iz,ib) = 0;
-			TENSOR_FOR(in, jx,jy,jz,jb) {
-				double k = ix==jx && iy == jy && iz == jz && ib == jb ? 1.0 : 0.0;
-				grads_out(ix,iy,iz,ib) += out(ix,iy,iz,ib)*(k - out(jx,jy,jz,jb))*grad_next_layer(ix,iy,iz,ib);
+		size_t n = sample_size();
+		for ( int b = 0; b < in.size.b; b++ ) {
+			const double * p = &out.data[b * n];
+			const double * g = &grad_next_layer.data[b * n];
+			double * d = &grads_out.data[b * n];
+			double dot = 0;
+			for ( size_t i = 0; i < n; i++ ) {
+				dot += p[i] * g[i];
+			}
+			for ( size_t i = 0; i < n; i++ ) {
+				d[i] = p[i] * (g[i] - dot);
 			}
 		}
 	}
@@ -77,6 +125,39 @@ namespace CNNTest{
 		layer.calc_grads(next_grads);
 	}
 
+	TEST_F(CNNTest, softmax_batched) {
+		srand(42);
+		tensor_t<double> data(5,2,1,3);
+		randomize(data);
+		data(0,0,0,2) = 1000; // would overflow exp() without the max trick.
+
+		softmax_layer_t layer(data.size);
+		layer.activate(data);
+		for (int b = 0; b < data.size.b; b++) {
+			double s = 0;
+			TDSIZE_FOR(tdsize(5,2,1,1), x,y,z,_) s += layer.out(x,y,z,b);
+			EXPECT_FLOAT_EQ(s, 1.0);
+		}
+		EXPECT_FLOAT_EQ(layer.out(0,0,0,2), 1.0);
+
+		// Compare against multiplying by the full Jacobian.
+		tensor_t<double> next_grads(data.size);
+		randomize(next_grads);
+		layer.calc_grads(next_grads);
+		size_t n = layer.sample_size();
+		for (int b = 0; b < data.size.b; b++) {
+			for (size_t i = 0; i < n; i++) {
+				double expected = 0;
+				for (size_t j = 0; j < n; j++) {
+					double p_i = layer.out.data[b*n + i];
+					double p_j = layer.out.data[b*n + j];
+					expected += p_j * ((i == j ? 1.0 : 0.0) - p_i) * next_grads.data[b*n + j];
+				}
+				EXPECT_NEAR(layer.grads_out.data[b*n + i], expected, 1e-12);
+			}
+		}
+	}
+
 	
 }  // namespace
 #endif
@@ -0,0 +1,118 @@
+#pragma once
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "tensor_t.hpp"
+
+class spsc_queue_t
+{
+public:
+	/*
+	  spsc_queue_t is a fixed-size ring of tensors passed from
+	  exactly one producer thread to exactly one consumer thread
+	  without locks.  The slots are allocated up front, so nothing
+	  is allocated or copied by the queue itself: the producer
+	  fills the slot that reserve() returns and then publish()es
+	  it, and the consumer reads front() and then pop()s it, which
+	  hands the slot back to the producer.
+
+	  `head` (next slot to read) is only written by the consumer
+	  and `tail` (next slot to write) only by the producer, so a
+	  release store on one side and an acquire load on the other
+	  is all the synchronization we need.  They live on separate
+	  cache lines so the two threads don't fight over one line.
+
+	  When the queue is full (or empty), reserve() (or front())
+	  spins, yielding the CPU between checks.
+	*/
+
+	spsc_queue_t(const tdsize & size, int capacity)
+		:
+		head(0),
+		tail(0)
+	{
+		throw_assert(capacity > 0, "Queue capacity must be positive.");
+		for (int i = 0; i < capacity; i++) {
+			slots.emplace_back(size);
+		}
+	}
+
+	int capacity() const {
+		return slots.size();
+	}
+
+	// Producer side.
+	tensor_t<double> & reserve() {
+		size_t t = tail.load(std::memory_order_relaxed);
+		while (t - head.load(std::memory_order_acquire) == slots.size()) {
+			std::this_thread::yield();
+		}
+		return slots[t % slots.size()];
+	}
+
+	void publish() {
+		tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+
+	// Consumer side.
+	tensor_t<double> & front() {
+		size_t h = head.load(std::memory_order_relaxed);
+		while (tail.load(std::memory_order_acquire) == h) {
+			std::this_thread::yield();
+		}
+		return slots[h % slots.size()];
+	}
+
+	void pop() {
+		head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+
+	// Would reserve() (or front()) have to wait right now?
+	bool full() const {
+		return tail.load(std::memory_order_relaxed) - head.load(std::memory_order_acquire) == slots.size();
+	}
+
+	bool empty() const {
+		return tail.load(std::memory_order_acquire) == head.load(std::memory_order_relaxed);
+	}
+
+private:
+	std::vector<tensor_t<double>> slots;
+	// Padding instead of alignas(64), which `new` ignores before
+	// C++17.  Either way, head and tail are 64 bytes apart.
+	std::atomic<size_t> head;
+	char head_pad[64 - sizeof(std::atomic<size_t>)];
+	std::atomic<size_t> tail;
+	char tail_pad[64 - sizeof(std::atomic<size_t>)];
+};
+
+#ifdef INCLUDE_TESTS
+namespace CNNTest {
+
+	TEST_F(CNNTest, spsc_queue) {
+		spsc_queue_t q(tdsize(4,1,1,1), 3);
+		EXPECT_TRUE(q.empty());
+		const int n = 10000;
+		std::thread producer([&]() {
+				for (int i = 0; i < n; i++) {
+					tensor_t<double> & t = q.reserve();
+					for (int x = 0; x < 4; x++) {
+						t(x,0,0) = i + x;
+					}
+					q.publish();
+				}
+			});
+		bool in_order = true;
+		for (int i = 0; i < n; i++) {
+			tensor_t<double> & t = q.front();
+			for (int x = 0; x < 4; x++) {
+				in_order &= t(x,0,0) == i + x;
+			}
+			q.pop();
+		}
+		producer.join();
+		EXPECT_TRUE(in_order);
+		EXPECT_TRUE(q.empty());
+	}
+}
+#endif
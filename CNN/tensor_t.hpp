@@ -1,5 +1,6 @@
 #pragma once
 #include "types.hpp"
+#include "access_trace_t.hpp"
 #include <vector>
 #include <string.h>
 #include <cmath>
@@ -67,13 +68,26 @@ struct tensor_t
 	bool delete_memory;
 	
 	T & as_vector(size_t i) {
+		trace_access(&data[i], true);
 		return data[i];
 	}
 
 	const  T & as_vector(size_t i) const {
+		trace_access(&data[i], false);
 		return data[i];
 	}
 
+	// In -DTRACE_TENSOR_ACCESSES builds, tell access_trace_t about
+	// an access.  Otherwise, nothing.
+	inline void trace_access(const T * element, bool write) const {
+#ifdef TRACE_TENSOR_ACCESSES
+		access_trace_t::record(this, element, sizeof(T), write);
+#else
+		(void)element;
+		(void)write;
+#endif
+	}
+
 	size_t element_count() const {
 		return size.x * size.y * size.z * size.b;
 	}
@@ -81,11 +95,64 @@ struct tensor_t
 	void resize(tdsize new_size) {
 		throw_assert(size.x > 0 && size.y > 0 && size.z > 0,  "Tensor resize with non-positive dimensions");
 		size = new_size;
-		delete[] data;
+		if (delete_memory) {
+			delete[] data;
+		}
                 if (size.b == 0) {
                         size.b = 1;
                 }
                 data = new T[size.x * size.y * size.z * size.b]();
+		delete_memory = true;
+	}
+
+	// Make this tensor a view of `other`'s memory instead of a
+	// copy of it.  A view doesn't own its data, so `other` must
+	// outlive it (or until the view is pointed somewhere else).
+	void view(const tensor_t<T> & other) {
+		if (delete_memory && data != other.data) {
+			delete[] data;
+		}
+		data = other.data;
+		size = other.size;
+		delete_memory = false;
+	}
+
+	// Make this tensor a view of raw memory someone else manages.
+	void view(T * data, const tdsize & size) {
+		if (delete_memory && this->data != data) {
+			delete[] this->data;
+		}
+		this->data = data;
+		this->size = size;
+		delete_memory = false;
+	}
+
+	bool is_view() const {
+		return !delete_memory;
+	}
+
+	// Free our memory but keep our size, for tensors that are no
+	// longer needed (see layer_t::freeze()).  A released tensor
+	// has no data, and neither do copies of it.
+	void release() {
+		if (delete_memory) {
+			delete[] data;
+		}
+		data = nullptr;
+		delete_memory = false;
+	}
+
+	bool is_released() const {
+		return data == nullptr;
+	}
+
+	// A released tensor of size `size` that never had any memory,
+	// for data that view() will supply later.
+	static tensor_t<T> released(const tdsize & size) {
+		T placeholder;
+		tensor_t<T> t(size.x, size.y, size.z, size.b ? size.b : 1, &placeholder);
+		t.release();
+		return t;
 	}
 
 	inline void assert1D() const {
@@ -130,24 +197,28 @@ struct tensor_t
 		throw_assert_debug( _x >= 0 && _y >= 0 && _z >= 0 && _b >= 0, "Tried to read tensor at negative coordinates" );
 		throw_assert_debug( _x < size.x && _y < size.y && _z < size.z && _b < size.b, "Tried to read tensor out of bounds " << tdsize(_x, _y, _z, _b) << ". But tensor is " << size );
 		
-		return data[
+		T & e = data[
 			_b * (size.x * size.y * size.z) +
 			_z * (size.x * size.y) +
 			_y * (size.x) +
 			_x
 			];
+		trace_access(&e, true);
+		return e;
 	}
 
 	const T & get( int _x, int _y, int _z, int _b=0 ) const {
 		throw_assert_debug( _x >= 0 && _y >= 0 && _z >= 0 && _b >= 0, "Tried to read tensor at negative coordinates" );
 		throw_assert_debug( _x < size.x && _y < size.y && _z < size.z && _b < size.b, "Tried to read tensor out of bounds " << tdsize(_x, _y, _z, _b) << ". But tensor is " << size );
 		
-		return data[
+		const T & e = data[
 			_b * (size.x * size.y * size.z) +
 			_z * (size.x * size.y) +
 			_y * (size.x) +
 			_x
 			];
+		trace_access(&e, false);
+		return e;
 	}
 
 	
@@ -180,6 +251,11 @@ struct tensor_t
 
 	tensor_t( const tensor_t& other ) : size(other.size), delete_memory(true)
 	{
+		if (other.is_released()) {
+			data = nullptr;
+			delete_memory = false;
+			return;
+		}
 		data = new T[size.x * size.y * size.z * size.b];
 		memcpy(
 			data,
@@ -188,7 +264,7 @@ struct tensor_t
 		);
 	}
 
-	tensor_t( tensor_t&& other ) : size(other.size), data(other.data)
+	tensor_t( tensor_t&& other ) : size(other.size), data(other.data), delete_memory(other.delete_memory)
 	{
 		other.data = nullptr;
 	}
@@ -201,15 +277,24 @@ struct tensor_t
 	}
 
 	
+	// Views don't count, since the memory belongs to someone else.
 	size_t get_total_memory_size() const {
-		return calculate_data_size();
+		return delete_memory ? calculate_data_size() : 0;
 	}
 	
 	tensor_t<T> & operator=(const tensor_t& other )
 	{
 		if (&other != this) {
-			delete[] data;
+			if (delete_memory) {
+				delete[] data;
+			}
 			size = other.size;
+			if (other.is_released()) {
+				data = nullptr;
+				delete_memory = false;
+				return *this;
+			}
+			delete_memory = true;
 			data = new T[other.size.x * other.size.y * other.size.z * other.size.b];
 			memcpy(
 				this->data,
@@ -222,9 +307,12 @@ struct tensor_t
 	
 	tensor_t<T> & operator=(tensor_t<T>&& other) {
 		if (&other != this) {
-			delete [] data;
+			if (delete_memory) {
+				delete [] data;
+			}
 			data = other.data;
 			size = other.size;
+			delete_memory = other.delete_memory;
 			other.data = nullptr;
 		}
 		return *this;
@@ -680,6 +768,26 @@ namespace CNNTest {
 		
 	}
 	
+	TEST_F(CNNTest, tensor_view) {
+		tensor_t<double> t1(3,4,5);
+		tensor_t<double> v(1,1,1);
+		v.view(t1);
+		EXPECT_TRUE(v.is_view());
+		EXPECT_EQ(v.size, t1.size);
+		t1(1,2,3) = 7;
+		EXPECT_EQ(v(1,2,3), 7);
+		EXPECT_EQ(v.get_total_memory_size(), 0u);
+
+		tensor_t<double> c(v); // copies always get their own memory.
+		EXPECT_FALSE(c.is_view());
+		EXPECT_NE(c.data, t1.data);
+		EXPECT_EQ(c, t1);
+
+		tensor_t<double> m(std::move(v));
+		EXPECT_TRUE(m.is_view());
+		EXPECT_EQ(m.data, t1.data);
+	}
+
 	TEST_F(CNNTest, tensor_gradient) {
 		tdsize s(2,2,3);
 		tensor_t<gradient_t> t1(s);
@@ -0,0 +1,236 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fstream>
+#include "throw_assert.hpp"
+
+class tracer_t
+{
+public:
+	/*
+	  tracer_t records a timeline of what each thread was doing,
+	  for viewing in chrome://tracing or Perfetto (json() writes
+	  the Chrome trace-event format).  Where profiler_t adds
+	  everything up, this keeps every span, so you can see
+	  overlap, stalls, and stragglers in multi-threaded runs.
+
+	  Spans are recorded with span_t (or by profiler_t::scope_t,
+	  which model_t already uses around every layer phase and
+	  training step).  model_t, dataset_t, the trainers, and
+	  pipeline_t add spans for batches, data loading, weight
+	  updates, and waiting.
+
+	  Tracing is off until enable(true).  When it's off, a span
+	  costs one relaxed atomic load.  When it's on, each thread
+	  writes into its own fixed-size ring buffer (no locks, no
+	  allocation), and once a ring fills up, new spans overwrite
+	  the oldest ones.  Turn tracing off before calling json(),
+	  since it reads the other threads' rings.
+
+	  Span names and categories must be string literals (or
+	  otherwise outlive the tracer); we only keep the pointers.
+	*/
+	struct event_t {
+		const char * name;
+		const char * category;
+		int arg;          // E.g., a layer index; -1 for none.
+		int64_t start_ns; // Since the tracer started.
+		int64_t duration_ns;
+	};
+
+	static void enable(bool on) {
+		registry().on.store(on, std::memory_order_relaxed);
+	}
+
+	static bool enabled() {
+		return registry().on.load(std::memory_order_relaxed);
+	}
+
+	// Drop everything recorded so far, and give every thread's
+	// ring `capacity` events from now on.
+	static void clear(size_t capacity = default_capacity) {
+		registry_t & r = registry();
+		std::lock_guard<std::mutex> lock(r.mutex);
+		r.capacity = capacity;
+		for (auto & ring: r.rings) {
+			ring->events = std::vector<event_t>();
+			ring->next = 0;
+		}
+	}
+
+	// Label the calling thread in the trace.
+	static void name_thread(const std::string & name) {
+		ring().name = name;
+	}
+
+	static void record(const char * name, const char * category, int arg,
+			   std::chrono::steady_clock::time_point start,
+			   std::chrono::steady_clock::time_point end) {
+		ring_t & r = ring();
+		if (r.events.empty()) {
+			r.events.resize(registry().capacity);
+		}
+		event_t & e = r.events[r.next++ % r.events.size()];
+		e.name = name;
+		e.category = category;
+		e.arg = arg;
+		e.start_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(start - registry().epoch).count();
+		e.duration_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+	}
+
+	// Records the enclosing block, if tracing is on when it starts.
+	class span_t {
+	public:
+		span_t(const char * name, const char * category, int arg = -1)
+			: name(name), category(category), arg(arg), tracing(enabled())
+		{
+			if (tracing) {
+				start = std::chrono::steady_clock::now();
+			}
+		}
+
+		~span_t() {
+			if (tracing) {
+				record(name, category, arg, start, std::chrono::steady_clock::now());
+			}
+		}
+
+	private:
+		const char * name;
+		const char * category;
+		int arg;
+		bool tracing;
+		std::chrono::steady_clock::time_point start;
+	};
+
+	// Every thread's spans, oldest first, in trace-event JSON.
+	static std::string json() {
+		registry_t & r = registry();
+		std::lock_guard<std::mutex> lock(r.mutex);
+		std::stringstream ss;
+		ss << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+		bool first = true;
+		for (auto & ring: r.rings) {
+			if (!ring->name.empty()) {
+				ss << (first ? "" : ",\n") << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 0, \"tid\": " << ring->tid
+				   << ", \"args\": {\"name\": \"" << ring->name << "\"}}";
+				first = false;
+			}
+			size_t n = ring->events.size();
+			uint64_t begin = ring->next > n ? ring->next - n : 0;
+			for (uint64_t i = begin; i < ring->next; i++) {
+				const event_t & e = ring->events[i % n];
+				ss << (first ? "" : ",\n") << "{\"name\": \"" << e.name << "\", \"cat\": \"" << e.category
+				   << "\", \"ph\": \"X\", \"pid\": 0, \"tid\": " << ring->tid
+				   << ", \"ts\": " << e.start_ns / 1000.0 << ", \"dur\": " << e.duration_ns / 1000.0;
+				if (e.arg >= 0) {
+					ss << ", \"args\": {\"index\": " << e.arg << "}";
+				}
+				ss << "}";
+				first = false;
+			}
+		}
+		ss << "\n]}\n";
+		return ss.str();
+	}
+
+	static void write(const std::string & filename) {
+		std::ofstream out(filename);
+		throw_assert(out.good(), "Couldn't open " << filename << " for the trace.");
+		out << json();
+	}
+
+	// How many spans we're holding, over all threads.
+	static size_t size() {
+		registry_t & r = registry();
+		std::lock_guard<std::mutex> lock(r.mutex);
+		size_t n = 0;
+		for (auto & ring: r.rings) {
+			n += std::min<uint64_t>(ring->next, ring->events.size());
+		}
+		return n;
+	}
+
+	static const size_t default_capacity = 1 << 16;
+
+private:
+	// `events` is allocated on the first span, so threads that
+	// never record don't pay for it.
+	struct ring_t {
+		int tid;
+		std::string name;
+		std::vector<event_t> events;
+		uint64_t next = 0;
+	};
+
+	// The rings outlive their threads, so nothing is lost when
+	// a thread exits.
+	struct registry_t {
+		std::mutex mutex;
+		std::vector<std::unique_ptr<ring_t>> rings;
+		std::atomic<bool> on{false};
+		size_t capacity = default_capacity;
+		const std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+	};
+
+	static registry_t & registry() {
+		static registry_t r;
+		return r;
+	}
+
+	static ring_t & ring() {
+		thread_local ring_t * mine = nullptr;
+		if (!mine) {
+			registry_t & r = registry();
+			std::lock_guard<std::mutex> lock(r.mutex);
+			r.rings.emplace_back(new ring_t);
+			mine = r.rings.back().get();
+			mine->tid = r.rings.size() - 1;
+		}
+		return *mine;
+	}
+};
+
+#ifdef INCLUDE_TESTS
+namespace CNNTest {
+
+	TEST_F(CNNTest, tracer) {
+		tracer_t::clear(4);
+		{
+			tracer_t::span_t s("off", "test");
+		}
+		EXPECT_EQ(tracer_t::size(), 0u);
+
+		tracer_t::enable(true);
+		tracer_t::name_thread("main");
+		for (int i = 0; i < 6; i++) {
+			tracer_t::span_t s("span", "test", i);
+		}
+		std::thread other([]() {
+				tracer_t::name_thread("other");
+				tracer_t::span_t s("other span", "test");
+			});
+		other.join();
+		tracer_t::enable(false);
+
+		// The main thread's ring only keeps the last four.
+		EXPECT_EQ(tracer_t::size(), 5u);
+		std::string json = tracer_t::json();
+		EXPECT_EQ(json.find("\"index\": 1}"), std::string::npos);
+		EXPECT_NE(json.find("\"index\": 2}"), std::string::npos);
+		EXPECT_NE(json.find("\"index\": 5}"), std::string::npos);
+		EXPECT_NE(json.find("\"name\": \"other span\""), std::string::npos);
+		EXPECT_NE(json.find("{\"name\": \"other\"}"), std::string::npos);
+		EXPECT_EQ(json.find("\"off\""), std::string::npos);
+
+		tracer_t::clear();
+		EXPECT_EQ(tracer_t::size(), 0u);
+	}
+}
+#endif
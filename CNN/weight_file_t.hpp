@@ -0,0 +1,565 @@
+#pragma once
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "model_t.hpp"
+
+class weight_file_t
+{
+public:
+	/*
+	  weight_file_t saves a model's trained weights and loads them
+	  back into a model with the same layers.
+
+	  The file starts with a header that lists each layer's
+	  spec_str(), input and output sizes, whether it's frozen, and
+	  where its parameter tensors (layer_t::parameter_tensors())
+	  are.  The tensors follow, each starting on a page boundary.
+
+	  load() maps the file into memory instead of reading it, and
+	  the model's parameter tensors become views of the mapping,
+	  so loading costs about the same whatever the model's size,
+	  and processes that load the same file share its pages in
+	  the page cache.  The mapping is private: training a loaded
+	  model copies the pages it changes and leaves the file
+	  alone.  The model keeps the mapping (see
+	  model_t::mapped_weights) for as long as it's around.
+	  load(..., load_mode::copied) copies the weights instead.
+
+	  For several inference processes on one host, there's
+	  load_mode::shared: the mapping is shared and read-only, so
+	  every process's layers point at the same physical pages,
+	  and weight memory doesn't grow with the number of
+	  processes.  Only frozen models can load that way, since
+	  nothing else leaves the weights alone.  save_shared() and
+	  load_shared() do the same with a named POSIX shared memory
+	  segment instead of a file, for when there's no file to
+	  share (e.g., weights that arrive over the network).  The
+	  segment stays until unlink_shared().
+
+	  Saving never changes a file or segment that someone might
+	  have mapped.  save() writes a new file and renames it over
+	  the old one, so running models keep the old weights until
+	  they load again.  save_shared() won't replace an existing
+	  segment; unlink_shared() it first (models that loaded it
+	  keep their mappings).
+
+	  Only the weights are saved, not the optimizer's momentum,
+	  so training a loaded model starts that over.  A frozen
+	  model saves its packed weights, which only load into a
+	  model that's frozen too.  To go the other way, load into an
+	  unfrozen model and freeze() it.
+
+	  Build the model to load into inside a
+	  layer_t::unloaded_parameters_t, and its layers won't fill
+	  weights with rand() just so load() can replace them, and a
+	  mapped load never allocates the weights at all.  Most of
+	  what's left of building is allocating the gradients, which
+	  freeze() drops.
+	*/
+	// Before C++17, binding this to a reference needs an
+	// out-of-line definition, which a header can't have, so pass
+	// copies (uint32_t(version)).
+	static constexpr uint32_t version = 1;
+	static constexpr uint64_t alignment = 4096;
+
+	enum class load_mode {
+		mapped, // Private, copy-on-write mapping.
+		copied, // Copy into the model's own tensors.
+		shared  // Shared, read-only mapping (frozen models only).
+	};
+
+	static void save(const model_t & model, const std::string & filename) {
+		// Same directory, so rename() can't cross file systems.
+		std::string temp = filename + ".XXXXXX";
+		int fd = mkstemp(&temp[0]);
+		throw_assert(fd >= 0, "Couldn't create a temporary file next to " << filename << ": " << strerror(errno));
+		bool ok = fchmod(fd, 0644) == 0 && write_fd(model, fd);
+		ok = close(fd) == 0 && ok;
+		ok = ok && rename(temp.c_str(), filename.c_str()) == 0;
+		int error = errno;
+		if (!ok) {
+			unlink(temp.c_str());
+		}
+		throw_assert(ok, "Couldn't write " << filename << ": " << strerror(error));
+	}
+
+	// Load the weights in `filename` into `model`, which must have
+	// the same layers (as in spec_str() and sizes, apart from the
+	// batch size).
+	static void load(model_t & model, const std::string & filename, load_mode mode = load_mode::mapped) {
+		int fd = open(filename.c_str(), O_RDONLY);
+		throw_assert(fd >= 0, "Couldn't open " << filename << ": " << strerror(errno));
+		load_fd(model, fd, filename, mode);
+	}
+
+	// Save into a new shared memory segment `name` (e.g.,
+	// "/mnist-weights").
+	static void save_shared(const model_t & model, const std::string & name) {
+		int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+		throw_assert(fd >= 0 || errno != EEXIST, "Shared memory " << name << " already exists; unlink_shared() it first.");
+		throw_assert(fd >= 0, "Couldn't create shared memory " << name << ": " << strerror(errno));
+		bool ok = write_fd(model, fd);
+		int error = errno;
+		close(fd);
+		if (!ok) {
+			shm_unlink(name.c_str());
+		}
+		throw_assert(ok, "Couldn't write " << name << ": " << strerror(error));
+	}
+
+	// Point the frozen `model`'s weights at the shared memory
+	// segment `name`, read-only.
+	static void load_shared(model_t & model, const std::string & name) {
+		int fd = shm_open(name.c_str(), O_RDONLY, 0);
+		throw_assert(fd >= 0, "Couldn't open shared memory " << name << ": " << strerror(errno));
+		load_fd(model, fd, name, load_mode::shared);
+	}
+
+	// Remove the segment `name`.  Models that loaded it keep their
+	// mappings.
+	static void unlink_shared(const std::string & name) {
+		shm_unlink(name.c_str());
+	}
+
+private:
+	static bool write_fd(const model_t & model, int fd) {
+		// The header's size doesn't depend on where the tensors
+		// start, so build it once to find out.
+		std::vector<const tensor_t<double>*> blobs;
+		std::string header = build_header(model, 0, blobs);
+		blobs.clear();
+		header = build_header(model, round_up(header.size()), blobs);
+
+		bool ok = write_all(fd, header.data(), header.size());
+		uint64_t position = header.size();
+		for (auto t: blobs) {
+			ok = ok && pad(fd, position, round_up(position));
+			ok = ok && write_all(fd, t->data, t->calculate_data_size());
+			position += t->calculate_data_size();
+		}
+		return ok && pad(fd, position, round_up(position));
+	}
+
+	static void load_fd(model_t & model, int fd, const std::string & filename, load_mode mode) {
+		const bool shared = mode == load_mode::shared;
+		if (shared) {
+			throw_assert(model.frozen, "Only frozen models can share read-only weights; freeze() it first.");
+		}
+		struct stat st;
+		bool ok = fstat(fd, &st) == 0;
+		size_t length = ok ? st.st_size : 0;
+		void * mem = length ? mmap(nullptr, length, shared ? PROT_READ : PROT_READ | PROT_WRITE,
+					   shared ? MAP_SHARED : MAP_PRIVATE, fd, 0) : MAP_FAILED;
+		close(fd);
+		throw_assert(ok && length > 0, "Couldn't read " << filename << ", or it's empty.");
+		throw_assert(mem != MAP_FAILED, "Couldn't map " << filename << ": " << strerror(errno));
+		std::shared_ptr<void> mapping(mem, [length](void * m) { munmap(m, length); });
+
+		reader_t r{(const char*)mem, length, 0, filename};
+		char file_magic[magic_size];
+		r.read(file_magic, sizeof(file_magic));
+		throw_assert(memcmp(file_magic, magic(), magic_size) == 0, filename << " isn't a weight file.");
+		uint32_t file_version = r.get<uint32_t>();
+		throw_assert(file_version == version, "Reloading from old weight file version is not supported.  Current version: " << uint32_t(version) << ";  file version: " << file_version);
+		uint32_t layer_count = r.get<uint32_t>();
+		throw_assert(layer_count == model.layers.size(), filename << " has " << layer_count << " layers, but the model has " << model.layers.size());
+
+		// Check everything before we change anything.
+		std::vector<std::pair<tensor_t<double>*, const tensor_record_t>> loads;
+		for (auto l: model.layers) {
+			std::string spec = r.get_string();
+			tdsize in = r.get<tdsize>();
+			tdsize out = r.get<tdsize>();
+			bool frozen = r.get<uint32_t>();
+			throw_assert(spec == l->spec_str() && same_shape(in, l->in.size) && same_shape(out, l->out.size),
+				     "Layer mismatch loading " << filename << ".  File: " << spec << " " << in << " -> " << out
+				     << "; model: " << l->spec_str() << " " << l->in.size << " -> " << l->out.size);
+			throw_assert(frozen == l->frozen, "Loading " << (frozen ? "frozen" : "unfrozen") << " weights into " << (l->frozen ? "a frozen " : "an unfrozen ") << l->spec_str());
+			std::vector<tensor_t<double>*> params = l->parameter_tensors();
+			uint32_t count = r.get<uint32_t>();
+			throw_assert(count == params.size(), filename << " has " << count << " parameter tensors for " << spec << ", but the model has " << params.size());
+			for (auto t: params) {
+				tensor_record_t rec = r.get<tensor_record_t>();
+				throw_assert(rec.size == t->size, "Parameter size mismatch in " << spec << ".  File: " << rec.size << "; model: " << t->size);
+				throw_assert(rec.offset % alignment == 0 && rec.offset + t->calculate_data_size() <= length, filename << " is corrupt.");
+				loads.push_back({t, rec});
+			}
+		}
+
+		for (auto & l: loads) {
+			double * data = (double*)((char*)mem + l.second.offset);
+			if (mode == load_mode::copied) {
+				if (l.first->is_released()) {
+					*l.first = tensor_t<double>(l.second.size);
+				}
+				memcpy(l.first->data, data, l.first->calculate_data_size());
+			} else {
+				l.first->view(data, l.second.size);
+			}
+		}
+		if (mode != load_mode::copied) {
+			model.mapped_weights = mapping;
+		}
+		// Anything finalize() built might have the old pointers.
+		model.finalized = false;
+	}
+
+	// A function rather than an array, so using it doesn't need
+	// an out-of-line definition before C++17.
+	static const char * magic() { return "CNNWGHT"; }
+	static constexpr size_t magic_size = 8; // Including the '\0'.
+
+	struct tensor_record_t {
+		tdsize size;
+		uint64_t offset;
+	};
+
+	// The header, with the first tensor at `start`.  The tensors
+	// go in `blobs`, in file order.
+	static std::string build_header(const model_t & model, uint64_t start, std::vector<const tensor_t<double>*> & blobs) {
+		std::string header;
+		append(header, magic(), magic_size);
+		append(header, uint32_t(version));
+		append(header, (uint32_t)model.layers.size());
+		uint64_t offset = start;
+		for (const layer_t * l: model.layers) {
+			append(header, l->spec_str());
+			append(header, l->in.size);
+			append(header, l->out.size);
+			append(header, (uint32_t)l->frozen);
+			std::vector<const tensor_t<double>*> params = l->parameter_tensors();
+			append(header, (uint32_t)params.size());
+			for (auto t: params) {
+				throw_assert(!t->is_released(), "Can't save released parameters of " << l->spec_str());
+				append(header, tensor_record_t{t->size, offset});
+				offset = round_up(offset + t->calculate_data_size());
+				blobs.push_back(t);
+			}
+		}
+		return header;
+	}
+
+	static uint64_t round_up(uint64_t n) {
+		return (n + alignment - 1) / alignment * alignment;
+	}
+
+	static bool same_shape(const tdsize & a, const tdsize & b) {
+		return a.x == b.x && a.y == b.y && a.z == b.z;
+	}
+
+	static void append(std::string & s, const void * p, size_t n) {
+		s.append((const char*)p, n);
+	}
+
+	template<class T>
+	static void append(std::string & s, const T & v) {
+		append(s, &v, sizeof(v));
+	}
+
+	static void append(std::string & s, const std::string & v) {
+		append(s, (uint32_t)v.size());
+		s += v;
+	}
+
+	static bool write_all(int fd, const void * p, size_t n) {
+		const char * c = (const char*)p;
+		while (n > 0) {
+			ssize_t w = ::write(fd, c, n);
+			if (w < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				return false;
+			}
+			c += w;
+			n -= w;
+		}
+		return true;
+	}
+
+	static bool pad(int fd, uint64_t & position, uint64_t to) {
+		static const char zeros[alignment] = {};
+		bool ok = write_all(fd, zeros, to - position);
+		position = to;
+		return ok;
+	}
+
+	struct reader_t {
+		const char * base;
+		size_t length;
+		size_t cursor;
+		const std::string & filename;
+
+		void read(void * p, size_t n) {
+			throw_assert(cursor + n <= length, filename << " is truncated.");
+			memcpy(p, base + cursor, n);
+			cursor += n;
+		}
+
+		template<class T>
+		T get() {
+			T v;
+			read(&v, sizeof(v));
+			return v;
+		}
+
+		std::string get_string() {
+			uint32_t n = get<uint32_t>();
+			throw_assert(cursor + n <= length, filename << " is truncated.");
+			std::string s(base + cursor, n);
+			cursor += n;
+			return s;
+		}
+	};
+};
+
+#ifdef INCLUDE_TESTS
+namespace CNNTest {
+
+	TEST_F(CNNTest, weight_file) {
+		auto build = [](std::vector<std::unique_ptr<layer_t>> & owned, int batch) {
+			owned.emplace_back(new conv_layer_t( 1, 3, 4, 0, tdsize(10,10,1,batch) ));
+			owned.emplace_back(new relu_layer_t( owned.back()->out.size ));
+			owned.emplace_back(new pool_layer_t( 2, 2, 0, owned.back()->out.size ));
+			owned.emplace_back(new fc_layer_t( owned.back()->out.size, 6 ));
+			model_t * m = new model_t;
+			for (auto & l: owned) {
+				m->add_layer(*l);
+			}
+			return m;
+		};
+		srand(5);
+		std::vector<std::unique_ptr<layer_t>> a_layers, b_layers, c_layers;
+		std::unique_ptr<model_t> a(build(a_layers, 1));
+		tensor_t<double> in(10,10,1,1), label(6,1,1,1);
+		randomize(in);
+		label(2,0,0) = 1;
+		for (int i = 0; i < 5; i++) {
+			a->train(in, label);
+		}
+		weight_file_t::save(*a, DEBUG_OUTPUT "model.weights");
+
+		// Different random weights until we load.
+		std::unique_ptr<model_t> b(build(b_layers, 1));
+		tensor_t<double> expected = a->apply(in);
+		EXPECT_NE(b->apply(in), expected);
+		weight_file_t::load(*b, DEBUG_OUTPUT "model.weights");
+		EXPECT_EQ(b->apply(in), expected);
+		EXPECT_TRUE(b->mapped_weights != nullptr);
+		auto & w = static_cast<fc_layer_t*>(b_layers[3].get())->weights;
+		EXPECT_TRUE(w.is_view());
+		EXPECT_EQ((uintptr_t)w.data % weight_file_t::alignment, 0u);
+
+		// Training a loaded model leaves the file alone.
+		b->train(in, label);
+		std::unique_ptr<model_t> c(build(c_layers, 1));
+		weight_file_t::load(*c, DEBUG_OUTPUT "model.weights", weight_file_t::load_mode::copied);
+		EXPECT_FALSE(c->mapped_weights);
+		EXPECT_EQ(c->apply(in), expected);
+
+		// Frozen weights round trip too, but only between frozen
+		// models.
+		a->freeze();
+		weight_file_t::save(*a, DEBUG_OUTPUT "frozen.weights");
+		EXPECT_ANY_THROW(weight_file_t::load(*c, DEBUG_OUTPUT "frozen.weights"));
+		c->freeze();
+		weight_file_t::load(*c, DEBUG_OUTPUT "frozen.weights");
+		EXPECT_EQ(c->apply(in), expected);
+
+		// The wrong model.
+		std::vector<std::unique_ptr<layer_t>> d_layers;
+		d_layers.emplace_back(new fc_layer_t( tdsize(10,10,1,1), 6 ));
+		model_t d;
+		d.add_layer(*d_layers.back());
+		EXPECT_ANY_THROW(weight_file_t::load(d, DEBUG_OUTPUT "model.weights"));
+		EXPECT_ANY_THROW(weight_file_t::load(d, DEBUG_OUTPUT "missing.weights"));
+	}
+
+	TEST_F(CNNTest, weight_file_unloaded) {
+		std::vector<std::unique_ptr<layer_t>> owned;
+		auto build = [&]() {
+			owned.emplace_back(new conv_layer_t( 1, 3, 4, 0, tdsize(10,10,1,1) ));
+			owned.emplace_back(new relu_layer_t( owned.back()->out.size ));
+			owned.emplace_back(new fc_layer_t( owned.back()->out.size, 6 ));
+			model_t * m = new model_t;
+			for (auto i = owned.end() - 3; i != owned.end(); i++) {
+				m->add_layer(**i);
+			}
+			return m;
+		};
+		srand(11);
+		std::unique_ptr<model_t> a(build());
+		tensor_t<double> in(10,10,1,1);
+		randomize(in);
+		tensor_t<double> expected = a->apply(in);
+		weight_file_t::save(*a, DEBUG_OUTPUT "unloaded.weights");
+		std::unique_ptr<model_t> frozen(build());
+		weight_file_t::load(*frozen, DEBUG_OUTPUT "unloaded.weights");
+		frozen->freeze();
+		weight_file_t::save(*frozen, DEBUG_OUTPUT "unloaded_frozen.weights");
+
+		std::unique_ptr<model_t> b, c, d;
+		srand(12);
+		{
+			layer_t::unloaded_parameters_t unloaded;
+			b.reset(build());
+			c.reset(build());
+			d.reset(build());
+		}
+		// No rand() calls, and no memory for the weights.
+		int next = rand();
+		srand(12);
+		EXPECT_EQ(next, rand());
+		auto fc = [&](int model) { return static_cast<fc_layer_t*>(owned[3 * model + 2].get()); };
+		auto conv = [&](int model) { return static_cast<conv_layer_t*>(owned[3 * model].get()); };
+		EXPECT_TRUE(fc(2)->weights.is_released());
+		EXPECT_TRUE(conv(2)->filters[0].is_released());
+		EXPECT_THROW(b->apply(in), AssertionFailureException);
+		EXPECT_THROW(weight_file_t::save(*b, DEBUG_OUTPUT "never.weights"), AssertionFailureException);
+
+		weight_file_t::load(*b, DEBUG_OUTPUT "unloaded.weights");
+		EXPECT_EQ(b->apply(in), expected);
+		weight_file_t::load(*c, DEBUG_OUTPUT "unloaded.weights", weight_file_t::load_mode::copied);
+		EXPECT_FALSE(fc(3)->weights.is_view());
+		EXPECT_EQ(c->apply(in), expected);
+		d->freeze();
+		EXPECT_TRUE(fc(4)->packed_weights.is_released());
+		weight_file_t::load(*d, DEBUG_OUTPUT "unloaded_frozen.weights");
+		EXPECT_EQ(d->apply(in), expected);
+
+		// Only inside the scope.
+		std::unique_ptr<model_t> e(build());
+		EXPECT_FALSE(fc(5)->weights.is_released());
+	}
+
+	TEST_F(CNNTest, weight_file_shared) {
+		std::vector<std::unique_ptr<layer_t>> owned;
+		auto build = [&]() {
+			owned.emplace_back(new conv_layer_t( 1, 3, 4, 0, tdsize(10,10,1,1) ));
+			owned.emplace_back(new relu_layer_t( owned.back()->out.size ));
+			owned.emplace_back(new fc_layer_t( owned.back()->out.size, 6 ));
+			model_t * m = new model_t;
+			for (auto i = owned.end() - 3; i != owned.end(); i++) {
+				m->add_layer(**i);
+			}
+			return m;
+		};
+		srand(9);
+		std::unique_ptr<model_t> a(build());
+		a->freeze();
+		tensor_t<double> in(10,10,1,1);
+		randomize(in);
+		tensor_t<double> expected = a->apply(in);
+		const std::string name = "/canela-test-" + std::to_string(getpid());
+		weight_file_t::save_shared(*a, name);
+
+		// Only frozen models can share.
+		std::unique_ptr<model_t> unfrozen(build());
+		EXPECT_ANY_THROW(weight_file_t::load_shared(*unfrozen, name));
+
+		std::unique_ptr<model_t> workers[2] = {std::unique_ptr<model_t>(build()), std::unique_ptr<model_t>(build())};
+		size_t before = 0;
+		for (auto & w: workers) {
+			w->freeze();
+			before = w->get_total_memory_size();
+			weight_file_t::load_shared(*w, name);
+			EXPECT_LT(w->get_total_memory_size(), before);
+			EXPECT_EQ(w->apply(in), expected);
+		}
+		weight_file_t::unlink_shared(name);
+		EXPECT_EQ(workers[0]->apply(in), expected);
+
+		// Both workers see the same pages, not copies: a change
+		// through a writable mapping of the file shows up in both.
+		const std::string file = DEBUG_OUTPUT "shared.weights";
+		weight_file_t::save(*a, file);
+		for (auto & w: workers) {
+			weight_file_t::load(*w, file, weight_file_t::load_mode::shared);
+		}
+		auto weights = [&](int w) -> tensor_t<double> & {
+			return static_cast<fc_layer_t*>(owned[3 * (w + 2) + 2].get())->packed_weights;
+		};
+		int fd = open(file.c_str(), O_RDWR);
+		ASSERT_GE(fd, 0);
+		size_t offset = (char*)weights(0).data - (char*)workers[0]->mapped_weights.get();
+		double changed = 12345;
+		ASSERT_EQ(pwrite(fd, &changed, sizeof(changed), offset), (ssize_t)sizeof(changed));
+		close(fd);
+		EXPECT_EQ(weights(0).data[0], changed);
+		EXPECT_EQ(weights(1).data[0], changed);
+	}
+
+	TEST_F(CNNTest, weight_file_resave) {
+		std::vector<std::unique_ptr<layer_t>> owned;
+		auto build = [&](int seed) {
+			srand(seed);
+			owned.emplace_back(new conv_layer_t( 1, 3, 4, 0, tdsize(10,10,1,1) ));
+			owned.emplace_back(new fc_layer_t( owned.back()->out.size, 6 ));
+			model_t * m = new model_t;
+			m->add_layer(*owned[owned.size() - 2]);
+			m->add_layer(*owned.back());
+			m->freeze();
+			return m;
+		};
+		std::unique_ptr<model_t> a(build(1)), b(build(2));
+		tensor_t<double> in(10,10,1,1);
+		randomize(in);
+		tensor_t<double> expected_a = a->apply(in);
+		tensor_t<double> expected_b = b->apply(in);
+		ASSERT_NE(expected_a, expected_b);
+
+		// Save over the file again and again while a model that
+		// shares it is running.  It keeps the weights it loaded.
+		const std::string file = DEBUG_OUTPUT "resave.weights";
+		weight_file_t::save(*a, file);
+		std::unique_ptr<model_t> running(build(3));
+		weight_file_t::load(*running, file, weight_file_t::load_mode::shared);
+		std::atomic<bool> stop(false);
+		std::atomic<int> runs(0);
+		int wrong = 0;
+		std::thread runner([&]() {
+				while (!stop) {
+					wrong += running->apply(in) != expected_a;
+					runs++;
+				}
+			});
+		while (runs == 0) {
+			std::this_thread::yield();
+		}
+		for (int i = 0; i < 20; i++) {
+			weight_file_t::save(i % 2 ? *b : *a, file);
+		}
+		int seen = runs;
+		while (runs < seen + 2) {
+			std::this_thread::yield();
+		}
+		stop = true;
+		runner.join();
+		EXPECT_EQ(wrong, 0);
+		std::unique_ptr<model_t> reloaded(build(4));
+		weight_file_t::load(*reloaded, file, weight_file_t::load_mode::shared);
+		EXPECT_EQ(reloaded->apply(in), expected_b);
+
+		// Shared memory segments aren't replaced.
+		const std::string name = "/canela-resave-" + std::to_string(getpid());
+		weight_file_t::save_shared(*a, name);
+		std::unique_ptr<model_t> first(build(5));
+		weight_file_t::load_shared(*first, name);
+		EXPECT_THROW(weight_file_t::save_shared(*b, name), AssertionFailureException);
+		weight_file_t::unlink_shared(name);
+		weight_file_t::save_shared(*b, name);
+		std::unique_ptr<model_t> second(build(6));
+		weight_file_t::load_shared(*second, name);
+		weight_file_t::unlink_shared(name);
+		EXPECT_EQ(first->apply(in), expected_a);
+		EXPECT_EQ(second->apply(in), expected_b);
+	}
+}
+#endif
@@ -0,0 +1,45 @@
+#include <iostream>
+#define EXCLUDE_MAIN
+#include "simple.cpp"
+
+// Run a few training steps of one of the models from simple.cpp
+// through the built-in cache simulator, and print what fraction of
+// each tensor's accesses each cache level served, by layer and phase.
+// The Makefile builds this with -DTRACE_TENSOR_ACCESSES, which it
+// needs.
+//
+//   cachesim.exe <model> <scale_factor> [steps] [L1 KB]
+
+int main(int argc, char*argv[]) {
+	throw_assert(argc >= 3, "Usage: cachesim.exe <model> <scale_factor> [steps] [L1 KB]");
+#ifndef TRACE_TENSOR_ACCESSES
+	std::cerr << "Warning: built without -DTRACE_TENSOR_ACCESSES, so there's nothing to trace.\n";
+#endif
+	std::string model_name = argv[1];
+	int scale_factor = atoi(argv[2]);
+	int steps = argc > 3 ? atoi(argv[3]) : 4;
+
+	std::vector<cache_sim_t::level_config_t> config = cache_sim_t::default_config();
+	if (argc > 4) {
+		config[0].size = atoi(argv[4]) << 10;
+	}
+
+	dataset_t train = dataset_t::read(std::string(std::getenv("CANELA_ROOT")) + "/datasets/mnist/mnist-train.dataset", 200 * scale_factor);
+	model_t * model = build_model(model_name, train);
+	std::cout << model->geometry() << "\n";
+
+	// One untraced step, so the trace doesn't include setup.
+	model->train(train.test_cases[0]);
+	model->label_tensors();
+
+	cache_sim_t cache(config);
+	access_trace_t::start(&cache);
+	for (int i = 0; i < steps; i++) {
+		model->train(train.test_cases[(i + 1) % train.size()]);
+	}
+	access_trace_t::stop();
+
+	std::cout << cache.report() << "\n";
+	std::cout << access_trace_t::report();
+	return 0;
+}
@@ -0,0 +1,61 @@
+#include <iostream>
+#include <chrono>
+#define EXCLUDE_MAIN
+#include "simple.cpp"
+
+// Compare serial model_t::train() with lock-free, Hogwild-style
+// training (hogwild_trainer_t) on one of the small models from
+// simple.cpp.
+//
+//   hogwild.exe <perceptron|two_layer> <scale_factor> <threads> [epochs]
+
+static double accuracy(model_t & model, dataset_t & test) {
+	model.set_training(false);
+	int correct = 0;
+	for (test_case_t & t : test) {
+		correct += model.apply(t.data).argmax() == t.label.argmax();
+	}
+	model.set_training(true);
+	return (correct + 0.0) / test.size();
+}
+
+int main(int argc, char*argv[]) {
+	throw_assert(argc >= 4, "Usage: hogwild.exe <perceptron|two_layer> <scale_factor> <threads> [epochs]");
+	std::string model_name = argv[1];
+	throw_assert(model_name == "perceptron" || model_name == "two_layer", "Hogwild is meant for the small fc models.");
+	int scale_factor = atoi(argv[2]);
+	int threads = atoi(argv[3]);
+	int epochs = argc > 4 ? atoi(argv[4]) : 1;
+
+	dataset_t train = dataset_t::read(std::string(std::getenv("CANELA_ROOT")) + "/datasets/mnist/mnist-train.dataset", 200 * scale_factor);
+	dataset_t test = dataset_t::read(std::string(std::getenv("CANELA_ROOT")) + "/datasets/mnist/mnist-test.dataset", 200 * scale_factor);
+
+	// Same initial weights for both runs.
+	srand(1);
+	model_t * serial = build_model(model_name, train);
+	srand(1);
+	model_t * hogwild = build_model(model_name, train);
+	hogwild_trainer_t trainer(*hogwild, threads);
+
+	std::cout << "epoch,mode,threads,seconds,cases_per_second,accuracy\n";
+	for (int e = 0; e < epochs; e++) {
+		auto start = std::chrono::steady_clock::now();
+		for (test_case_t & t : train) {
+			serial->train(t);
+		}
+		std::chrono::duration<double> serial_time = std::chrono::steady_clock::now() - start;
+
+		start = std::chrono::steady_clock::now();
+		auto it = train.begin();
+		trainer.train(train, it, train.size());
+		std::chrono::duration<double> hogwild_time = std::chrono::steady_clock::now() - start;
+
+		std::cout << e << ",serial,1," << serial_time.count() << ","
+			  << train.size() / serial_time.count() << ","
+			  << accuracy(*serial, test) << "\n";
+		std::cout << e << ",hogwild," << threads << "," << hogwild_time.count() << ","
+			  << train.size() / hogwild_time.count() << ","
+			  << accuracy(*hogwild, test) << "\n";
+	}
+	return 0;
+}
@@ -0,0 +1,52 @@
+#include <iostream>
+#include <chrono>
+#define EXCLUDE_MAIN
+#include "simple.cpp"
+
+// Stream MNIST test images through one of the models from simple.cpp,
+// first with model_t::apply() and then with a pipeline_t, and report
+// throughput and how busy each pipeline stage was.  If you give it a
+// trace file, it also writes a timeline of the pipelined run that you
+// can load in chrome://tracing or ui.perfetto.dev.
+//
+//   pipeline.exe <model> <scale_factor> <stages> [queue_capacity] [trace.json]
+
+int main(int argc, char*argv[]) {
+	throw_assert(argc >= 4, "Usage: pipeline.exe <model> <scale_factor> <stages> [queue_capacity] [trace.json]");
+	std::string model_name = argv[1];
+	int scale_factor = atoi(argv[2]);
+	int stage_count = atoi(argv[3]);
+	int capacity = argc > 4 ? atoi(argv[4]) : 4;
+
+	dataset_t test = dataset_t::read(std::string(std::getenv("CANELA_ROOT")) + "/datasets/mnist/mnist-test.dataset", 200 * scale_factor);
+	model_t * model = build_model(model_name, test);
+	model->set_training(false);
+	std::cout << model->geometry() << "\n";
+
+	std::vector<tensor_t<double>> frames;
+	for (test_case_t & t : test) {
+		frames.push_back(t.data);
+	}
+
+	std::vector<tensor_t<double>> serial_out;
+	auto start = std::chrono::steady_clock::now();
+	for (auto & f : frames) {
+		serial_out.push_back(model->apply(f));
+	}
+	std::chrono::duration<double> serial_time = std::chrono::steady_clock::now() - start;
+
+	pipeline_t pipeline(*model, stage_count, frames[0], capacity);
+	std::vector<tensor_t<double>> pipelined_out;
+	tracer_t::enable(argc > 5);
+	pipeline.run(frames, pipelined_out);
+	tracer_t::enable(false);
+	if (argc > 5) {
+		tracer_t::write(argv[5]);
+	}
+	throw_assert(pipelined_out == serial_out, "Pipelined outputs don't match.");
+
+	std::cout << "Serial   : " << frames.size() / serial_time.count() << " frames/s\n";
+	std::cout << "Pipelined: " << frames.size() / pipeline.last_run_seconds << " frames/s\n";
+	std::cout << pipeline.report();
+	return 0;
+}
@@ -0,0 +1,39 @@
+#include <iostream>
+#define EXCLUDE_MAIN
+#include "simple.cpp"
+
+// Train one of the models from simple.cpp on MNIST with a profiler
+// (and hardware counters, if the machine allows them) attached,
+// measure the machine, and show where each layer sits on the
+// roofline.
+//
+//   roofline.exe <model> <scale_factor> [profile.csv]
+
+int main(int argc, char*argv[]) {
+	throw_assert(argc >= 3, "Usage: roofline.exe <model> <scale_factor> [profile.csv]");
+	std::string model_name = argv[1];
+	int scale_factor = atoi(argv[2]);
+
+	dataset_t train = dataset_t::read(std::string(std::getenv("CANELA_ROOT")) + "/datasets/mnist/mnist-train.dataset", 200 * scale_factor);
+	model_t * model = build_model(model_name, train);
+	std::cout << model->geometry() << "\n";
+
+	profiler_t profiler;
+	perf_counters_t counters;
+	std::cout << counters.status() << "\n";
+	profiler.set_counters(&counters);
+	model->set_profiler(&profiler);
+	for (test_case_t & t : train) {
+		model->train(t);
+	}
+	// Again, now that we know whether they actually counted.
+	std::cout << counters.status() << "\n";
+
+	roofline_t machine = roofline_t::measure();
+	std::cout << machine.report(profiler);
+	if (argc > 3) {
+		std::ofstream out(argv[3]);
+		out << profiler.csv();
+	}
+	return 0;
+}
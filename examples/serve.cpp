@@ -0,0 +1,51 @@
+#include <iostream>
+#include <chrono>
+#include <thread>
+#define EXCLUDE_MAIN
+#include "simple.cpp"
+
+// A local load generator for batching_server_t: `clients` threads
+// each send MNIST test images one at a time to a server running one
+// of the models from simple.cpp, batched `batch` wide, and wait for
+// each answer before sending the next.  Prints throughput, accuracy,
+// and the server's metrics.
+//
+//   serve.exe <model> <scale_factor> <batch> <clients> [max_wait_us]
+
+int main(int argc, char*argv[]) {
+	throw_assert(argc >= 5, "Usage: serve.exe <model> <scale_factor> <batch> <clients> [max_wait_us]");
+	std::string model_name = argv[1];
+	int scale_factor = atoi(argv[2]);
+	int batch = atoi(argv[3]);
+	int clients = atoi(argv[4]);
+	int max_wait = argc > 5 ? atoi(argv[5]) : 1000;
+
+	dataset_t test = dataset_t::read(std::string(std::getenv("CANELA_ROOT")) + "/datasets/mnist/mnist-test.dataset", 200 * scale_factor);
+	model_t * model = build_model(model_name, test.batched_copy(batch));
+	model->freeze();
+
+	std::vector<int> correct(clients, 0);
+	auto start = std::chrono::steady_clock::now();
+	batching_server_t server(*model, std::chrono::microseconds(max_wait));
+	std::vector<std::thread> threads;
+	for (int c = 0; c < clients; c++) {
+		threads.emplace_back([&, c]() {
+				for (uint i = c; i < test.size(); i += clients) {
+					tensor_t<double> out = server.submit(test.test_cases[i].data).get();
+					correct[c] += out.argmax() == test.test_cases[i].label.argmax();
+				}
+			});
+	}
+	for (auto & t: threads) {
+		t.join();
+	}
+	std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
+
+	int total = 0;
+	for (auto c: correct) {
+		total += c;
+	}
+	std::cout << test.size() / seconds.count() << " requests/s, accuracy " << (total + 0.0) / test.size() << "\n";
+	std::cout << server.report();
+	return 0;
+}
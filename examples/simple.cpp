@@ -93,6 +93,23 @@ model_t * build_cache_1(const dataset_t & ds)  {
 	return model;
 }
 
+model_t * build_model(const std::string &model_name, const dataset_t & ds) {
+	if (model_name == "perceptron") {
+		return build_perceptron(ds);
+	} else if (model_name == "two_layer") { 
+		return build_two_layer(ds);
+	} else if (model_name == "conv") {
+		return build_conv(ds);
+	} else if (model_name == "mid") {
+		return build_mid(ds);
+	} else if (model_name == "cache-1") {
+		return build_cache_1(ds);
+	} else if (model_name == "deep") {
+		return build_deep(ds);
+	}
+	throw_assert(false, "Illegal model name: " << model_name << "\n");
+}
+
 double simple(const std::string &model_name, const std::string & ds, int scale_factor) 
 {
 	
@@ -119,23 +136,8 @@ double simple(const std::string &model_name, const std::string & ds, int scale_f
 	}
 	       
 
-	model_t * model = nullptr;
-	
-	if (model_name == "perceptron") {
-		model = build_perceptron(*train);
-	} else if (model_name == "two_layer") { 
-		model = build_two_layer(*train);
-	} else if (model_name == "conv") {
-		model = build_conv(*train);
-	} else if (model_name == "mid") {
-		model = build_mid(*train);
-	} else if (model_name == "cache-1") {
-		model = build_cache_1(*train);
-	} else if (model_name == "deep") {
-		model = build_deep(*train);
-	} else {
-		throw_assert(false, "Illegal model name: " << model_name << "\n");
-	}
+	model_t * model = build_model(model_name, *train);
+	model->enable_memory_planning = true;
 
 
 	std::cout << model->geometry() << "\n";
@@ -152,22 +154,13 @@ double simple(const std::string &model_name, const std::string & ds, int scale_f
 		model->train(t);
 	}
 	
+	model->set_training(false);
 
-	int correct  = 0, incorrect = 0;
-	for ( test_case_t& t : *test ) {
-		tensor_t<double>& out = model->apply(t.data);
-		
-		tdsize guess = out.argmax();
-	        tdsize answer = t.label.argmax();
-		if (guess == answer) {
-			correct++;
-		} else {
-			incorrect++;
-		}
-	}
-
-	double total_error = (correct+0.0)/(correct+ incorrect +0.0);
-	std::cout << "Accuracy: " << total_error << ": " << correct << "/" << correct + incorrect << "\n";
+	// Evaluate in batches, on every core.
+	evaluator_t evaluator(*model, std::thread::hardware_concurrency());
+	evaluator_t::result_t result = evaluator.evaluate(*test);
+	std::cout << result.report();
+	double total_error = result.accuracy();
 	return total_error;
 }
 